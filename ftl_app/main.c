@@ -425,9 +425,9 @@ static void *ftl_status_thread(void *data)
     {
       ftl_packet_stats_msg_t *p = &status.msg.pkt_stats;
 
-      printf("Avg packet send per second %3.1f, total nack requests %d\n",
+      printf("Avg packet send per second %3.1f, total nack requests %d (%d expired)\n",
              (float)p->sent * 1000.f / p->period,
-             p->nack_reqs);
+             (int)p->nack_reqs, (int)p->expired);
     }
   else if (status.type == FTL_STATUS_VIDEO_PACKETS_INSTANT)
   {
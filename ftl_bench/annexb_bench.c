@@ -0,0 +1,126 @@
+#define __FTL_INTERNAL
+#include "ftl.h"
+#include "ftl_private.h"
+
+#include <time.h>
+
+// Splits a synthetic Annex B stream into NALs with annexb_next_nal() once
+// per start code scanner and reports each one's throughput.
+//
+// usage: ftl_annexb_bench [megabytes] [nal_bytes] [rounds]
+
+static const struct {
+  annexb_scanner_t scanner;
+  const char *name;
+} scanners[] = {
+  { ANNEXB_SCAN_SCALAR, "scalar" },
+  { ANNEXB_SCAN_SSE2, "sse2" },
+  { ANNEXB_SCAN_AVX2, "avx2" },
+};
+
+static int64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// NALs of nal_bytes behind alternating 4 and 3 byte start codes. The payload
+// is random with the emulation prevention an encoder adds, so zero bytes
+// show up but never a start code.
+static int fill_stream(uint8_t *buf, int len, int nal_bytes) {
+  uint32_t x = 2463534242u;
+  int nals = 0;
+  int i = 0;
+  int j;
+
+  while (len - i > nal_bytes + 4) {
+    if (nals % 2 == 0) {
+      buf[i++] = 0;
+    }
+    buf[i++] = 0;
+    buf[i++] = 0;
+    buf[i++] = 1;
+    buf[i++] = 0x41;
+
+    for (j = 1; j < nal_bytes; j++, i++) {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      buf[i] = (x & 0x700) ? (uint8_t)x : 0;
+
+      if (buf[i] <= 3 && buf[i - 1] == 0 && buf[i - 2] == 0) {
+        buf[i] = 3;
+      }
+    }
+
+    // A NAL can't end in a zero byte.
+    if (buf[i - 1] == 0) {
+      buf[i - 1] = 0x80;
+    }
+    nals++;
+  }
+
+  return i;
+}
+
+int main(int argc, char **argv) {
+  int megabytes = (argc > 1) ? atoi(argv[1]) : 32;
+  int nal_bytes = (argc > 2) ? atoi(argv[2]) : 1400;
+  int rounds = (argc > 3) ? atoi(argv[3]) : 10;
+  int expected = -1;
+  uint8_t *buf;
+  int len;
+  int i, r;
+
+  if (megabytes <= 0 || megabytes > 1024 || nal_bytes < 2 || rounds <= 0) {
+    fprintf(stderr, "usage: %s [megabytes] [nal_bytes] [rounds]\n", argv[0]);
+    return 1;
+  }
+
+  if ((buf = malloc((size_t)megabytes << 20)) == NULL) {
+    return 1;
+  }
+
+  len = fill_stream(buf, megabytes << 20, nal_bytes);
+
+  printf("%d MB of %d byte NALs, %d rounds\n", megabytes, nal_bytes, rounds);
+
+  for (i = 0; i < (int)(sizeof(scanners) / sizeof(scanners[0])); i++) {
+    int64_t start;
+    int64_t elapsed;
+    int nals = 0;
+
+    if (!annexb_set_scanner(scanners[i].scanner)) {
+      printf("%-8s not available\n", scanners[i].name);
+      continue;
+    }
+
+    start = now_ns();
+    for (r = 0; r < rounds; r++) {
+      const uint8_t *pos = buf;
+      const uint8_t *nal;
+      int32_t nal_len;
+
+      nals = 0;
+      while (annexb_next_nal(&pos, buf + len, &nal, &nal_len)) {
+        nals++;
+      }
+    }
+    elapsed = now_ns() - start;
+
+    printf("%-8s %8.2f GB/s %8.1f ns/NAL  %d NALs\n", scanners[i].name,
+      (double)len * rounds / elapsed, (double)elapsed / rounds / nals, nals);
+
+    if (expected >= 0 && nals != expected) {
+      printf("%-8s found %d NALs, expected %d\n", scanners[i].name, nals, expected);
+      free(buf);
+      return 1;
+    }
+    expected = nals;
+  }
+
+  annexb_init();
+  free(buf);
+
+  return 0;
+}
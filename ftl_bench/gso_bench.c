@@ -0,0 +1,166 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "socket.h"
+
+// Sends the same packets to a UDP socket on the loopback interface one per
+// call, in sendmmsg() batches and as UDP GSO super-buffers through the
+// send_socket_* calls the video send thread uses, and reports the sender's
+// CPU time per packet for each.
+//
+// usage: ftl_gso_bench [packets] [packet_bytes] [batch]
+
+#define MAX_BATCH 64 //MAX_SEND_BATCH_PKTS
+#define MAX_GSO_BYTES 65000
+#define MAX_PACKET_BYTES 1500
+
+typedef struct {
+  int sock;
+  volatile int stop;
+  volatile int64_t packets;
+} receiver_t;
+
+static void *receive_thread(void *data) {
+  receiver_t *receiver = data;
+  uint8_t buf[65536];
+
+  while (!receiver->stop) {
+    if (recv(receiver->sock, buf, sizeof(buf), 0) > 0) {
+      receiver->packets++;
+    }
+  }
+
+  return NULL;
+}
+
+static int64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// mode 0 sends one packet per call, 1 uses sendmmsg() and 2 UDP GSO.
+static void run(const char *name, int mode, int sock, receiver_t *receiver, const struct sockaddr_in *addr, socket_packet_t *pkts, int total, int batch) {
+  int64_t received = receiver->packets;
+  int64_t cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  int64_t wall_ns = clock_ns(CLOCK_MONOTONIC);
+  int calls = 0;
+  int sent = 0;
+  int errors = 0;
+  int n, ret;
+
+  while (sent < total) {
+    n = (mode == 0) ? 1 : batch;
+    if (n > total - sent) {
+      n = total - sent;
+    }
+
+    if (mode == 2) {
+      ret = send_socket_gso(sock, pkts, n, pkts[0].len, (const struct sockaddr *)addr, sizeof(*addr));
+    }
+    else {
+      ret = send_socket_batch(sock, pkts, n, (const struct sockaddr *)addr, sizeof(*addr));
+    }
+
+    calls++;
+    if (ret <= 0) {
+      if (++errors > 100) {
+        printf("%-10s send failed\n", name);
+        return;
+      }
+      continue;
+    }
+    sent += ret;
+  }
+
+  cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_ns;
+  wall_ns = clock_ns(CLOCK_MONOTONIC) - wall_ns;
+
+  // Let the receiver catch up before counting.
+  usleep(200 * 1000);
+
+  printf("%-10s %8d calls %8.0f ns cpu/pkt %8.0f ns wall/pkt %9.0f Mbps  %5.1f%% received\n",
+    name, calls, (double)cpu_ns / total, (double)wall_ns / total,
+    (double)total * pkts[0].len * 8 * 1000 / wall_ns,
+    100.0 * (receiver->packets - received) / total);
+}
+
+int main(int argc, char **argv) {
+  int total = (argc > 1) ? atoi(argv[1]) : 200000;
+  int packet_bytes = (argc > 2) ? atoi(argv[2]) : 1392;
+  int batch = (argc > 3) ? atoi(argv[3]) : 32;
+  static uint8_t bufs[MAX_BATCH][MAX_PACKET_BYTES];
+  socket_packet_t pkts[MAX_BATCH];
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  receiver_t receiver;
+  pthread_t thread;
+  struct timeval timeout = { 0, 100 * 1000 };
+  int rcvbuf = 32 << 20;
+  int sock;
+  int i;
+
+  if (total <= 0 || packet_bytes < 12 || packet_bytes > MAX_PACKET_BYTES || batch < 1 || batch > MAX_BATCH) {
+    fprintf(stderr, "usage: %s [packets] [packet_bytes 12-%d] [batch 1-%d]\n", argv[0], MAX_PACKET_BYTES, MAX_BATCH);
+    return 1;
+  }
+
+  // A GSO super-buffer has to fit in one datagram.
+  if (batch * packet_bytes > MAX_GSO_BYTES) {
+    batch = MAX_GSO_BYTES / packet_bytes;
+  }
+
+  memset(&receiver, 0, sizeof(receiver));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  receiver.sock = socket(AF_INET, SOCK_DGRAM, 0);
+  setsockopt(receiver.sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  setsockopt(receiver.sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  if (bind(receiver.sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      getsockname(receiver.sock, (struct sockaddr *)&addr, &addrlen) != 0) {
+    perror("bind");
+    return 1;
+  }
+
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  set_socket_send_buf(sock, 4 << 20);
+
+  for (i = 0; i < MAX_BATCH; i++) {
+    memset(bufs[i], i, packet_bytes);
+    pkts[i].buf = bufs[i];
+    pkts[i].len = packet_bytes;
+    pkts[i].ext = NULL;
+    pkts[i].ext_len = 0;
+    pkts[i].txtime_ns = 0;
+  }
+
+  pthread_create(&thread, NULL, receive_thread, &receiver);
+
+  printf("%d packets of %d bytes, batches of %d\n", total, packet_bytes, batch);
+
+  run("single", 0, sock, &receiver, &addr, pkts, total, batch);
+  run("sendmmsg", 1, sock, &receiver, &addr, pkts, total, batch);
+  if (get_socket_gso_supported(sock)) {
+    run("gso", 2, sock, &receiver, &addr, pkts, total, batch);
+  }
+  else {
+    printf("gso        not supported by this kernel\n");
+  }
+
+  receiver.stop = 1;
+  pthread_join(thread, NULL);
+  close(sock);
+  close(receiver.sock);
+
+  return 0;
+}
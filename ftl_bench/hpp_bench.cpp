@@ -0,0 +1,199 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "ftl.hpp"
+
+extern "C" {
+#include "loopback_ingest.h"
+}
+
+// Streams P frames to the loopback ingest through ftl.hpp from a coroutine,
+// rotating between the wrapper's send calls and ftl_ingest_send_media_dts,
+// and reports the time each takes per call. Fails if an owned buffer isn't
+// released by the time the stream is destroyed.
+//
+// usage: ftl_hpp_bench [frames] [frame_bytes]
+
+#define PEAK_KBPS 20000
+#define FPS 30
+#define GOP_FRAMES 60
+#define MAX_FRAME_BYTES (1 << 20)
+
+using namespace std::chrono;
+
+namespace {
+
+enum method { wrapper, c_api, owned, owned_unique, methods };
+
+const char *method_names[methods] = { "send_video", "C", "owned", "owned unique_ptr" };
+
+struct timing {
+  double ns = 0;
+  int calls = 0;
+};
+
+std::atomic<int> owned_sent{ 0 };
+std::atomic<int> owned_released{ 0 };
+
+// Counts its release, moving leaves the vector empty.
+struct counted_buffer {
+  std::vector<uint8_t> bytes;
+
+  explicit counted_buffer(int len) : bytes(len, 0x45) { bytes[0] = 0x41; }
+  counted_buffer(counted_buffer &&) noexcept = default;
+  ~counted_buffer() {
+    if (!bytes.empty()) {
+      owned_released++;
+    }
+  }
+
+  uint8_t *begin() { return bytes.data(); }
+  uint8_t *end() { return bytes.data() + bytes.size(); }
+};
+
+// Starts right away, the future is ready once the coroutine returns.
+struct task {
+  struct promise_type {
+    std::promise<void> done;
+
+    task get_return_object() { return task{ done.get_future() }; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() { done.set_value(); }
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  std::future<void> done;
+};
+
+task stream_frames(ftl::Stream &stream, int frames, int frame_bytes, timing *timings, int *failed) {
+  auto connected = co_await stream.connect_async();
+  if (!connected) {
+    printf("FAIL: couldn't connect to the loopback ingest (%d)\n", connected.status);
+    *failed = 1;
+    co_return;
+  }
+
+  ftl::Session session = std::move(connected.value);
+  std::vector<uint8_t> frame(frame_bytes, 0x45);
+  uint8_t sps[21] = { 0x67 };
+  uint8_t pps[7] = { 0x68 };
+  auto start = steady_clock::now();
+  frame[0] = 0x41;
+
+  for (int f = 0; f < frames; f++) {
+    auto due = start + microseconds((int64_t)f * 1000000 / FPS);
+    ftl::timestamp dts = duration_cast<microseconds>(due - start);
+    auto m = (method)(f % methods);
+    int sent;
+
+    std::this_thread::sleep_until(due);
+
+    if (f % GOP_FRAMES == 0) {
+      frame[0] = 0x65;
+      session.send_video(sps, dts, false);
+      session.send_video(pps, dts, false);
+      session.send_video(frame, dts, true);
+      frame[0] = 0x41;
+      continue;
+    }
+
+    // Owned buffers are made before the clock restarts, only the send is timed.
+    auto t0 = steady_clock::now();
+    if (m == owned) {
+      counted_buffer buffer(frame_bytes);
+      owned_sent++;
+      t0 = steady_clock::now();
+      sent = session.send_video_owned(std::move(buffer), dts, true);
+    }
+    else if (m == owned_unique) {
+      std::unique_ptr<uint8_t[]> buffer(new uint8_t[frame_bytes]);
+      memcpy(buffer.get(), frame.data(), frame_bytes);
+      t0 = steady_clock::now();
+      sent = session.send_video_owned(std::move(buffer), frame_bytes, dts, true);
+    }
+    else if (m == wrapper) {
+      sent = session.send_video(frame, dts, true);
+    }
+    else {
+      sent = ftl_ingest_send_media_dts(stream.native_handle(), FTL_VIDEO_DATA, dts.count(), frame.data(), (int32_t)frame.size(), 1);
+    }
+    auto t1 = steady_clock::now();
+
+    if (sent > 0) {
+      timings[m].ns += duration<double, std::nano>(t1 - t0).count();
+      timings[m].calls++;
+    }
+
+    co_await session.drained();
+  }
+
+  auto status = co_await stream.next_status_async(milliseconds(100));
+  printf("next status %d\n", status.status);
+
+  session.disconnect();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int frames = (argc > 1) ? atoi(argv[1]) : 300;
+  int frame_bytes = (argc > 2) ? atoi(argv[2]) : PEAK_KBPS * 1000 / 8 / FPS / 2;
+  loopback_ingest_t ingest;
+  ftl_ingest_params_t params;
+  ftl_ingest_params_ex_t ex;
+  timing timings[methods];
+  int failed = 0;
+
+  if (frames <= 0 || frame_bytes < 2 || frame_bytes > MAX_FRAME_BYTES) {
+    fprintf(stderr, "usage: %s [frames] [frame_bytes]\n", argv[0]);
+    return 1;
+  }
+
+  if (loopback_ingest_start(&ingest, 0) != 0) {
+    return 1;
+  }
+
+  ftl_init();
+
+  loopback_ingest_params(&params, PEAK_KBPS);
+  memset(&ex, 0, sizeof(ex));
+  ex.fast_start = 1; //no audio
+
+  {
+    auto created = ftl::Stream::create(params, &ex, 300, 100);
+    if (!created) {
+      printf("FAIL: couldn't create the stream (%d)\n", created.status);
+      loopback_ingest_stop(&ingest);
+      return 1;
+    }
+
+    ftl::Stream stream = std::move(created.value);
+
+    printf("%d frames of %d bytes at %d fps\n", frames, frame_bytes, FPS);
+    stream_frames(stream, frames, frame_bytes, timings, &failed).done.wait();
+  }
+
+  loopback_ingest_settle(&ingest, 2000);
+
+  for (int m = 0; m < methods; m++) {
+    printf("%-18s %8.0f ns/call over %d calls\n", method_names[m], timings[m].calls ? timings[m].ns / timings[m].calls : 0.0, timings[m].calls);
+  }
+  printf("received %lld packets, %lld frames\n", (long long)ingest.packets, (long long)ingest.markers);
+
+  if (owned_released != owned_sent) {
+    printf("FAIL: %d of %d owned buffers released\n", owned_released.load(), owned_sent.load());
+    failed = 1;
+  }
+
+  loopback_ingest_stop(&ingest);
+
+  printf("%s\n", failed ? "FAIL" : "PASS");
+
+  return failed;
+}
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+
+#include "loopback_ingest.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define VIDEO_PAYLOAD_TYPE 96
+#define PING_PAYLOAD_TYPE 250
+#define SOCKET_POLL_MS 100
+
+static void *_control_thread(void *data);
+static void *_control_connection(void *data);
+static void *_media_thread(void *data);
+static int _bind_socket(int type, int port);
+
+int64_t loopback_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int loopback_ingest_start(loopback_ingest_t *ingest, int max_arrivals) {
+  memset(ingest, 0, sizeof(*ingest));
+  ingest->control_socket = -1;
+  ingest->media_socket = -1;
+
+  if (max_arrivals > 0) {
+    if ((ingest->arrivals = malloc(sizeof(loopback_arrival_t) * max_arrivals)) == NULL) {
+      return -1;
+    }
+    ingest->max_arrivals = max_arrivals;
+  }
+
+  if ((ingest->control_socket = _bind_socket(SOCK_STREAM, LOOPBACK_CONTROL_PORT)) < 0 ||
+      (ingest->media_socket = _bind_socket(SOCK_DGRAM, LOOPBACK_MEDIA_PORT)) < 0) {
+    fprintf(stderr, "loopback ingest: can't bind ports %d and %d\n", LOOPBACK_CONTROL_PORT, LOOPBACK_MEDIA_PORT);
+    loopback_ingest_stop(ingest);
+    return -1;
+  }
+
+  listen(ingest->control_socket, 4);
+
+  pthread_create(&ingest->control_thread, NULL, _control_thread, ingest);
+  pthread_create(&ingest->media_thread, NULL, _media_thread, ingest);
+
+  return 0;
+}
+
+void loopback_ingest_stop(loopback_ingest_t *ingest) {
+  int running = (ingest->control_socket >= 0 && ingest->media_socket >= 0);
+
+  ingest->stop = 1;
+
+  if (running) {
+    pthread_join(ingest->control_thread, NULL);
+    pthread_join(ingest->media_thread, NULL);
+  }
+
+  if (ingest->control_socket >= 0) {
+    close(ingest->control_socket);
+  }
+  if (ingest->media_socket >= 0) {
+    close(ingest->media_socket);
+  }
+  free(ingest->arrivals);
+
+  ingest->control_socket = -1;
+  ingest->media_socket = -1;
+  ingest->arrivals = NULL;
+}
+
+void loopback_ingest_settle(loopback_ingest_t *ingest, int timeout_ms) {
+  int64_t packets = -1;
+  int waited;
+
+  for (waited = 0; waited < timeout_ms && packets != ingest->packets; waited += 200) {
+    packets = ingest->packets;
+    usleep(200 * 1000);
+  }
+}
+
+void loopback_ingest_params(ftl_ingest_params_t *params, int peak_kbps) {
+  memset(params, 0, sizeof(*params));
+  params->stream_key = "1234-abcdef";
+  params->video_codec = FTL_VIDEO_H264;
+  params->audio_codec = FTL_AUDIO_OPUS;
+  params->ingest_hostname = "127.0.0.1";
+  params->fps_num = 30;
+  params->fps_den = 1;
+  params->peak_kbps = peak_kbps;
+  params->vendor_name = "ftl_bench";
+  params->vendor_version = "1";
+}
+
+static int _bind_socket(int type, int port) {
+  struct sockaddr_in addr;
+  struct timeval timeout = { 0, SOCKET_POLL_MS * 1000 };
+  int on = 1;
+  int rcvbuf = 8 << 20;
+  int sock;
+
+  if ((sock = socket(AF_INET, type, 0)) < 0) {
+    return -1;
+  }
+
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  if (type == SOCK_DGRAM) {
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+#ifdef SO_TIMESTAMPNS
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+#endif
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+typedef struct {
+  loopback_ingest_t *ingest;
+  int sock;
+} control_connection_t;
+
+static void *_control_thread(void *data) {
+  loopback_ingest_t *ingest = data;
+  control_connection_t *conn;
+  pthread_t thread;
+  int sock;
+
+  while (!ingest->stop) {
+    if ((sock = accept(ingest->control_socket, NULL, NULL)) < 0) {
+      continue;
+    }
+
+    if ((conn = malloc(sizeof(*conn))) == NULL) {
+      close(sock);
+      continue;
+    }
+
+    conn->ingest = ingest;
+    conn->sock = sock;
+    pthread_create(&thread, NULL, _control_connection, conn);
+    pthread_detach(thread);
+  }
+
+  return NULL;
+}
+
+// Commands end with a blank line. The attributes sent between CONNECT and
+// "." get no reply.
+static void *_control_connection(void *data) {
+  control_connection_t *conn = data;
+  char buf[4096];
+  int len = 0;
+  int n;
+  char *end;
+
+  while (!conn->ingest->stop) {
+    if ((n = recv(conn->sock, buf + len, sizeof(buf) - 1 - len, 0)) == 0) {
+      break;
+    }
+    if (n < 0) {
+      continue;
+    }
+
+    len += n;
+    buf[len] = 0;
+
+    while ((end = strstr(buf, "\r\n\r\n")) != NULL) {
+      *end = 0;
+
+      if (strcmp(buf, "HMAC") == 0) {
+        char reply[4 + 128 + 2] = "200 ";
+        memset(reply + 4, 'a', 128);
+        strcpy(reply + 4 + 128, "\n");
+        send(conn->sock, reply, strlen(reply), 0);
+      }
+      else if (strncmp(buf, "CONNECT", 7) == 0) {
+        send(conn->sock, "200\n", 4, 0);
+      }
+      else if (strcmp(buf, ".") == 0) {
+        char reply[64];
+        snprintf(reply, sizeof(reply), "200 hi. Use UDP port %d\n", LOOPBACK_MEDIA_PORT);
+        send(conn->sock, reply, strlen(reply), 0);
+      }
+      else if (strncmp(buf, "PING", 4) == 0) {
+        send(conn->sock, "201\n", 4, 0);
+      }
+
+      len -= (int)(end + 4 - buf);
+      memmove(buf, end + 4, len + 1);
+    }
+
+    // A line longer than the buffer, drop it.
+    if (len == sizeof(buf) - 1) {
+      len = 0;
+    }
+  }
+
+  close(conn->sock);
+  free(conn);
+
+  return NULL;
+}
+
+static void *_media_thread(void *data) {
+  loopback_ingest_t *ingest = data;
+  uint8_t packet[65536];
+  char control[256];
+  struct sockaddr_in from;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  uint16_t last_sn = 0;
+  int have_sn = 0;
+  int64_t ns;
+  int len;
+
+  while (!ingest->stop) {
+    iov.iov_base = packet;
+    iov.iov_len = sizeof(packet);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &from;
+    msg.msg_namelen = sizeof(from);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if ((len = (int)recvmsg(ingest->media_socket, &msg, 0)) < 12) {
+      continue;
+    }
+
+    ns = 0;
+#ifdef SO_TIMESTAMPNS
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPNS) {
+        struct timespec ts;
+        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+        ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+      }
+    }
+#endif
+    if (ns == 0) {
+      ns = loopback_now_ns();
+    }
+
+    // Pings are echoed so the sender can measure the round trip.
+    if (packet[1] == PING_PAYLOAD_TYPE) {
+      sendto(ingest->media_socket, packet, len, 0, (struct sockaddr *)&from, msg.msg_namelen);
+      continue;
+    }
+
+    if ((packet[1] & 0x7f) != VIDEO_PAYLOAD_TYPE) {
+      continue;
+    }
+
+    uint16_t sn = (uint16_t)((packet[2] << 8) | packet[3]);
+
+    if (have_sn && sn != (uint16_t)(last_sn + 1)) {
+      ingest->seq_gaps++;
+    }
+    last_sn = sn;
+    have_sn = 1;
+
+    if (ingest->arrival_count < ingest->max_arrivals) {
+      ingest->arrivals[ingest->arrival_count].ns = ns;
+      ingest->arrivals[ingest->arrival_count].len = len;
+      ingest->arrival_count++;
+    }
+
+    if (packet[1] & 0x80) {
+      ingest->markers++;
+    }
+    ingest->bytes += len;
+    ingest->packets++;
+  }
+
+  return NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef __LOOPBACK_INGEST_H
+#define __LOOPBACK_INGEST_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ftl.h"
+
+// Answers the control handshake on the ingest port and counts the video
+// packets that arrive on LOOPBACK_MEDIA_PORT. Not a real ingest: it never
+// checks the HMAC and never sends NACKs.
+#define LOOPBACK_CONTROL_PORT 8084
+#define LOOPBACK_MEDIA_PORT 8082
+
+typedef struct {
+  int64_t ns; //kernel receive time, CLOCK_REALTIME
+  int len;
+} loopback_arrival_t;
+
+typedef struct {
+  volatile int stop;
+  int control_socket;
+  int media_socket;
+  pthread_t control_thread;
+  pthread_t media_thread;
+
+  // Video only, written by the media thread.
+  volatile int64_t packets;
+  volatile int64_t bytes;
+  volatile int64_t markers; //last packet of a frame
+  volatile int64_t seq_gaps;
+  loopback_arrival_t *arrivals; //first max_arrivals packets, NULL if not kept
+  int max_arrivals;
+  volatile int arrival_count;
+} loopback_ingest_t;
+
+int loopback_ingest_start(loopback_ingest_t *ingest, int max_arrivals);
+void loopback_ingest_stop(loopback_ingest_t *ingest);
+
+// Waits up to timeout_ms for the video packet count to stop changing.
+void loopback_ingest_settle(loopback_ingest_t *ingest, int timeout_ms);
+
+// Fills in the parameters to stream to the loopback ingest.
+void loopback_ingest_params(ftl_ingest_params_t *params, int peak_kbps);
+
+int64_t loopback_now_ns();
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "loopback_ingest.h"
+
+// Streams video at a fixed bitrate to the loopback ingest and reports how
+// far the gaps between arriving packets are from the gap the target rate
+// gives each packet.
+//
+// usage: ftl_pacer_bench [kbps] [seconds] [pacing] [frame_bytes]
+//   pacing is an FTL_PACING_* value, frame_bytes defaults to one frame's
+//   share of kbps at 30 fps.
+
+#define FPS 30
+#define MAX_FRAME_BYTES (1 << 20)
+
+static int compare_int64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static int send_frame(ftl_handle_t *handle, int64_t dts, int key, int len) {
+  static uint8_t buf[MAX_FRAME_BYTES];
+
+  if (key) {
+    buf[0] = 0x67;
+    memset(buf + 1, 0x42, 20);
+    ftl_ingest_send_media_dts(handle, FTL_VIDEO_DATA, dts, buf, 21, 0);
+    buf[0] = 0x68;
+    ftl_ingest_send_media_dts(handle, FTL_VIDEO_DATA, dts, buf, 7, 0);
+  }
+
+  buf[0] = key ? 0x65 : 0x41;
+  memset(buf + 1, 0x45, len - 1);
+
+  return ftl_ingest_send_media_dts(handle, FTL_VIDEO_DATA, dts, buf, len, 1);
+}
+
+// Gaps over four times the target are the queue running dry between frames,
+// not pacing, and are left out.
+static void report(loopback_ingest_t *ingest, int kbps) {
+  loopback_arrival_t *a = ingest->arrivals;
+  int64_t *dev;
+  int64_t gap_sum = 0;
+  int64_t byte_sum = 0;
+  int64_t dev_sum = 0;
+  int bursts = 0;
+  int n = 0;
+  int i;
+
+  if (ingest->arrival_count < 2 || (dev = malloc(sizeof(int64_t) * ingest->arrival_count)) == NULL) {
+    printf("not enough packets arrived\n");
+    return;
+  }
+
+  for (i = 1; i < ingest->arrival_count; i++) {
+    int64_t target = (int64_t)a[i - 1].len * 8 * 1000000 / kbps;
+    int64_t gap = a[i].ns - a[i - 1].ns;
+
+    if (gap > 4 * target) {
+      continue;
+    }
+
+    gap_sum += gap;
+    byte_sum += a[i - 1].len;
+    dev[n] = (gap > target) ? gap - target : target - gap;
+    dev_sum += dev[n];
+    if (gap < target / 4) {
+      bursts++;
+    }
+    n++;
+  }
+
+  if (n == 0 || gap_sum == 0) {
+    printf("no paced gaps\n");
+    free(dev);
+    return;
+  }
+
+  qsort(dev, n, sizeof(int64_t), compare_int64);
+
+  printf("paced gaps     %d of %d packets\n", n, ingest->arrival_count);
+  printf("achieved       %.0f kbps (target %d)\n", (double)byte_sum * 8 * 1000000 / gap_sum, kbps);
+  printf("|gap - target| mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+    dev_sum / 1000.0 / n, dev[n / 2] / 1000.0, dev[n * 99 / 100] / 1000.0, dev[n - 1] / 1000.0);
+  printf("bursts         %.1f%% of gaps under a quarter of the target\n", 100.0 * bursts / n);
+
+  free(dev);
+}
+
+int main(int argc, char **argv) {
+  int kbps = (argc > 1) ? atoi(argv[1]) : 20000;
+  int seconds = (argc > 2) ? atoi(argv[2]) : 4;
+  int pacing = (argc > 3) ? atoi(argv[3]) : FTL_PACING_USER;
+  int frame_bytes = (argc > 4) ? atoi(argv[4]) : kbps * 1000 / 8 / FPS;
+  loopback_ingest_t ingest;
+  ftl_handle_t handle;
+  ftl_ingest_params_t params;
+  ftl_ingest_params_ex_t ex;
+  ftl_status_t status;
+  int64_t start_ns;
+  int frame;
+
+  if (kbps <= 0 || seconds <= 0 || frame_bytes < 2 || frame_bytes > MAX_FRAME_BYTES) {
+    fprintf(stderr, "usage: %s [kbps] [seconds] [pacing] [frame_bytes]\n", argv[0]);
+    return 1;
+  }
+
+  if (loopback_ingest_start(&ingest, kbps * 1000 / 8 / 1000 * (seconds + 1)) != 0) {
+    return 1;
+  }
+
+  ftl_init();
+
+  loopback_ingest_params(&params, kbps);
+  memset(&ex, 0, sizeof(ex));
+  ex.fast_start = 1; //no audio
+  ex.pacing = pacing;
+
+  if ((status = ftl_ingest_create_ex(&handle, &params, &ex)) != FTL_SUCCESS ||
+      (status = ftl_ingest_connect(&handle)) != FTL_SUCCESS) {
+    fprintf(stderr, "couldn't stream to the loopback ingest (%d)\n", status);
+    loopback_ingest_stop(&ingest);
+    return 1;
+  }
+
+  printf("%d kbps, %d byte frames at %d fps, pacing %d, %d seconds\n", kbps, frame_bytes, FPS, pacing, seconds);
+
+  start_ns = loopback_now_ns();
+  for (frame = 0; frame < seconds * FPS; frame++) {
+    int64_t due_ns = start_ns + (int64_t)frame * 1000000000 / FPS;
+    int64_t wait_ns = due_ns - loopback_now_ns();
+
+    if (wait_ns > 0) {
+      usleep((useconds_t)(wait_ns / 1000));
+    }
+
+    send_frame(&handle, due_ns / 1000, frame % (FPS * 2) == 0, frame_bytes);
+  }
+
+  loopback_ingest_settle(&ingest, 5000);
+
+  ftl_ingest_disconnect(&handle);
+  ftl_ingest_destroy(&handle);
+
+  report(&ingest, kbps);
+
+  loopback_ingest_stop(&ingest);
+
+  return 0;
+}
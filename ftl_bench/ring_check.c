@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "loopback_ingest.h"
+
+// Streams a key frame several times larger than the video ring while earlier
+// frames are still queued behind the pacer. The ring has to grow with the
+// send thread backlogged for the key frame to be admitted.
+
+#define RING_SLOTS 64
+#define PEAK_KBPS 4000
+#define P_FRAME_BYTES 12000
+#define P_FRAMES 3
+#define SMALL_IDR_BYTES 5000
+#define LARGE_IDR_BYTES (200 * 1400)
+
+static int send_nal(ftl_handle_t *handle, int64_t dts, uint8_t type, int len, int end_of_frame) {
+  static uint8_t buf[LARGE_IDR_BYTES];
+
+  buf[0] = type;
+  memset(buf + 1, 0x42, len - 1);
+
+  return ftl_ingest_send_media_dts(handle, FTL_VIDEO_DATA, dts, buf, len, end_of_frame);
+}
+
+static int send_key_frame(ftl_handle_t *handle, int64_t dts, int len) {
+  send_nal(handle, dts, 0x67, 21, 0);
+  send_nal(handle, dts, 0x68, 7, 0);
+  return send_nal(handle, dts, 0x65, len, 1);
+}
+
+int main(void) {
+  loopback_ingest_t ingest;
+  ftl_handle_t handle;
+  ftl_ingest_params_t params;
+  ftl_ingest_params_ex_t ex;
+  ftl_queue_status_t queue;
+  ftl_status_t status;
+  int64_t dts = 0;
+  int failed = 0;
+  int sent;
+  int i;
+
+  if (loopback_ingest_start(&ingest, 0) != 0) {
+    return 1;
+  }
+
+  ftl_init();
+
+  loopback_ingest_params(&params, PEAK_KBPS);
+  memset(&ex, 0, sizeof(ex));
+  ex.video_ring_slots = RING_SLOTS;
+  ex.video_ring_max_kb = 4096;
+  ex.fast_start = 1; //no audio
+
+  if ((status = ftl_ingest_create_ex(&handle, &params, &ex)) != FTL_SUCCESS ||
+      (status = ftl_ingest_connect(&handle)) != FTL_SUCCESS) {
+    printf("FAIL: couldn't stream to the loopback ingest (%d)\n", status);
+    loopback_ingest_stop(&ingest);
+    return 1;
+  }
+
+  send_key_frame(&handle, dts, SMALL_IDR_BYTES);
+  for (i = 0; i < P_FRAMES; i++) {
+    dts += 33333;
+    send_nal(&handle, dts, 0x41, P_FRAME_BYTES, 1);
+  }
+
+  if (ftl_ingest_get_queue_status(&handle, FTL_VIDEO_DATA, &queue) != FTL_SUCCESS || queue.queued_packets == 0) {
+    printf("FAIL: the queue drained before the key frame, nothing was checked\n");
+    failed = 1;
+  }
+  else {
+    printf("queued packets before the key frame: %d\n", queue.queued_packets);
+  }
+
+  dts += 33333;
+  if ((sent = send_key_frame(&handle, dts, LARGE_IDR_BYTES)) < LARGE_IDR_BYTES) {
+    printf("FAIL: a %d byte key frame on a %d packet ring queued %d bytes\n", LARGE_IDR_BYTES, RING_SLOTS, sent);
+    failed = 1;
+  }
+
+  loopback_ingest_settle(&ingest, 5000);
+
+  printf("received %lld packets, %lld frames, %lld sequence gaps\n", (long long)ingest.packets, (long long)ingest.markers, (long long)ingest.seq_gaps);
+
+  if (ingest.markers != P_FRAMES + 2 || ingest.seq_gaps != 0) {
+    printf("FAIL: expected %d complete frames without gaps\n", P_FRAMES + 2);
+    failed = 1;
+  }
+
+  ftl_ingest_disconnect(&handle);
+  ftl_ingest_destroy(&handle);
+  loopback_ingest_stop(&ingest);
+
+  printf("%s\n", failed ? "FAIL" : "PASS");
+
+  return failed;
+}
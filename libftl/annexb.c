@@ -0,0 +1,321 @@
+#define __FTL_INTERNAL
+#include "ftl.h"
+#include "ftl_private.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define ANNEXB_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ANNEXB_TARGET_AVX2
+#else
+#define ANNEXB_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// NALs handed to media_send_batch at a time.
+#define ANNEXB_MAX_BATCH 32
+
+#define AVCC_LENGTH_SIZE 4
+
+// Bytes the scalar scanner looks at before handing over to the vector one.
+// SPS, PPS and SEI NALs are a few dozen bytes, too short for the vector
+// loops to pay for themselves.
+#define ANNEXB_SCALAR_PREFIX 64
+
+// NALs of one frame waiting to be handed to media_send_batch.
+typedef struct {
+  ftl_media_buffer_t buffers[ANNEXB_MAX_BATCH];
+  ftl_media_unit_t units[ANNEXB_MAX_BATCH];
+  int count;
+  int bytes_queued;
+} nal_batch_t;
+
+typedef const uint8_t *(*annexb_scan_fn)(const uint8_t *p, const uint8_t *end);
+
+static const uint8_t *_annexb_scan_scalar(const uint8_t *p, const uint8_t *end);
+static void _nal_batch_add(ftl_stream_configuration_private_t *ftl, nal_batch_t *batch, int64_t dts_usec, const uint8_t *nal, int32_t nal_len);
+static int _nal_batch_finish(ftl_stream_configuration_private_t *ftl, nal_batch_t *batch);
+#ifdef ANNEXB_X86
+static int _annexb_ctz(uint32_t mask);
+static BOOL _annexb_cpu_has_avx2();
+static const uint8_t *_annexb_scan_sse2(const uint8_t *p, const uint8_t *end);
+static const uint8_t *_annexb_scan_avx2(const uint8_t *p, const uint8_t *end);
+
+static annexb_scan_fn annexb_scan = _annexb_scan_sse2;
+#else
+static annexb_scan_fn annexb_scan = _annexb_scan_scalar;
+#endif
+
+void annexb_init() {
+#ifdef ANNEXB_X86
+  if (_annexb_cpu_has_avx2()) {
+    annexb_scan = _annexb_scan_avx2;
+  }
+#endif
+}
+
+/*
+ * Switches annexb_find_start_code() to another scanner, for benchmarks.
+ * Returns FALSE if this build or CPU doesn't have it.
+ */
+BOOL annexb_set_scanner(annexb_scanner_t scanner) {
+  switch (scanner) {
+  case ANNEXB_SCAN_SCALAR:
+    annexb_scan = _annexb_scan_scalar;
+    return TRUE;
+#ifdef ANNEXB_X86
+  case ANNEXB_SCAN_SSE2:
+    annexb_scan = _annexb_scan_sse2;
+    return TRUE;
+  case ANNEXB_SCAN_AVX2:
+    if (!_annexb_cpu_has_avx2()) {
+      return FALSE;
+    }
+    annexb_scan = _annexb_scan_avx2;
+    return TRUE;
+#endif
+  default:
+    return FALSE;
+  }
+}
+
+const uint8_t *annexb_find_start_code(const uint8_t *p, const uint8_t *end) {
+  const uint8_t *found;
+
+  if (annexb_scan == _annexb_scan_scalar || end - p <= ANNEXB_SCALAR_PREFIX) {
+    return _annexb_scan_scalar(p, end);
+  }
+
+  if ((found = _annexb_scan_scalar(p, p + ANNEXB_SCALAR_PREFIX)) != p + ANNEXB_SCALAR_PREFIX) {
+    return found;
+  }
+
+  // The last two positions of the prefix were never looked at.
+  return annexb_scan(p + ANNEXB_SCALAR_PREFIX - 2, end);
+}
+
+/*
+ * Returns the next NAL in [*pos, end) without its start code and trailing
+ * zero bytes and advances *pos past it. Anything in front of the first start
+ * code is skipped.
+ */
+BOOL annexb_next_nal(const uint8_t **pos, const uint8_t *end, const uint8_t **nal, int32_t *nal_len) {
+  const uint8_t *start = *pos;
+  const uint8_t *next;
+
+  while (start < end) {
+    if ((start = annexb_find_start_code(start, end)) == end) {
+      break;
+    }
+
+    start += 3;
+    next = annexb_find_start_code(start, end);
+    *pos = next;
+
+    // A 4 byte start code leaves a zero byte at the end of the previous NAL.
+    while (next > start && next[-1] == 0) {
+      next--;
+    }
+
+    if (next > start) {
+      *nal = start;
+      *nal_len = (int32_t)(next - start);
+      return TRUE;
+    }
+
+    start = *pos;
+  }
+
+  *pos = end;
+  return FALSE;
+}
+
+static const uint8_t *_annexb_scan_scalar(const uint8_t *p, const uint8_t *end) {
+  // Look at the third byte first, anything other than 0 or 1 there rules
+  // out three positions at once.
+  while (end - p >= 3) {
+    if (p[2] > 1) {
+      p += 3;
+    }
+    else if (p[2] == 0) {
+      p++;
+    }
+    else if (p[1] == 0 && p[0] == 0) {
+      return p;
+    }
+    else {
+      p += 3;
+    }
+  }
+
+  return end;
+}
+
+#ifdef ANNEXB_X86
+static int _annexb_ctz(uint32_t mask) {
+#ifdef _MSC_VER
+  unsigned long idx;
+  _BitScanForward(&idx, mask);
+  return (int)idx;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+static BOOL _annexb_cpu_has_avx2() {
+#ifdef _MSC_VER
+  int info[4];
+
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return FALSE;
+  }
+
+  // AVX and OSXSAVE, then the OS has to save the ymm registers.
+  __cpuid(info, 1);
+  if ((info[2] & (1 << 27 | 1 << 28)) != (1 << 27 | 1 << 28) || (_xgetbv(0) & 6) != 6) {
+    return FALSE;
+  }
+
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") ? TRUE : FALSE;
+#endif
+}
+
+static const uint8_t *_annexb_scan_sse2(const uint8_t *p, const uint8_t *end) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+
+  // Positions i where p[i] == 0, p[i + 1] == 0 and p[i + 2] == 1.
+  while (end - p >= 18) {
+    __m128i b0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), zero);
+    __m128i b1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 1)), zero);
+    __m128i b2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 2)), one);
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(b0, b1), b2));
+
+    if (mask) {
+      return p + _annexb_ctz(mask);
+    }
+
+    p += 16;
+  }
+
+  return _annexb_scan_scalar(p, end);
+}
+
+ANNEXB_TARGET_AVX2
+static const uint8_t *_annexb_scan_avx2(const uint8_t *p, const uint8_t *end) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi8(1);
+
+  while (end - p >= 34) {
+    __m256i b0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), zero);
+    __m256i b1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 1)), zero);
+    __m256i b2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 2)), one);
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(b0, b1), b2));
+
+    if (mask) {
+      return p + _annexb_ctz(mask);
+    }
+
+    p += 32;
+  }
+
+  return _annexb_scan_sse2(p, end);
+}
+#endif
+
+static void _nal_batch_add(ftl_stream_configuration_private_t *ftl, nal_batch_t *batch, int64_t dts_usec, const uint8_t *nal, int32_t nal_len) {
+  int i;
+
+  if (batch->count == ANNEXB_MAX_BATCH) {
+    batch->bytes_queued += media_send_batch(ftl, batch->units, batch->count);
+    batch->count = 0;
+  }
+
+  i = batch->count++;
+  batch->buffers[i].data = nal;
+  batch->buffers[i].len = nal_len;
+  batch->units[i].media_type = FTL_VIDEO_DATA;
+  batch->units[i].dts_usec = dts_usec;
+  batch->units[i].buffers = &batch->buffers[i];
+  batch->units[i].buffer_count = 1;
+  batch->units[i].end_of_frame = 0;
+}
+
+// Queues what is left, the last NAL ends the frame.
+static int _nal_batch_finish(ftl_stream_configuration_private_t *ftl, nal_batch_t *batch) {
+  if (batch->count > 0) {
+    batch->units[batch->count - 1].end_of_frame = 1;
+    batch->bytes_queued += media_send_batch(ftl, batch->units, batch->count);
+    batch->count = 0;
+  }
+
+  return batch->bytes_queued;
+}
+
+/*
+ * Splits an access unit into NALs and queues them as one batch, pointing the
+ * packetizer at the caller's buffer.
+ */
+int annexb_send_video(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, const uint8_t *data, int32_t len) {
+  nal_batch_t batch;
+  const uint8_t *pos = data;
+  const uint8_t *end = data + len;
+  const uint8_t *nal;
+  int32_t nal_len;
+
+  batch.count = 0;
+  batch.bytes_queued = 0;
+
+  while (annexb_next_nal(&pos, end, &nal, &nal_len)) {
+    _nal_batch_add(ftl, &batch, dts_usec, nal, nal_len);
+  }
+
+  return _nal_batch_finish(ftl, &batch);
+}
+
+/*
+ * Same for an AVCC frame, where every NAL is preceded by its length as a 4
+ * byte big endian number. A frame whose lengths run past the end of the data
+ * is dropped as a whole.
+ */
+int avcc_send_video(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, const uint8_t *data, int32_t len) {
+  nal_batch_t batch;
+  const uint8_t *p;
+  const uint8_t *end = data + len;
+  uint32_t nal_len;
+
+  for (p = data; end - p >= AVCC_LENGTH_SIZE; p += nal_len) {
+    nal_len = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    p += AVCC_LENGTH_SIZE;
+
+    if (nal_len > (uint32_t)(end - p)) {
+      break;
+    }
+  }
+
+  if (p != end) {
+    FTL_LOG(ftl, FTL_LOG_WARN, "Dropping malformed AVCC frame of %d bytes\n", len);
+    return 0;
+  }
+
+  batch.count = 0;
+  batch.bytes_queued = 0;
+
+  for (p = data; p < end; p += nal_len) {
+    nal_len = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    p += AVCC_LENGTH_SIZE;
+
+    if (nal_len > 0) {
+      _nal_batch_add(ftl, &batch, dts_usec, p, (int32_t)nal_len);
+    }
+  }
+
+  return _nal_batch_finish(ftl, &batch);
+}
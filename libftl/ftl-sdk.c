@@ -8,53 +8,106 @@
 
 static BOOL _get_chan_id_and_key(const char *stream_key, uint32_t *chan_id, char *key);
 static int _lookup_ingest_ip(const char *ingest_location, char *ingest_ip);
+static BOOL _is_valid_ring_slots(int slots);
+static int _ring_slots_for_packet_rate(int64_t packets_per_sec, int retention_ms, int min_slots);
 
 char error_message[1000];
+
+static BOOL ftl_initialized = FALSE;
 FTL_API const int FTL_VERSION_MAJOR = 0;
 FTL_API const int FTL_VERSION_MINOR = 9;
 FTL_API const int FTL_VERSION_MAINTENANCE = 14;
 
+FTL_API ftl_status_t ftl_set_allocator(const ftl_allocator_t *allocator) {
+  if (ftl_initialized || (allocator != NULL && (allocator->alloc == NULL || allocator->free == NULL))) {
+    return FTL_CONFIG_ERROR;
+  }
+
+  ftl_set_allocator_internal(allocator);
+
+  return FTL_SUCCESS;
+}
+
 // Initializes all sublibraries used by FTL
 FTL_API ftl_status_t ftl_init() {
   struct timeval now;
 
   init_sockets();
   os_init();
+  annexb_init();
 #ifndef DISABLE_AUTO_INGEST
   curl_global_init(CURL_GLOBAL_ALL);
 #endif
 
   gettimeofday(&now, NULL);
   srand((unsigned int)now.tv_sec);
+  ftl_initialized = TRUE;
   return FTL_SUCCESS;
 }
 
 FTL_API ftl_status_t ftl_ingest_create(ftl_handle_t *ftl_handle, ftl_ingest_params_t *params){
+  return ftl_ingest_create_ex(ftl_handle, params, NULL);
+}
+
+FTL_API ftl_status_t ftl_ingest_create_ex(ftl_handle_t *ftl_handle, ftl_ingest_params_t *params, ftl_ingest_params_ex_t *params_ex){
   ftl_status_t ret_status = FTL_SUCCESS;
   ftl_stream_configuration_private_t *ftl = NULL;
+  ftl_ingest_params_ex_t ex;
+  int i;
+
+  if (params_ex != NULL) {
+    ex = *params_ex;
+  }
+  else {
+    memset(&ex, 0, sizeof(ex));
+  }
+
+  if (!_is_valid_ring_slots(ex.video_ring_slots) || !_is_valid_ring_slots(ex.audio_ring_slots) ||
+      (ex.mtu != 0 && (ex.mtu < MIN_MTU || ex.mtu > MAX_MTU)) || ex.retention_ms < 0 || ex.video_ring_max_kb < 0 || ex.retention_rtt_multiplier < 0 || ex.keyframe_request_interval_ms < 0 ||
+      (ex.memory_flags & ~(FTL_MEMORY_LOCK | FTL_MEMORY_PREFAULT | FTL_MEMORY_HUGE_PAGES)) != 0 ||
+      (ex.nal_filter & ~(FTL_NAL_FILTER_FILLER | FTL_NAL_FILTER_AUD | FTL_NAL_FILTER_REPEATED_PARAMS | FTL_NAL_FILTER_SEI)) != 0 ||
+      ex.pacer_burst_ms < 0 || (ex.pacer_rate_percent != 0 && (ex.pacer_rate_percent < MIN_PACER_RATE_PERCENT || ex.pacer_rate_percent > MAX_PACER_RATE_PERCENT)) ||
+      ex.pacing < FTL_PACING_USER || ex.pacing > FTL_PACING_TXTIME) {
+    return FTL_CONFIG_ERROR;
+  }
 
   do {
-    if ((ftl = (ftl_stream_configuration_private_t *)malloc(sizeof(ftl_stream_configuration_private_t))) == NULL) {
+    if ((ftl = (ftl_stream_configuration_private_t *)ftl_malloc(NULL, sizeof(ftl_stream_configuration_private_t), FTL_ALLOC_HANDLE)) == NULL) {
       // Note it is important that we return here otherwise the call to 
       // internal_ftl_ingest_destroy will fail!
       return FTL_MALLOC_FAILURE;
     }
 
     memset(ftl, 0, sizeof(ftl_stream_configuration_private_t));
+    ftl_account_memory(ftl, FTL_ALLOC_HANDLE, sizeof(ftl_stream_configuration_private_t));
 
     // First create any components that the system relies on.
     os_init_mutex(&ftl->state_mutex);
     os_init_mutex(&ftl->disconnect_mutex);
     os_init_mutex(&ftl->status_q.mutex);
+    os_init_mutex(&ftl->video.keyframe_mutex);
+
+    // Status and log messages are stored in a fixed pool.
+    ftl->status_q.count = 0;
+    ftl->status_q.head = NULL;
+    ftl->status_q.free_list = NULL;
+    for (i = 0; i < sizeof(ftl->status_q.pool) / sizeof(ftl->status_q.pool[0]); i++) {
+      ftl->status_q.pool[i].next = ftl->status_q.free_list;
+      ftl->status_q.free_list = &ftl->status_q.pool[i];
+    }
 
     if (os_semaphore_create(&ftl->status_q.sem, "/StatusQueue", O_CREAT, 0) < 0) {
         ret_status = FTL_MALLOC_FAILURE;
         break;
     }
 
+    if ((ret_status = media_submit_create(ftl)) != FTL_SUCCESS) {
+      break;
+    }
+
     // Capture the incoming key.
     ftl->key = NULL;
-    if ((ftl->key = (char*)malloc(sizeof(char)*MAX_KEY_LEN)) == NULL) {
+    if ((ftl->key = (char*)ftl_malloc(ftl, sizeof(char)*MAX_KEY_LEN, FTL_ALLOC_HANDLE)) == NULL) {
       ret_status = FTL_MALLOC_FAILURE;
       break;
     }
@@ -87,10 +140,53 @@ FTL_API ftl_status_t ftl_ingest_create(ftl_handle_t *ftl_handle, ftl_ingest_para
     ftl->video.height = 720;
 
     ftl->video.media_component.peak_kbps = params->peak_kbps;
-    ftl->param_ingest_hostname = _strdup(params->ingest_hostname);
 
-    ftl->status_q.count = 0;
-    ftl->status_q.head = NULL;
+    ftl->media.configured_mtu = (ex.mtu > 0) ? ex.mtu : MAX_MTU;
+    ftl->media.retention_ms = (ex.retention_ms > 0) ? ex.retention_ms : DEFAULT_RETENTION_MS;
+    ftl->media.retention_rtt_multiplier = (ex.retention_rtt_multiplier > 0) ? ex.retention_rtt_multiplier : DEFAULT_RETENTION_RTT_MULTIPLIER;
+
+    if (ex.video_ring_slots > 0) {
+      ftl->video.media_component.nack_ring_slots = ex.video_ring_slots;
+    }
+    else if (params_ex != NULL && params->peak_kbps > 0) {
+      int64_t packets_per_sec = (int64_t)params->peak_kbps * 1000 / 8 / ftl->media.configured_mtu + 1;
+      ftl->video.media_component.nack_ring_slots = _ring_slots_for_packet_rate(packets_per_sec, ftl->media.retention_ms, MIN_AUTO_NACK_RB_SIZE);
+    }
+    else {
+      ftl->video.media_component.nack_ring_slots = NACK_RB_SIZE;
+    }
+
+    // Audio is one packet per opus frame, twice that leaves room for bursts.
+    if (ex.audio_ring_slots > 0) {
+      ftl->audio.media_component.nack_ring_slots = ex.audio_ring_slots;
+    }
+    else {
+      ftl->audio.media_component.nack_ring_slots = _ring_slots_for_packet_rate(2 * 1000 / AUDIO_PACKET_DURATION_MS, ftl->media.retention_ms, MIN_NACK_RB_SIZE);
+    }
+
+    ftl->video.media_component.nack_ring_max_bytes = (int64_t)ex.video_ring_max_kb * 1024;
+    ftl->audio.media_component.nack_ring_max_bytes = 0;
+    ftl->media.memory_flags = ex.memory_flags;
+
+    ftl->video.keyframe_request = ex.keyframe_request;
+    ftl->video.keyframe_request_context = ex.keyframe_request_context;
+    ftl->video.nal_filter = ex.nal_filter;
+    ftl->video.fast_start = (ex.fast_start || ex.low_latency) ? TRUE : FALSE;
+    if (ex.pacer_burst_ms > 0) {
+      ftl->video.pacer_burst_ms = ex.pacer_burst_ms;
+    }
+    else {
+      ftl->video.pacer_burst_ms = ex.low_latency ? LOW_LATENCY_PACER_BURST_MS : DEFAULT_PACER_BURST_MS;
+    }
+    ftl->video.pacer_rate_percent = (ex.pacer_rate_percent > 0) ? ex.pacer_rate_percent : DEFAULT_PACER_RATE_PERCENT;
+    ftl->video.pacing = ex.pacing;
+    ftl->video.keyframe_request_interval_ms = (ex.keyframe_request_interval_ms > 0) ? ex.keyframe_request_interval_ms : DEFAULT_KEYFRAME_REQUEST_INTERVAL_MS;
+
+    if ((ret_status = media_arena_create(ftl)) != FTL_SUCCESS) {
+      break;
+    }
+
+    ftl->param_ingest_hostname = ftl_strdup(ftl, params->ingest_hostname, FTL_ALLOC_HANDLE);
 
     ftl_set_state(ftl, FTL_STATUS_QUEUE);
 
@@ -149,11 +245,11 @@ FTL_API ftl_status_t ftl_ingest_update_params(ftl_handle_t *ftl_handle, ftl_inge
 
   if (params->ingest_hostname != NULL) {
     if (ftl->param_ingest_hostname != NULL) {
-      free(ftl->param_ingest_hostname);
+      ftl_free(ftl->param_ingest_hostname);
       ftl->param_ingest_hostname = NULL;
     }
 
-    ftl->param_ingest_hostname = _strdup(params->ingest_hostname);
+    ftl->param_ingest_hostname = ftl_strdup(ftl, params->ingest_hostname, FTL_ALLOC_HANDLE);
   }
 
   /* not going to update fps for the moment*/
@@ -195,6 +291,9 @@ FTL_API int ftl_ingest_send_media_dts(ftl_handle_t *ftl_handle, ftl_media_type_t
   if (media_type == FTL_AUDIO_DATA) {
     bytes_sent = media_send_audio(ftl, dts_usec, data, len);
   }
+  else if (media_type == FTL_VIDEO_DATA && ftl->video.codec == FTL_VIDEO_H264_AVCC) {
+    bytes_sent = avcc_send_video(ftl, dts_usec, data, len);
+  }
   else if (media_type == FTL_VIDEO_DATA) {
     bytes_sent = media_send_video(ftl, dts_usec, data, len, end_of_frame);
   }
@@ -217,7 +316,7 @@ FTL_API int ftl_ingest_send_media(ftl_handle_t *ftl_handle, ftl_media_type_t med
   }
   else if (media_type == FTL_VIDEO_DATA) {
     dts_usec = ftl->video.dts_usec;
-    if (end_of_frame) {
+    if (end_of_frame || ftl->video.codec == FTL_VIDEO_H264_AVCC) {
       float dst_usec_f = (float)ftl->video.fps_den * 1000000.f / (float)ftl->video.fps_num + ftl->video.dts_error;
       dts_increment_usec = (int64_t)(dst_usec_f);
       ftl->video.dts_error = dst_usec_f - (float)dts_increment_usec;
@@ -228,6 +327,75 @@ FTL_API int ftl_ingest_send_media(ftl_handle_t *ftl_handle, ftl_media_type_t med
   return ftl_ingest_send_media_dts(ftl_handle, media_type, dts_usec, data, len, end_of_frame);
 }
 
+FTL_API ftl_status_t ftl_ingest_submit_media(ftl_handle_t *ftl_handle, ftl_media_type_t media_type, int64_t dts_usec, int nal_index, uint8_t *data, int32_t len, int end_of_frame) {
+
+  ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+
+  if (media_type != FTL_AUDIO_DATA && media_type != FTL_VIDEO_DATA) {
+    return FTL_UNSUPPORTED_MEDIA_TYPE;
+  }
+
+  if (data == NULL || len <= 0 || nal_index < 0) {
+    return FTL_CONFIG_ERROR;
+  }
+
+  return media_submit(ftl, media_type, dts_usec, nal_index, data, len, end_of_frame);
+}
+
+FTL_API int ftl_ingest_send_media_batch(ftl_handle_t *ftl_handle, const ftl_media_unit_t *units, int unit_count) {
+
+  ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+
+  if (units == NULL || unit_count <= 0) {
+    return 0;
+  }
+
+  return media_send_batch(ftl, units, unit_count);
+}
+
+FTL_API int ftl_ingest_send_video_annexb(ftl_handle_t *ftl_handle, int64_t dts_usec, const uint8_t *data, int32_t len) {
+
+  ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+
+  if (data == NULL || len <= 0) {
+    return 0;
+  }
+
+  return annexb_send_video(ftl, dts_usec, data, len);
+}
+
+FTL_API int ftl_ingest_send_video_zero_copy(ftl_handle_t *ftl_handle, int64_t dts_usec, const uint8_t *data, int32_t len, int end_of_frame, ftl_release_callback_t release, void *context) {
+
+  ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+
+  if (release == NULL) {
+    return 0;
+  }
+
+  if (data == NULL || len <= 0) {
+    release(context, data);
+    return 0;
+  }
+
+  return media_send_video_zero_copy(ftl, dts_usec, data, len, end_of_frame, release, context);
+}
+
+FTL_API ftl_status_t ftl_ingest_attach_shm(ftl_handle_t *ftl_handle, const char *name) {
+  ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+
+  if (name == NULL) {
+    return FTL_CONFIG_ERROR;
+  }
+
+  return shm_input_attach(ftl, name);
+}
+
+FTL_API ftl_status_t ftl_ingest_detach_shm(ftl_handle_t *ftl_handle) {
+  ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+
+  return shm_input_detach(ftl);
+}
+
 FTL_API ftl_status_t ftl_ingest_disconnect(ftl_handle_t *ftl_handle) {
   ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
   ftl_status_t status_code = FTL_SUCCESS;
@@ -276,6 +444,11 @@ ftl_status_t internal_ftl_ingest_destroy(ftl_stream_configuration_private_t *ftl
 
   if (ftl != NULL) {
 
+    // Stop the reader first, it queues media and posts status messages.
+    if (ftl->shm_input != NULL) {
+      shm_input_detach(ftl);
+    }
+
     ftl_clear_state(ftl, FTL_STATUS_QUEUE);
     //if a thread is waiting send a destroy event
     if (ftl->status_q.thread_waiting) {
@@ -300,34 +473,37 @@ ftl_status_t internal_ftl_ingest_destroy(ftl_stream_configuration_private_t *ftl
 
     os_lock_mutex(&ftl->status_q.mutex);
 
-    status_queue_elmt_t *elmt;
-    while (ftl->status_q.head != NULL) {
-      elmt = ftl->status_q.head;
-      ftl->status_q.head = elmt->next;
-      free(elmt);
-      ftl->status_q.count--;
-    }
+    ftl->status_q.head = NULL;
+    ftl->status_q.count = 0;
 
     os_unlock_mutex(&ftl->status_q.mutex);
     os_delete_mutex(&ftl->status_q.mutex);
 
     os_semaphore_delete(&ftl->status_q.sem);
 
+    os_delete_mutex(&ftl->video.keyframe_mutex);
+
+    media_submit_destroy(ftl);
+
     ingest_release(ftl);
 
+    media_arena_destroy(ftl);
+
     if (ftl->key != NULL) {
-      free(ftl->key);
+      ftl_free(ftl->key);
     }
 
     if (ftl->ingest_hostname != NULL) {
-      free(ftl->ingest_hostname);
+      ftl_free(ftl->ingest_hostname);
     }
 
+    ftl_free(ftl->ingest_ip);
+
   if (ftl->param_ingest_hostname != NULL) {
-    free(ftl->param_ingest_hostname);
+    ftl_free(ftl->param_ingest_hostname);
   }
 
-    free(ftl);
+    ftl_free(ftl);
   }
 
   return FTL_SUCCESS;
@@ -341,6 +517,60 @@ FTL_API ftl_status_t ftl_ingest_destroy(ftl_handle_t *ftl_handle){
   return internal_ftl_ingest_destroy(ftl);
 }
 
+FTL_API ftl_status_t ftl_get_memory_usage(ftl_handle_t *ftl_handle, ftl_memory_usage_t *usage) {
+  ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+  int i;
+
+  if (ftl == NULL) {
+    return FTL_NOT_INITIALIZED;
+  }
+
+  usage->total_bytes = 0;
+  for (i = 0; i < FTL_ALLOC_TAG_COUNT; i++) {
+    usage->bytes[i] = os_atomic_load64(&ftl->memory_bytes[i]);
+    usage->total_bytes += usage->bytes[i];
+  }
+
+  return FTL_SUCCESS;
+}
+
+FTL_API ftl_status_t ftl_ingest_get_queue_status(ftl_handle_t *ftl_handle, ftl_media_type_t media_type, ftl_queue_status_t *status) {
+  ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+
+  if (ftl == NULL) {
+    return FTL_NOT_INITIALIZED;
+  }
+
+  if (media_type != FTL_AUDIO_DATA && media_type != FTL_VIDEO_DATA) {
+    return FTL_UNSUPPORTED_MEDIA_TYPE;
+  }
+
+  return media_get_queue_status(ftl, media_type, status);
+}
+
+FTL_API ftl_status_t ftl_ingest_set_queue_callback(ftl_handle_t *ftl_handle, ftl_queue_callback_t callback, void *context, int high_drain_ms, int low_drain_ms) {
+  ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+
+  if (ftl == NULL) {
+    return FTL_NOT_INITIALIZED;
+  }
+
+  if (callback != NULL && (low_drain_ms < 0 || low_drain_ms >= high_drain_ms)) {
+    return FTL_CONFIG_ERROR;
+  }
+
+  if (ftl_get_state(ftl, FTL_CONNECTED)) {
+    return FTL_ALREADY_CONNECTED;
+  }
+
+  ftl->video.queue_callback = callback;
+  ftl->video.queue_callback_context = context;
+  ftl->video.queue_high_drain_ms = high_drain_ms;
+  ftl->video.queue_low_drain_ms = low_drain_ms;
+
+  return FTL_SUCCESS;
+}
+
 FTL_API char* ftl_status_code_to_string(ftl_status_t status) {
 
   switch (status) {
@@ -410,6 +640,8 @@ FTL_API char* ftl_status_code_to_string(ftl_status_t status) {
     return "the ingest socket was hit a timeout.";
   case FTL_INGEST_SERVER_TERMINATE:
     return "The server has terminated the stream.";
+  case FTL_MEDIA_REJECTED:
+    return "The media came too late to be queued in order";
   case FTL_UNKNOWN_ERROR_CODE:
   default:
     /* Unknown FTL error */
@@ -424,7 +656,11 @@ BOOL _get_chan_id_and_key(const char *stream_key, uint32_t *chan_id, char *key)
     return FALSE;
   }
 
-  char * copy_of_key = _strdup(stream_key);
+  char * copy_of_key = ftl_strdup(NULL, stream_key, FTL_ALLOC_HANDLE);
+
+  if (copy_of_key == NULL) {
+    return FALSE;
+  }
 
   len = strlen(stream_key);
 
@@ -449,13 +685,35 @@ BOOL _get_chan_id_and_key(const char *stream_key, uint32_t *chan_id, char *key)
       copy_of_key[i] = '\0';
       *chan_id = atol(copy_of_key);
 
-      free(copy_of_key);
+      ftl_free(copy_of_key);
       return TRUE;
     }
   }
 
-  free(copy_of_key);
+  ftl_free(copy_of_key);
   return FALSE;
 }
 
+static BOOL _is_valid_ring_slots(int slots) {
+  if (slots == 0) {
+    return TRUE;
+  }
+
+  // A power of two keeps the slot index stable across the 16 bit sequence number rollover.
+  return slots >= MIN_NACK_RB_SIZE && slots <= MAX_NACK_RB_SIZE && (slots & (slots - 1)) == 0;
+}
+
+/*
+ * Number of slots needed to hold retention_ms worth of packets, rounded up to
+ * a power of two.
+ */
+static int _ring_slots_for_packet_rate(int64_t packets_per_sec, int retention_ms, int min_slots) {
+  int64_t packets = packets_per_sec * retention_ms / 1000 + 1;
+  int slots = min_slots;
+
+  while (slots < packets && slots < MAX_NACK_RB_SIZE) {
+    slots <<= 1;
+  }
 
+  return slots;
+}
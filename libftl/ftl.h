@@ -25,6 +25,7 @@
 #ifndef __FTL_H
 #define __FTL_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -93,6 +94,7 @@ typedef enum {
   FTL_INGEST_SOCKET_CLOSED,
   FTL_INGEST_SOCKET_TIMEOUT,
   FTL_INGEST_SERVER_TERMINATE,
+  FTL_MEDIA_REJECTED,           /**< The media arrived after later media of the same type was queued */
 } ftl_status_t;
 
 typedef enum {
@@ -109,7 +111,8 @@ typedef enum {
 typedef enum {
   FTL_VIDEO_NULL, /**< No video for this stream */
   FTL_VIDEO_VP8,  /**< Google's VP8 codec (recommended default) */
-  FTL_VIDEO_H264
+  FTL_VIDEO_H264,
+  FTL_VIDEO_H264_AVCC /**< H264 sent as whole AVCC frames, NALs prefixed with a 4 byte length */
 } ftl_video_codec_t;
 
 /*! \brief Audio codecs supported by FTL
@@ -127,6 +130,50 @@ typedef enum {
   FTL_VIDEO_DATA
 } ftl_media_type_t;
 
+/*! \brief One piece of a media unit, see ftl_media_unit_t.
+*  \ingroup ftl_public
+*/
+typedef struct {
+  const uint8_t *data;
+  int32_t len;
+} ftl_media_buffer_t;
+
+/*! \brief A NAL or an audio packet for ftl_ingest_send_media_batch. The
+*  payload is the concatenation of buffers, which the sdk reads in place.
+*  \ingroup ftl_public
+*/
+typedef struct {
+  ftl_media_type_t media_type;
+  int64_t dts_usec;
+  const ftl_media_buffer_t *buffers;
+  int buffer_count;
+  int end_of_frame;
+} ftl_media_unit_t;
+
+/*! \brief Gives a buffer passed to ftl_ingest_send_video_zero_copy back to
+*  its owner.
+*  \ingroup ftl_public
+*/
+typedef void (*ftl_release_callback_t)(void *context, const uint8_t *data);
+
+/*! \brief Packets queued but not yet sent for one media type.
+*  \ingroup ftl_public
+*/
+typedef struct {
+  int64_t queued_bytes;
+  int queued_packets;
+  int oldest_packet_age_ms; /**< How long the next packet to send has been queued */
+  int rate_kbps;            /**< Rate the send thread is paced at, 0 if it isn't */
+  int drain_time_ms;        /**< Time to send what is queued at rate_kbps, -1 if not paced */
+} ftl_queue_status_t;
+
+/*! \brief Called by the video send thread when the queue's drain time goes
+*  above or comes back below the thresholds given to
+*  ftl_ingest_set_queue_callback. above is 1 in the first case.
+*  \ingroup ftl_public
+*/
+typedef void (*ftl_queue_callback_t)(void *context, const ftl_queue_status_t *status, int above);
+
 /*! \brief Log levels used by libftl; returned via logging callback
 *  \ingroup ftl_public
 */
@@ -146,6 +193,22 @@ typedef enum {
 typedef void(*ftl_logging_function_t)(ftl_log_severity_t log_level, const char * log_message);
 typedef void(*ftl_status_function_t)(ftl_connection_status_t status);
 
+/*! \brief Why the sdk asks the encoder for a key frame.
+*  \ingroup ftl_public
+*/
+typedef enum {
+  FTL_KEYFRAME_STREAM_START,   /**< The stream (re)connected */
+  FTL_KEYFRAME_FRAME_DROPPED,  /**< A reference frame was dropped, later frames are dropped until a key frame */
+  FTL_KEYFRAME_PICTURE_LOSS,   /**< The ingest sent a PLI or FIR */
+} ftl_keyframe_reason_t;
+
+/*! \brief Asks the encoder to make its next frame a key frame. It may run on
+*  an sdk thread or inside a send call with sdk locks held, so it should only
+*  flag the encoder and must not call back into the sdk.
+*  \ingroup ftl_public
+*/
+typedef void(*ftl_keyframe_request_function_t)(void *context, ftl_keyframe_reason_t reason);
+
 typedef struct {
   char const *ingest_hostname;
   char const *stream_key;
@@ -158,6 +221,101 @@ typedef struct {
   char const *vendor_version;
 } ftl_ingest_params_t;
 
+/*! \brief Flags for ftl_ingest_params_ex_t.memory_flags. Each is best effort,
+*  the sdk logs a warning when one can't be applied.
+*  \ingroup ftl_public
+*/
+#define FTL_MEMORY_LOCK 0x1 //pin the packet queues in ram with mlock/VirtualLock
+#define FTL_MEMORY_PREFAULT 0x2 //touch every page of the packet queues at create
+#define FTL_MEMORY_HUGE_PAGES 0x4 //back the packet queues with huge pages
+
+/*! \brief Flags for ftl_ingest_params_ex_t.nal_filter, NALs dropped before
+*  they are packetized.
+*  \ingroup ftl_public
+*/
+#define FTL_NAL_FILTER_FILLER 0x1 //filler data from CBR encoders
+#define FTL_NAL_FILTER_AUD 0x2 //access unit delimiters
+#define FTL_NAL_FILTER_REPEATED_PARAMS 0x4 //SPS and PPS identical to the last ones, key frames still get them
+#define FTL_NAL_FILTER_SEI 0x8 //all SEI except recovery points
+
+/*! \brief Values for ftl_ingest_params_ex_t.pacing, what spaces video
+*  packets out at the paced rate. The kernel backends need Linux and the fq
+*  qdisc on the outgoing interface (tc qdisc replace dev eth0 root fq), the
+*  send thread then wakes once per half pacer_burst_ms instead of per packet.
+*  Without fq the packets leave in bursts of that size. Where the socket
+*  option is missing the sdk logs a warning and paces in user space.
+*  \ingroup ftl_public
+*/
+#define FTL_PACING_USER 0 //the send thread sleeps between packets
+#define FTL_PACING_RATE 1 //SO_MAX_PACING_RATE on the socket, audio and retransmits queue behind video
+#define FTL_PACING_TXTIME 2 //SO_TXTIME departure time on each video packet, audio and retransmits go out right away
+
+/*! \brief Optional per stream tuning for ftl_ingest_create_ex. Any field left
+*  at 0 keeps its default.
+*  \ingroup ftl_public
+*/
+typedef struct {
+  int video_ring_slots; //video packets buffered for sending and retransmission, a power of two from 64 to 32768. 0 sizes the ring from peak_kbps and retention_ms
+  int audio_ring_slots; //audio packets buffered for sending and retransmission, a power of two from 64 to 32768. 0 sizes the ring from the opus packet rate and retention_ms
+  int mtu; //largest RTP packet sent, 256 to 1392 bytes
+  int retention_ms; //how long a sent packet can still be retransmitted
+  int video_ring_max_kb; //memory the video ring may temporarily grow to for key frames that don't fit in it, 0 to never grow
+  int retention_rtt_multiplier; //sent packets expire after this many smoothed round trips, bounded by retention_ms
+  int memory_flags; //FTL_MEMORY_* flags for the memory the packet queues live in
+  ftl_keyframe_request_function_t keyframe_request; //asks the encoder for a key frame instead of waiting for the next one, NULL if it can't
+  void *keyframe_request_context;
+  int keyframe_request_interval_ms; //minimum time between key frame requests
+  int nal_filter; //FTL_NAL_FILTER_* flags, 0 sends every NAL
+  int fast_start; //start on the first key frame without waiting for audio, later audio is aligned to it by dts
+  int low_latency; //profile for intra refresh encoders that rarely send IDRs: implies fast_start and paces video in short bursts
+  int pacer_burst_ms; //largest video burst, in ms at the paced rate, after the send thread was idle. 100 by default, 20 with low_latency
+  int pacer_rate_percent; //video is paced at this percent of the target bitrate, 50 to 400
+  int pacing; //FTL_PACING_* backend
+} ftl_ingest_params_ex_t;
+
+/*! \brief NAL payload bytes ftl_ingest_params_ex_t.nal_filter kept off the
+*  wire, by NAL type.
+*  \ingroup ftl_public
+*/
+typedef struct {
+  int64_t filler_bytes;
+  int64_t aud_bytes;
+  int64_t sei_bytes;
+  int64_t sps_bytes;
+  int64_t pps_bytes;
+  int64_t injected_bytes; //cached parameter sets sent with key frames that came without them
+} ftl_nal_filter_stats_t;
+
+/*! \brief What an sdk allocation is used for. The tags also separate the
+*  size classes: packet queues are few and large, the rest are small.
+*  \ingroup ftl_public
+*/
+typedef enum {
+  FTL_ALLOC_HANDLE, /**< the handle and its copies of the stream key and hostnames, lives until ftl_ingest_destroy */
+  FTL_ALLOC_PACKET_QUEUE, /**< packet rings and the receive buffer, the bulk of a stream's memory */
+  FTL_ALLOC_CONNECTION, /**< addresses and buffers used while connecting */
+  FTL_ALLOC_INGEST_LIST, /**< ingest discovery results */
+  FTL_ALLOC_TAG_COUNT
+} ftl_alloc_tag_t;
+
+/*! \brief Memory callbacks for ftl_set_allocator. alloc must return memory
+*  aligned like malloc or NULL. free gets back the size and tag alloc was called with.
+*  \ingroup ftl_public
+*/
+typedef struct {
+  void *(*alloc)(void *context, size_t size, ftl_alloc_tag_t tag);
+  void (*free)(void *context, void *ptr, size_t size, ftl_alloc_tag_t tag);
+  void *context;
+} ftl_allocator_t;
+
+/*! \brief Memory a handle currently holds, see ftl_get_memory_usage.
+*  \ingroup ftl_public
+*/
+typedef struct {
+  int64_t total_bytes;
+  int64_t bytes[FTL_ALLOC_TAG_COUNT]; //indexed by ftl_alloc_tag_t
+} ftl_memory_usage_t;
+
 typedef struct {
   int pkts_sent;
   int nack_requests;
@@ -220,6 +378,7 @@ typedef struct {
   int64_t lost;
   int64_t recovered;
   int64_t late;
+  int64_t expired; //retransmit requests for packets past the retention window
 }ftl_packet_stats_msg_t;
 
 typedef struct {
@@ -241,6 +400,9 @@ typedef struct {
   int64_t bw_throttling_count;
   int queue_fullness;
   int max_frame_size;
+  int64_t keyframe_requests; //total since the stream started
+  int max_recovery_ms; //longest wait for a key frame after frames were dropped, over the period
+  int first_packet_ms; //from the media connection to the first video packet sent, -1 until then
 }ftl_video_frame_stats_msg_t;
 
 typedef enum
@@ -286,6 +448,17 @@ typedef struct
     } msg;
 }ftl_status_msg_t;
 
+/*!
+* \ingroup ftl_public
+* \brief Routes every allocation the sdk makes through allocator. Must be
+* called before ftl_init, NULL restores malloc and free. With an allocator set
+* the packet queues come from it too and ftl_ingest_params_ex_t.memory_flags
+* are ignored.
+*
+* @returns FTL_CONFIG_ERROR if ftl_init was already called or a callback is missing.
+*/
+FTL_API ftl_status_t ftl_set_allocator(const ftl_allocator_t *allocator);
+
 /*!
 * \ingroup ftl_public
 * \brief FTL Initialization
@@ -306,6 +479,20 @@ FTL_API ftl_status_t ftl_init();
 
 FTL_API ftl_status_t ftl_ingest_create(ftl_handle_t *ftl_handle, ftl_ingest_params_t *params);
 
+/*!
+* \ingroup ftl_public
+* \brief Same as ftl_ingest_create with control over the per stream packet
+* buffers. Sizing the rings to the stream's bitrate and the round trip time to
+* the ingest lets low bitrate streams use a fraction of the default memory.
+*
+* All packet queues are preallocated here, after ftl_ingest_connect returns
+* the sdk doesn't allocate until ftl_ingest_disconnect, apart from
+* ftl_ingest_update_params copying a new ingest hostname.
+*
+* @returns FTL_CONFIG_ERROR if params_ex is out of range.
+*/
+FTL_API ftl_status_t ftl_ingest_create_ex(ftl_handle_t *ftl_handle, ftl_ingest_params_t *params, ftl_ingest_params_ex_t *params_ex);
+
 FTL_API ftl_status_t ftl_ingest_connect(ftl_handle_t *ftl_handle);
 
 FTL_API int ftl_ingest_speed_test(ftl_handle_t *ftl_handle, int speed_kbps, int duration_ms);
@@ -314,8 +501,81 @@ FTL_API ftl_status_t ftl_ingest_speed_test_ex(ftl_handle_t *ftl_handle, int spee
 // Deprecated! Please use the DTS version.
 FTL_API int ftl_ingest_send_media(ftl_handle_t *ftl_handle, ftl_media_type_t media_type, uint8_t *data, int32_t len, int end_of_frame);
 
+// With FTL_VIDEO_H264_AVCC each video call carries a whole frame and end_of_frame is ignored.
 FTL_API int ftl_ingest_send_media_dts(ftl_handle_t *ftl_handle, ftl_media_type_t media_type, int64_t dts_usec, uint8_t *data, int32_t len, int end_of_frame);
 
+/*!
+* \ingroup ftl_public
+* \brief Queues one NAL or audio packet and may be called from several
+* threads at once, for example by the slice threads of an encoder. Video is
+* queued in dts order and, within a frame, in nal_index order: the NALs of a
+* frame are numbered from 0 and the last one sets end_of_frame. A call blocks
+* until its unit is queued, waiting a short time for the NALs before it. Audio
+* is queued in dts order among the calls waiting at the same time.
+*
+* @returns FTL_SUCCESS when the unit was queued. Otherwise says why it was
+* not: FTL_NOT_CONNECTED, FTL_QUEUE_FULL when the packet queue or the number
+* of waiting threads is exhausted, FTL_STATUS_WAITING_FOR_KEY_FRAME while
+* frames are dropped until the next key frame, FTL_NOT_ACTIVE_STREAM before
+* the other media type has started and FTL_MEDIA_REJECTED for units that come
+* after their frame was finished or given up on.
+*/
+FTL_API ftl_status_t ftl_ingest_submit_media(ftl_handle_t *ftl_handle, ftl_media_type_t media_type, int64_t dts_usec, int nal_index, uint8_t *data, int32_t len, int end_of_frame);
+
+/*!
+* \ingroup ftl_public
+* \brief Queues several media units, for example a whole access unit of
+* SPS, PPS, SEI and slices plus the audio that goes with it, taking the media
+* locks once and waking the send threads once at the end. Each unit behaves
+* like a call to ftl_ingest_send_media_dts.
+*
+* @returns the number of bytes queued.
+*/
+FTL_API int ftl_ingest_send_media_batch(ftl_handle_t *ftl_handle, const ftl_media_unit_t *units, int unit_count);
+
+/*!
+* \ingroup ftl_public
+* \brief Queues a whole H.264 access unit in Annex-B format, NALs separated
+* by 00 00 01 or 00 00 00 01 start codes. The sdk finds the NAL boundaries
+* and packetizes straight from data, the last NAL ends the frame. Bytes in
+* front of the first start code are ignored.
+*
+* @returns the number of bytes queued.
+*/
+FTL_API int ftl_ingest_send_video_annexb(ftl_handle_t *ftl_handle, int64_t dts_usec, const uint8_t *data, int32_t len);
+
+/*!
+* \ingroup ftl_public
+* \brief Queues one NAL like ftl_ingest_send_media_dts, but the packets point
+* into data instead of holding a copy of it. The buffer must stay untouched
+* until release is called, which happens exactly once: when all of its
+* packets have been sent and can no longer be retransmitted, on disconnect, or
+* before this call returns if the NAL is dropped or had to be copied.
+*
+* @returns the number of bytes queued.
+*/
+FTL_API int ftl_ingest_send_video_zero_copy(ftl_handle_t *ftl_handle, int64_t dts_usec, const uint8_t *data, int32_t len, int end_of_frame, ftl_release_callback_t release, void *context);
+
+/*!
+* \ingroup ftl_public
+* \brief Reads media from a shared memory ring an encoder process fills with
+* the ftl_shm_producer functions in ftl_shm.h. A thread of the sdk queues each
+* unit as it is published, video by reference like
+* ftl_ingest_send_video_zero_copy, and gives its slot back once the packets
+* are done with. Units published before attaching are skipped.
+*
+* @returns FTL_CONFIG_ERROR if there is no ring of that name or it doesn't
+* match this version, FTL_ALREADY_CONNECTED if a ring is already attached.
+*/
+FTL_API ftl_status_t ftl_ingest_attach_shm(ftl_handle_t *ftl_handle, const char *name);
+
+/*!
+* \ingroup ftl_public
+* \brief Stops reading the shared memory ring. Video still queued from it keeps
+* the ring mapped until it is sent or the stream disconnects.
+*/
+FTL_API ftl_status_t ftl_ingest_detach_shm(ftl_handle_t *ftl_handle);
+
 FTL_API ftl_status_t ftl_ingest_get_status(ftl_handle_t *ftl_handle, ftl_status_msg_t *msg, int ms_timeout);
 
 FTL_API ftl_status_t ftl_ingest_update_params(ftl_handle_t *ftl_handle, ftl_ingest_params_t *params);
@@ -330,6 +590,38 @@ FTL_API ftl_status_t ftl_find_closest_available_ingest(const char* ingestHosts[]
 
 FTL_API ftl_status_t ftl_get_video_stats(ftl_handle_t* handle, uint64_t* frames_sent, uint64_t* nacks_received, uint64_t* rtt_recorded, uint64_t* frames_dropped, float* queue_fullness);
 
+// Bytes saved by the NAL filter since the stream connected.
+FTL_API ftl_status_t ftl_get_nal_filter_stats(ftl_handle_t *handle, ftl_nal_filter_stats_t *stats);
+
+/*!
+* \ingroup ftl_public
+* \brief Reports the memory the handle holds by ftl_alloc_tag_t, including the
+* handle itself. Thread stacks and socket buffers aren't counted.
+*/
+FTL_API ftl_status_t ftl_get_memory_usage(ftl_handle_t *ftl_handle, ftl_memory_usage_t *usage);
+
+/*!
+* \ingroup ftl_public
+* \brief Reports how much of media_type is waiting to be sent. Doesn't take
+* any locks, so it is cheap enough to call for every frame, and the numbers
+* may be a packet or two apart from each other.
+*
+* @returns FTL_NOT_CONNECTED when not streaming.
+*/
+FTL_API ftl_status_t ftl_ingest_get_queue_status(ftl_handle_t *ftl_handle, ftl_media_type_t media_type, ftl_queue_status_t *status);
+
+/*!
+* \ingroup ftl_public
+* \brief Calls callback once the video queue needs high_drain_ms or more to
+* drain at the paced rate and again once it is back to low_drain_ms or less,
+* letting an encoder lower its quality before frames are dropped. The callback
+* runs on the send thread and must return quickly. NULL removes it. Must be
+* set while not connected.
+*
+* @returns FTL_CONFIG_ERROR if low_drain_ms isn't below high_drain_ms.
+*/
+FTL_API ftl_status_t ftl_ingest_set_queue_callback(ftl_handle_t *ftl_handle, ftl_queue_callback_t callback, void *context, int high_drain_ms, int low_drain_ms);
+
 FTL_API ftl_status_t ftl_adaptive_bitrate_thread(
     ftl_handle_t* ftl_handle,
     void* context,
@@ -0,0 +1,635 @@
+#ifndef __FTL_HPP
+#define __FTL_HPP
+
+/*! \file ftl.hpp - C++20 wrapper for the FTL SDK
+*
+* Header only, everything forwards to the C API in ftl.h. The send calls are
+* inline and pass straight through. The only allocation is the stream state
+* made at create, which also holds the owners of send_video_owned buffers and
+* the two threads the async calls use. Nothing here throws, failures come back
+* as ftl_status_t like in C.
+*/
+
+#include "ftl.h"
+
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <concepts>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <ranges>
+#include <span>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace ftl {
+
+/*! \brief Timestamps are microseconds on the caller's clock, the same for
+*  audio and video. Coarser durations convert implicitly.
+*/
+using timestamp = std::chrono::microseconds;
+
+/*! \brief A status and the value it came with, the value is only meaningful
+*  when status is FTL_SUCCESS.
+*/
+template <class T>
+struct result {
+  ftl_status_t status = FTL_NOT_INITIALIZED;
+  T value{};
+
+  explicit operator bool() const noexcept { return status == FTL_SUCCESS; }
+};
+
+namespace detail {
+
+// Owners of send_video_owned buffers live in slots of the stream state, as
+// many as libftl holds zero copy buffers at once.
+inline constexpr std::size_t owned_slot_bytes = 32;
+inline constexpr int owned_slot_count = 256;
+
+} // namespace detail
+
+/*! \brief A buffer send_video_owned can take over: a contiguous range of bytes
+*  handed over by move, no bigger than a std::string and moved without
+*  throwing. Its destructor runs once libftl is done with the data.
+*/
+template <class B>
+concept owned_bytes = std::is_object_v<B> && std::is_nothrow_move_constructible_v<B> &&
+  sizeof(B) <= detail::owned_slot_bytes && alignof(B) <= alignof(std::max_align_t) &&
+  std::ranges::contiguous_range<B> && std::ranges::sized_range<B> &&
+  sizeof(std::ranges::range_value_t<B>) == 1;
+
+namespace detail {
+
+// Work queued on a worker. run returns the coroutine to resume once the job
+// is finished with, if any.
+struct job {
+  std::coroutine_handle<> (*run)(job *) = nullptr;
+  void *context = nullptr;
+  job *next = nullptr;
+  enum { idle, queued, running } state = idle;
+};
+
+// A thread running jobs in order, started by start or the first post and
+// joined by stop. The queue is intrusive so posting never allocates.
+class worker {
+public:
+  worker() noexcept = default;
+  worker(const worker &) = delete;
+  worker &operator=(const worker &) = delete;
+  ~worker() { stop(); }
+
+  bool start() noexcept {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return start_locked();
+  }
+
+  //! False if the thread can't start or is stopping, j won't run then.
+  bool post(job *j) noexcept {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!start_locked()) {
+      return false;
+    }
+    if (j->state != job::queued) {
+      j->next = nullptr;
+      j->state = job::queued;
+      *tail_ = j;
+      tail_ = &j->next;
+      wake_.notify_one();
+    }
+    return true;
+  }
+
+  //! Takes j off the queue, or waits for it to finish if it's running.
+  void cancel(job *j) noexcept {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (j->state == job::queued) {
+      job **link = &head_;
+      while (*link != j) {
+        link = &(*link)->next;
+      }
+      if ((*link = j->next) == nullptr) {
+        tail_ = link;
+      }
+      j->state = job::idle;
+      return;
+    }
+    done_.wait(lock, [j] { return j->state != job::running; });
+  }
+
+  //! Jobs still queued never run. Can be called from a coroutine the worker
+  //! resumed, the thread is then left to return on its own.
+  void stop() noexcept {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
+    for (job *j = head_; j != nullptr; j = j->next) {
+      j->state = job::idle;
+    }
+    head_ = nullptr;
+    tail_ = &head_;
+
+    if (thread_.joinable() && thread_.get_id() == std::this_thread::get_id()) {
+      *stopped_from_job_ = true;
+      thread_.detach();
+      return;
+    }
+
+    lock.unlock();
+    wake_.notify_all();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+private:
+  bool start_locked() noexcept {
+    if (stopping_) {
+      return false;
+    }
+    if (thread_.joinable()) {
+      return true;
+    }
+#if defined(__cpp_exceptions) || defined(_CPPUNWIND)
+    try {
+      thread_ = std::thread([this] { loop(); });
+    }
+    catch (...) {
+      return false;
+    }
+#else
+    thread_ = std::thread([this] { loop(); });
+#endif
+    return true;
+  }
+
+  void loop() noexcept {
+    bool stopped = false;
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopped_from_job_ = &stopped;
+
+    while (true) {
+      wake_.wait(lock, [this] { return head_ != nullptr || stopping_; });
+      if (stopping_) {
+        return;
+      }
+
+      job *j = head_;
+      if ((head_ = j->next) == nullptr) {
+        tail_ = &head_;
+      }
+      j->state = job::running;
+      lock.unlock();
+
+      std::coroutine_handle<> h = j->run(j);
+
+      lock.lock();
+      j->state = job::idle;
+      done_.notify_all();
+      lock.unlock();
+
+      // The coroutine may destroy the stream and this worker with it.
+      if (h) {
+        h.resume();
+        if (stopped) {
+          return;
+        }
+      }
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  job *head_ = nullptr;
+  job **tail_ = &head_;
+  bool stopping_ = false;
+  bool *stopped_from_job_ = nullptr;
+  std::thread thread_;
+};
+
+struct stream_state;
+
+struct owned_slot {
+  alignas(std::max_align_t) unsigned char storage[owned_slot_bytes];
+  void (*destroy)(void *storage) = nullptr;
+  stream_state *state = nullptr;
+};
+
+// State the C callbacks point at, on the heap so Stream can move.
+struct stream_state {
+  std::mutex mutex;
+  bool above = false; //queue drain time is over the high threshold
+  std::coroutine_handle<> drained_waiter; //suspended in Session::drained
+  std::coroutine_handle<> drained_resume; //handed to the resumer
+  job drained_job;
+  worker calls; //blocking C calls of the async functions
+  worker resumer; //resumes coroutines, so the send thread never does
+  owned_slot slots[owned_slot_count];
+  std::atomic<uint64_t> slots_used[owned_slot_count / 64] = {};
+
+  stream_state() noexcept {
+    drained_job.run = &resume_drained;
+    drained_job.context = this;
+    for (owned_slot &slot : slots) {
+      slot.state = this;
+    }
+  }
+
+  owned_slot *acquire_slot() noexcept {
+    for (int i = 0; i < owned_slot_count / 64; i++) {
+      uint64_t used = slots_used[i].load(std::memory_order_relaxed);
+      while (used != ~uint64_t(0)) {
+        int bit = std::countr_one(used);
+        if (slots_used[i].compare_exchange_weak(used, used | (uint64_t(1) << bit), std::memory_order_acquire, std::memory_order_relaxed)) {
+          return &slots[i * 64 + bit];
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  void release_slot(owned_slot *slot) noexcept {
+    std::ptrdiff_t index = slot - slots;
+    slots_used[index / 64].fetch_and(~(uint64_t(1) << (index % 64)), std::memory_order_release);
+  }
+
+  static void queue_callback(void *context, const ftl_queue_status_t *, int above) {
+    auto *state = static_cast<stream_state *>(context);
+    bool post = false;
+
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      state->above = (above != 0);
+      if (!above && state->drained_waiter) {
+        state->drained_resume = std::exchange(state->drained_waiter, nullptr);
+        post = true;
+      }
+    }
+
+    // Never resume on the send thread.
+    if (post) {
+      state->resumer.post(&state->drained_job);
+    }
+  }
+
+  static std::coroutine_handle<> resume_drained(job *j) noexcept {
+    auto *state = static_cast<stream_state *>(j->context);
+    std::lock_guard<std::mutex> lock(state->mutex);
+    return std::exchange(state->drained_resume, nullptr);
+  }
+
+  // A coroutine suspended in drained() is being destroyed.
+  void forget_drained(std::coroutine_handle<> h) noexcept {
+    bool posted;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (drained_waiter == h) {
+        drained_waiter = nullptr;
+      }
+      if ((posted = (drained_resume == h))) {
+        drained_resume = nullptr;
+      }
+    }
+
+    if (posted) {
+      resumer.cancel(&drained_job);
+    }
+  }
+};
+
+// Runs a blocking C call on the stream's call thread and resumes the
+// coroutine on its resumer, or runs the call in place if there is no thread.
+// Destroying a coroutine suspended here waits for the call to return.
+template <class F>
+class blocking_awaitable {
+public:
+  blocking_awaitable(stream_state *state, F fn) noexcept : state_(state), fn_(std::move(fn)) {
+    call_.run = &call;
+    call_.context = this;
+    resume_.run = &resume;
+    resume_.context = this;
+  }
+  blocking_awaitable(const blocking_awaitable &) = delete;
+  blocking_awaitable &operator=(const blocking_awaitable &) = delete;
+  ~blocking_awaitable() {
+    if (state_ != nullptr) {
+      state_->calls.cancel(&call_);
+      state_->resumer.cancel(&resume_);
+    }
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> h) noexcept {
+    handle_ = h;
+    if (state_ != nullptr && state_->calls.post(&call_)) {
+      return true;
+    }
+    value_ = fn_();
+    return false;
+  }
+
+  auto await_resume() noexcept { return std::move(value_); }
+
+private:
+  static std::coroutine_handle<> call(job *j) noexcept {
+    auto *self = static_cast<blocking_awaitable *>(j->context);
+    self->value_ = self->fn_();
+
+    // The next call shouldn't wait on the coroutine, unless there's no resumer.
+    return self->state_->resumer.post(&self->resume_) ? nullptr : self->handle_;
+  }
+
+  static std::coroutine_handle<> resume(job *j) noexcept {
+    return static_cast<blocking_awaitable *>(j->context)->handle_;
+  }
+
+  stream_state *state_;
+  F fn_;
+  std::invoke_result_t<F &> value_{};
+  std::coroutine_handle<> handle_;
+  job call_;
+  job resume_;
+};
+
+template <class B>
+struct unique_array : std::false_type {};
+
+// unique_ptr arrays with a stateless deleter travel in the context pointer.
+template <class T, class D>
+struct unique_array<std::unique_ptr<T[], D>> : std::bool_constant<std::is_empty_v<D> && std::is_default_constructible_v<D>> {};
+
+} // namespace detail
+
+/*! \brief A connection to the ingest, from Stream::connect until it is
+*  destroyed, which disconnects. Move only. Must not outlive its Stream.
+*
+*  Sends taking a span copy the data before they return. send_video_owned
+*  takes the buffer over instead and packetizes straight from it.
+*/
+class Session {
+public:
+  Session() noexcept = default;
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+  Session(Session &&other) noexcept : handle_(std::exchange(other.handle_, ftl_handle_t{})), state_(std::exchange(other.state_, nullptr)) {}
+  Session &operator=(Session &&other) noexcept {
+    if (this != &other) {
+      disconnect();
+      handle_ = std::exchange(other.handle_, ftl_handle_t{});
+      state_ = std::exchange(other.state_, nullptr);
+    }
+    return *this;
+  }
+  ~Session() { disconnect(); }
+
+  explicit operator bool() const noexcept { return handle_.priv != nullptr; }
+
+  ftl_status_t disconnect() noexcept {
+    if (handle_.priv == nullptr) {
+      return FTL_NOT_CONNECTED;
+    }
+    ftl_status_t status = ftl_ingest_disconnect(&handle_);
+    handle_.priv = nullptr;
+    return status;
+  }
+
+  // Not noexcept so these stay tail calls into the C API, which can't throw
+  // anyway. It takes mutable pointers but only reads the media.
+  int send_video(std::span<const uint8_t> nal, timestamp dts, bool end_of_frame) {
+    return ftl_ingest_send_media_dts(&handle_, FTL_VIDEO_DATA, dts.count(), const_cast<uint8_t *>(nal.data()), (int32_t)nal.size(), end_of_frame);
+  }
+
+  int send_audio(std::span<const uint8_t> packet, timestamp dts) {
+    return ftl_ingest_send_media_dts(&handle_, FTL_AUDIO_DATA, dts.count(), const_cast<uint8_t *>(packet.data()), (int32_t)packet.size(), 0);
+  }
+
+  int send_annexb(std::span<const uint8_t> access_unit, timestamp dts) {
+    return ftl_ingest_send_video_annexb(&handle_, dts.count(), access_unit.data(), (int32_t)access_unit.size());
+  }
+
+  int send_batch(std::span<const ftl_media_unit_t> units) {
+    return ftl_ingest_send_media_batch(&handle_, units.data(), (int)units.size());
+  }
+
+  ftl_status_t submit(ftl_media_type_t media_type, timestamp dts, int nal_index, std::span<const uint8_t> data, bool end_of_frame) {
+    return ftl_ingest_submit_media(&handle_, media_type, dts.count(), nal_index, const_cast<uint8_t *>(data.data()), (int32_t)data.size(), end_of_frame);
+  }
+
+  /*! \brief Queues one NAL by reference like ftl_ingest_send_video_zero_copy,
+  *  taking the buffer over. It is destroyed once its packets can no longer be
+  *  retransmitted, or before this returns if the NAL was dropped or copied.
+  *  The owner is kept in the stream state, the NAL is copied when all of its
+  *  slots are taken.
+  */
+  template <owned_bytes B>
+  int send_video_owned(B &&buffer, timestamp dts, bool end_of_frame) {
+    using buffer_t = std::remove_cvref_t<B>;
+    detail::owned_slot *slot = (state_ != nullptr) ? state_->acquire_slot() : nullptr;
+
+    if (slot == nullptr) {
+      buffer_t owned(std::move(buffer));
+      return send_video(std::span<const uint8_t>(reinterpret_cast<const uint8_t *>(std::ranges::data(owned)), std::ranges::size(owned)), dts, end_of_frame);
+    }
+
+    // Moving a vector keeps its data where it was, the slot only holds it.
+    auto *owned = ::new (slot->storage) buffer_t(std::move(buffer));
+    slot->destroy = [](void *storage) { std::destroy_at(std::launder(static_cast<buffer_t *>(storage))); };
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(std::ranges::data(*owned));
+    auto len = (int32_t)std::ranges::size(*owned);
+
+    return ftl_ingest_send_video_zero_copy(&handle_, dts.count(), data, len, end_of_frame,
+      [](void *context, const uint8_t *) {
+        auto *slot = static_cast<detail::owned_slot *>(context);
+        slot->destroy(slot->storage);
+        slot->state->release_slot(slot);
+      }, slot);
+  }
+
+  /*! \brief Same as above for a unique_ptr array of len bytes with a
+  *  stateless deleter, without allocating.
+  */
+  template <class T, class D>
+    requires (sizeof(T) == 1 && detail::unique_array<std::unique_ptr<T[], D>>::value)
+  int send_video_owned(std::unique_ptr<T[], D> &&buffer, std::size_t len, timestamp dts, bool end_of_frame) {
+    T *data = buffer.release();
+
+    return ftl_ingest_send_video_zero_copy(&handle_, dts.count(), reinterpret_cast<const uint8_t *>(data), (int32_t)len, end_of_frame,
+      [](void *context, const uint8_t *) { D()(static_cast<T *>(context)); }, data);
+  }
+
+  result<ftl_queue_status_t> queue_status(ftl_media_type_t media_type = FTL_VIDEO_DATA) {
+    result<ftl_queue_status_t> r;
+    r.status = ftl_ingest_get_queue_status(&handle_, media_type, &r.value);
+    return r;
+  }
+
+  /*! \brief co_await resumes once the video queue is back below the low
+  *  threshold given to Stream::create, right away if it isn't above the high
+  *  one or the Session isn't connected. Never resumes without backpressure
+  *  thresholds. One waiter at a time, resumed on the stream's resume thread.
+  */
+  auto drained() noexcept {
+    class awaitable {
+    public:
+      explicit awaitable(detail::stream_state *state) noexcept : state_(state) {}
+      awaitable(const awaitable &) = delete;
+      awaitable &operator=(const awaitable &) = delete;
+      ~awaitable() {
+        if (handle_) {
+          state_->forget_drained(handle_);
+        }
+      }
+
+      bool await_ready() const noexcept {
+        if (state_ == nullptr) {
+          return true;
+        }
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        return !state_->above;
+      }
+
+      bool await_suspend(std::coroutine_handle<> h) noexcept {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        if (!state_->above) {
+          return false;
+        }
+        state_->drained_waiter = handle_ = h;
+        return true;
+      }
+
+      void await_resume() const noexcept {}
+
+    private:
+      detail::stream_state *state_;
+      std::coroutine_handle<> handle_;
+    };
+
+    return awaitable(state_);
+  }
+
+private:
+  friend class Stream;
+
+  Session(ftl_handle_t handle, detail::stream_state *state) noexcept : handle_(handle), state_(state) {}
+
+  ftl_handle_t handle_{};
+  detail::stream_state *state_ = nullptr;
+};
+
+/*! \brief An ingest handle, from create to destruction. Move only.
+*
+*  The async calls run on a thread of the stream and resume the coroutine on
+*  another, both joined when the stream is destroyed. A call already running
+*  then finishes and resumes first, the others never resume. Awaitables must
+*  not outlive the stream.
+*/
+class Stream {
+public:
+  Stream() noexcept = default;
+  Stream(const Stream &) = delete;
+  Stream &operator=(const Stream &) = delete;
+  Stream(Stream &&other) noexcept : handle_(std::exchange(other.handle_, ftl_handle_t{})), state_(std::move(other.state_)) {}
+  Stream &operator=(Stream &&other) noexcept {
+    if (this != &other) {
+      destroy();
+      handle_ = std::exchange(other.handle_, ftl_handle_t{});
+      state_ = std::move(other.state_);
+    }
+    return *this;
+  }
+  ~Stream() { destroy(); }
+
+  explicit operator bool() const noexcept { return handle_.priv != nullptr; }
+
+  /*! \brief ftl_ingest_create_ex, plus the queue callback behind
+  *  Session::drained when high_drain_ms is set. ex may be NULL.
+  */
+  static result<Stream> create(ftl_ingest_params_t &params, ftl_ingest_params_ex_t *ex = nullptr, int high_drain_ms = 0, int low_drain_ms = 0) {
+    result<Stream> r;
+    Stream &stream = r.value;
+
+    stream.state_.reset(new (std::nothrow) detail::stream_state());
+    if (stream.state_ == nullptr) {
+      r.status = FTL_MALLOC_FAILURE;
+      return r;
+    }
+
+    if ((r.status = ftl_ingest_create_ex(&stream.handle_, &params, ex)) != FTL_SUCCESS) {
+      stream.handle_.priv = nullptr;
+      return r;
+    }
+
+    if (high_drain_ms > 0) {
+      // Started now, the send thread posts to it but mustn't start threads.
+      if (!stream.state_->resumer.start()) {
+        r.status = FTL_MALLOC_FAILURE;
+        return r;
+      }
+      r.status = ftl_ingest_set_queue_callback(&stream.handle_, &detail::stream_state::queue_callback, stream.state_.get(), high_drain_ms, low_drain_ms);
+    }
+
+    return r;
+  }
+
+  result<Session> connect() { return connect(handle_, state_.get()); }
+
+  //! co_await gives the result of connect.
+  auto connect_async() noexcept {
+    return detail::blocking_awaitable(state_.get(), [handle = handle_, state = state_.get()] { return connect(handle, state); });
+  }
+
+  result<ftl_status_msg_t> next_status(std::chrono::milliseconds timeout) { return next_status(handle_, timeout); }
+
+  //! co_await gives the next status message.
+  auto next_status_async(std::chrono::milliseconds timeout) noexcept {
+    return detail::blocking_awaitable(state_.get(), [handle = handle_, timeout] { return next_status(handle, timeout); });
+  }
+
+  ftl_status_t attach_shm(const char *name) { return ftl_ingest_attach_shm(&handle_, name); }
+  ftl_status_t detach_shm() { return ftl_ingest_detach_shm(&handle_); }
+
+  ftl_handle_t *native_handle() noexcept { return &handle_; }
+
+private:
+  // The C calls only use the handle's priv pointer, copies work as well.
+  static result<Session> connect(ftl_handle_t handle, detail::stream_state *state) {
+    result<Session> r;
+    if ((r.status = ftl_ingest_connect(&handle)) == FTL_SUCCESS) {
+      r.value = Session(handle, state);
+    }
+    return r;
+  }
+
+  static result<ftl_status_msg_t> next_status(ftl_handle_t handle, std::chrono::milliseconds timeout) {
+    result<ftl_status_msg_t> r;
+    r.status = ftl_ingest_get_status(&handle, &r.value, (int)timeout.count());
+    return r;
+  }
+
+  void destroy() noexcept {
+    if (state_ != nullptr) {
+      state_->calls.stop();
+      state_->resumer.stop();
+    }
+    if (handle_.priv != nullptr) {
+      ftl_ingest_destroy(&handle_);
+    }
+  }
+
+  ftl_handle_t handle_{};
+  std::unique_ptr<detail::stream_state> state_;
+};
+
+} // namespace ftl
+
+#endif
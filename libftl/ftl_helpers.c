@@ -26,6 +26,25 @@
 #include "ftl_private.h"
 #include "hmac/hmac.h"
 
+static void *_default_alloc(void *context, size_t size, ftl_alloc_tag_t tag);
+static void _default_free(void *context, void *ptr, size_t size, ftl_alloc_tag_t tag);
+
+static ftl_allocator_t ftl_allocator = { _default_alloc, _default_free, NULL };
+
+/*
+ * Every allocation is preceded by this header so free can hand the size and
+ * tag back to the allocator and take them off the owning handle's usage.
+ */
+typedef union {
+  struct {
+    ftl_stream_configuration_private_t *owner;
+    size_t size;
+    ftl_alloc_tag_t tag;
+  } info;
+  long double align;
+  void *align_ptr;
+} alloc_header_t;
+
 /*
     Please note that throughout the code, we send "\r\n\r\n", where a normal newline ("\n") would suffice.
     This is done due to some firewalls / anti-malware systems not passing our packets through when we don't send those double-windows-newlines.
@@ -115,11 +134,7 @@ int ftl_get_hmac(SOCKET sock, char * auth_key, char * dst) {
     }
 
     int messageLen = len / 2;
-    unsigned char *msg;
-
-    if( (msg = (unsigned char*)malloc(messageLen * sizeof(*msg))) == NULL){
-        return 0;
-    }
+    unsigned char msg[1024]; // the response is at most 2048 bytes of hex
 
     int i;
     const char *hexMsgBuf = buf + 4;
@@ -129,7 +144,6 @@ int ftl_get_hmac(SOCKET sock, char * auth_key, char * dst) {
     }
 
     hmacsha512(auth_key, msg, messageLen, dst);
-    free(msg);
     return 1;
 }
 
@@ -149,6 +163,7 @@ const char * ftl_video_codec_to_string(ftl_video_codec_t codec) {
     case FTL_VIDEO_NULL: return "";
     case FTL_VIDEO_VP8: return "VP8";
     case FTL_VIDEO_H264: return "H264";
+    case FTL_VIDEO_H264_AVCC: return "H264";
   }
 
   // Should be never reached
@@ -188,12 +203,15 @@ ftl_status_t enqueue_status_msg(ftl_stream_configuration_private_t *ftl, ftl_sta
 
   os_lock_mutex(&ftl->status_q.mutex);
 
-  if ( (elmt = (status_queue_elmt_t*)malloc(sizeof(status_queue_elmt_t))) == NULL) {
-    fprintf(stderr, "Unable to allocate status msg");
-    return FTL_MALLOC_FAILURE;
+  // The pool has one element more than the queue holds, so this only fails
+  // if the handle was never initialized.
+  if ((elmt = ftl->status_q.free_list) == NULL) {
+    os_unlock_mutex(&ftl->status_q.mutex);
+    return FTL_QUEUE_FULL;
   }
+  ftl->status_q.free_list = elmt->next;
 
-  memcpy(&elmt->stats_msg, stats_msg, sizeof(status_queue_elmt_t));
+  memcpy(&elmt->stats_msg, stats_msg, sizeof(elmt->stats_msg));
   elmt->next = NULL;
 
   if (ftl->status_q.head == NULL) {
@@ -215,7 +233,8 @@ ftl_status_t enqueue_status_msg(ftl_stream_configuration_private_t *ftl, ftl_sta
   if (ftl->status_q.count >= MAX_STATUS_MESSAGE_QUEUED) {
     elmt = ftl->status_q.head;
     ftl->status_q.head = elmt->next;
-    free(elmt);
+    elmt->next = ftl->status_q.free_list;
+    ftl->status_q.free_list = elmt;
     retval = FTL_QUEUE_FULL;
   }
   else {
@@ -247,7 +266,8 @@ ftl_status_t dequeue_status_msg(ftl_stream_configuration_private_t *ftl, ftl_sta
     elmt = ftl->status_q.head;
     memcpy(stats_msg, &elmt->stats_msg, sizeof(elmt->stats_msg));
     ftl->status_q.head = elmt->next;
-    free(elmt);
+    elmt->next = ftl->status_q.free_list;
+    ftl->status_q.free_list = elmt;
     ftl->status_q.count--;
   }
   else {
@@ -265,6 +285,10 @@ ftl_status_t _set_ingest_hostname(ftl_stream_configuration_private_t *ftl) {
 
   ftl_status_t ret_status = FTL_SUCCESS;
 
+  // Drop the hostname of an earlier connect.
+  ftl_free(ftl->ingest_hostname);
+  ftl->ingest_hostname = NULL;
+
   do {
 #ifndef DISABLE_AUTO_INGEST
       if (strcmp(ftl->param_ingest_hostname, "auto") == 0) {
@@ -272,7 +296,7 @@ ftl_status_t _set_ingest_hostname(ftl_stream_configuration_private_t *ftl) {
       }
       else
 #endif
-    ftl->ingest_hostname = _strdup(ftl->param_ingest_hostname);
+    ftl->ingest_hostname = ftl_strdup(ftl, ftl->param_ingest_hostname, FTL_ALLOC_HANDLE);
   } while (0);
   
   return ret_status;
@@ -297,3 +321,98 @@ int _get_remote_ip(struct sockaddr *addr, size_t addrlen, char *remote_ip, size_
 
   return 0;
 }
+
+static void *_default_alloc(void *context, size_t size, ftl_alloc_tag_t tag) {
+  (void)context;
+  (void)tag;
+
+  return malloc(size);
+}
+
+static void _default_free(void *context, void *ptr, size_t size, ftl_alloc_tag_t tag) {
+  (void)context;
+  (void)size;
+  (void)tag;
+
+  free(ptr);
+}
+
+void ftl_set_allocator_internal(const ftl_allocator_t *allocator) {
+  if (allocator != NULL) {
+    ftl_allocator = *allocator;
+  }
+  else {
+    ftl_allocator.alloc = _default_alloc;
+    ftl_allocator.free = _default_free;
+    ftl_allocator.context = NULL;
+  }
+}
+
+BOOL ftl_has_custom_allocator() {
+  return ftl_allocator.alloc != _default_alloc;
+}
+
+/*
+ * Adds bytes (negative to release) to what ftl holds under tag. ftl may be
+ * NULL for allocations that don't belong to a handle.
+ */
+void ftl_account_memory(ftl_stream_configuration_private_t *ftl, ftl_alloc_tag_t tag, int64_t bytes) {
+  if (ftl != NULL) {
+    os_atomic_add64(&ftl->memory_bytes[tag], bytes);
+  }
+}
+
+void *ftl_malloc(ftl_stream_configuration_private_t *ftl, size_t size, ftl_alloc_tag_t tag) {
+  alloc_header_t *hdr;
+
+  if ((hdr = (alloc_header_t *)ftl_allocator.alloc(ftl_allocator.context, size + sizeof(alloc_header_t), tag)) == NULL) {
+    return NULL;
+  }
+
+  hdr->info.owner = ftl;
+  hdr->info.size = size;
+  hdr->info.tag = tag;
+  ftl_account_memory(ftl, tag, (int64_t)(size + sizeof(alloc_header_t)));
+
+  return hdr + 1;
+}
+
+void *ftl_realloc(ftl_stream_configuration_private_t *ftl, void *ptr, size_t size, ftl_alloc_tag_t tag) {
+  alloc_header_t *hdr;
+  void *mem;
+
+  if ((mem = ftl_malloc(ftl, size, tag)) == NULL) {
+    return NULL;
+  }
+
+  if (ptr != NULL) {
+    hdr = (alloc_header_t *)ptr - 1;
+    memcpy(mem, ptr, (hdr->info.size < size) ? hdr->info.size : size);
+    ftl_free(ptr);
+  }
+
+  return mem;
+}
+
+char *ftl_strdup(ftl_stream_configuration_private_t *ftl, const char *str, ftl_alloc_tag_t tag) {
+  size_t len = strlen(str) + 1;
+  char *copy;
+
+  if ((copy = (char *)ftl_malloc(ftl, len, tag)) != NULL) {
+    memcpy(copy, str, len);
+  }
+
+  return copy;
+}
+
+void ftl_free(void *ptr) {
+  alloc_header_t *hdr;
+
+  if (ptr == NULL) {
+    return;
+  }
+
+  hdr = (alloc_header_t *)ptr - 1;
+  ftl_account_memory(hdr->info.owner, hdr->info.tag, -(int64_t)(hdr->info.size + sizeof(alloc_header_t)));
+  ftl_allocator.free(ftl_allocator.context, hdr, hdr->info.size + sizeof(alloc_header_t), hdr->info.tag);
+}
@@ -29,6 +29,7 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -65,14 +66,40 @@
 #define FTL_UDP_MEDIA_PORT 8082   //legacy port
 #define RTP_HEADER_BASE_LEN 12
 #define RTP_FUA_HEADER_LEN 2
-#define NACK_RB_SIZE (2048) //must be evenly divisible by 2^16
+#define NACK_RB_SIZE (2048) //default ring size, must be evenly divisible by 2^16
+#define MIN_NACK_RB_SIZE 64
+#define MAX_NACK_RB_SIZE 32768
+#define MIN_AUTO_NACK_RB_SIZE 512 //leaves room for a key frame burst when the ring is sized from the bitrate
+#define MIN_MTU 256
+#define DEFAULT_RETENTION_MS 2000 //how long sent packets can be retransmitted unless configured
+#define DEFAULT_RETENTION_RTT_MULTIPLIER 8
+#define DEFAULT_KEYFRAME_REQUEST_INTERVAL_MS 1000 //minimum time between key frame requests unless configured
+#define MIN_RETENTION_MS 100 //keeps retransmits possible on very low rtt links
 #define NACK_RTT_AVG_SECONDS 5
 #define MAX_STATUS_MESSAGE_QUEUED 10
 #define MAX_FRAME_SIZE_ELEMENTS 64 //must be a minimum of 3
-#define MAX_XMIT_LEVEL_IN_MS 100 //allows a maximum burst size of 100ms at the target bitrate
+#define DEFAULT_PACER_BURST_MS 100 //allows a maximum burst size of 100ms at the target bitrate
+#define MAX_SEND_BATCH_PKTS 64 //max number of queued packets handed to the socket in one call
+#define MAX_MEDIA_SUBMITTERS 16 //threads that can wait in ftl_ingest_submit_media at once, per media type
+#define SUBMIT_ORDER_TIMEOUT_MS 100 //how long a NAL waits for the NALs before it before its frame is given up
+#define MAX_PARAM_SET_SIZE 256 //largest SPS or PPS kept in the parameter set cache
+#define MAX_SEI_PROBE_SIZE 64 //bytes at the start of an SEI searched for a recovery point
+#define LOW_LATENCY_PACER_BURST_MS 20 //pacer burst size in the low latency profile
+#define DEFAULT_PACER_RATE_PERCENT 100
+#define MIN_PACER_RATE_PERCENT 50
+#define MAX_PACER_RATE_PERCENT 400
+#define PACER_START_BURST_MS 5 //small initial level to prevent bursting at the start of a stream
+#define KERNEL_PACING_HEADROOM_KBPS 512 //added to SO_MAX_PACING_RATE for the audio and retransmits sharing the socket
+#define MAX_BUFFER_REFS 256 //caller buffers zero copy packets can point into at once, a power of 2
+#define BUFFER_RETIRE_INTERVAL_MS 20 //how often an idle send thread checks for buffers to release
+#define MAX_GSO_BYTES 65000 //max size of a UDP GSO super-buffer, must stay below the 64k datagram limit
+#define MIN_GSO_SEGMENTS 2 //shorter runs of same sized packets are sent without segmentation offload
+#define CACHE_LINE_SIZE 64 //used to keep data written by different threads apart
+#define ARENA_ALIGNMENT 4096 //arena regions start on a page so they can be handed back to the os
 #define VIDEO_RTP_TS_CLOCK_HZ 90000
 #define AUDIO_SAMPLE_RATE 48000
 #define AUDIO_PACKET_DURATION_MS 20
+#define AUDIO_MAX_PACKET_SIZE (RTP_HEADER_BASE_LEN + 1275) //largest opus packet plus the rtp header
 #define IPVX_ADDR_ASCII_LEN INET6_ADDRSTRLEN
 #define INGEST_LIST_URI "https://conductor.videosvc.mixer.com/api/video/v2/channels/%d/ingest"
 #define INGEST_LOAD_PORT 8079
@@ -82,6 +109,12 @@
 #define SENDER_REPORT_TX_INTERVAL_MS 1000
 #define PING_PTYPE 250
 #define SENDER_REPORT_PTYPE 200
+#define RTCP_PSFB_PTYPE 206
+#define RTCP_PSFB_PLI 1
+#define RTCP_PSFB_FIR 4
+
+// Fails to compile when cond is false, name says which check it was.
+#define FTL_STATIC_ASSERT(cond, name) typedef char ftl_static_assert_##name[(cond) ? 1 : -1]
 
  // Adaptive bitrate constants
 
@@ -143,6 +176,8 @@ typedef enum {
   H264_NALU_TYPE_FILLER = 12
 }h264_nalu_type_t;
 
+#define H264_SEI_RECOVERY_POINT 6 //SEI payload type marking where a decoder can start without an IDR
+
 typedef enum {
   FTL_CONNECTED = 0x0001,
   FTL_MEDIA_READY = 0x0002,
@@ -176,6 +211,8 @@ typedef struct _status_queue_t {
 
 typedef struct {
   status_queue_elmt_t *head;
+  status_queue_elmt_t *free_list;
+  status_queue_elmt_t pool[MAX_STATUS_MESSAGE_QUEUED + 1]; //one spare for the message that bumps the oldest
   int count;
   int thread_waiting;
   OS_MUTEX mutex;
@@ -187,17 +224,117 @@ typedef struct {
  * as the authetication keys and other similar information. It's members are
  * private and not to be directly manipulated
  */
+#define NACK_SLOT_FIRST 0x1 /*first packet in frame*/
+#define NACK_SLOT_LAST 0x2 /*last packet in frame*/
+#define NACK_SLOT_IFRAME 0x4 /*part of an idr frame*/
+
+/*
+ * Packet history of a media component. Everything lives in one cache line
+ * aligned allocation. The slot metadata is stored as separate arrays away
+ * from the payloads, so walking sequence numbers or timestamps doesn't pull
+ * packet data into the cache.
+ */
 typedef struct {
-  uint8_t packet[MAX_PACKET_BUFFER];
-  int len;
-  struct timeval insert_time;
-  struct timeval xmit_time;
-  int sn;
-  int first;/*first packet in frame*/
-  int last; /*last packet in frame*/
+  void *mem; /*the arena region holding this header and the arrays below*/
+  int size; /*number of slots, must evenly divide 2^16*/
+  int packet_size; /*largest packet a slot holds*/
+  int stride; /*bytes between two payloads, a multiple of CACHE_LINE_SIZE*/
+  uint8_t *packets;
+  int32_t *sn;
+  int32_t *len;
+  OS_ATOMIC_INT *gen; /*odd while the producer is rewriting the slot*/
+  uint8_t *flags;
+  int64_t *insert_us;
+  int64_t *xmit_us;
+  const uint8_t **ext_data; /*payload left in a caller buffer, the slot only holds the headers*/
+  int32_t *ext_len; /*0 when the whole packet is in the slot*/
+  uint32_t *ext_ref; /*media_buffer_ref_t id of ext_data*/
+}nack_ring_t;
+
+/*
+ * A caller buffer that queued packets point into. The producer hands out refs
+ * in order and the send thread releases them in order, once the packets in
+ * [start_sn, end_sn) have been sent and their retention has passed.
+ */
+typedef struct {
+  const uint8_t *data;
+  int32_t len;
+  ftl_release_callback_t release;
+  void *context;
+  uint32_t id;
+  uint16_t start_sn;
+  OS_ATOMIC_INT end_sn; /*moved back to start_sn if the frame is rolled back*/
+  int64_t sent_us; /*when the send thread saw the last packet sent, 0 before*/
+  OS_ATOMIC_INT live; /*cleared before release, retransmits only read live buffers*/
+  OS_ATOMIC_INT pins; /*retransmits currently copying from the buffer*/
+}media_buffer_ref_t;
+
+/*
+ * Read position in the buffers of a media unit. Lets the packetizer copy a
+ * payload split over several buffers straight into the packet slots.
+ */
+typedef struct {
+  const ftl_media_buffer_t *buffers;
+  int count;
+  int idx;
+  int offset;
+  BOOL by_reference; /*payloads stay in the single buffer, see ext*/
+  uint32_t ref; /*media_buffer_ref_t id of the buffer*/
+  const uint8_t *ext; /*payload of the last packet when by_reference*/
+  int ext_len;
+}media_cursor_t;
+
+/*
+ * A unit waiting in ftl_ingest_submit_media. It lives on the submitting
+ * thread's behalf in the submit queue pool and points at the caller's data,
+ * which stays valid because the caller waits until the unit is done.
+ */
+typedef struct _media_submission_t {
+  int64_t dts_usec;
+  int nal_index;
+  uint8_t *data;
+  int32_t len;
+  int end_of_frame;
+  BOOL done;
+  ftl_status_t status;
+  OS_SEMAPHORE done_sem; /*posted when another thread finished the unit*/
+  struct _media_submission_t *next;
+}media_submission_t;
+
+/*
+ * Orders concurrent submissions of one media type. Whichever submitter finds
+ * no one else combining queues every pending unit that is next in order,
+ * including those of other threads, then wakes their owners.
+ */
+typedef struct {
+  BOOL created;
   OS_MUTEX mutex;
-  BOOL isPartOfIframe;
-}nack_slot_t;
+  media_submission_t pool[MAX_MEDIA_SUBMITTERS];
+  media_submission_t *free_list;
+  media_submission_t *pending; /*sorted by dts and nal_index*/
+  BOOL combining;
+  int64_t frame_dts_usec; /*frame being queued*/
+  BOOL in_frame;
+  int next_nal_index;
+  int64_t last_dts_usec; /*last finished or abandoned frame*/
+  BOOL have_last;
+}media_submit_queue_t;
+
+typedef struct {
+  uint8_t data[MAX_PARAM_SET_SIZE];
+  int len; /*0 when nothing is cached*/
+}media_param_set_t;
+
+/*
+ * Token bucket pacing the video send thread. Credit is in bytes and kept
+ * fractional so no time is lost to rounding between refills.
+ */
+typedef struct {
+  int64_t last_ns; //os_monotonic_ns() of the last refill
+  double credit; //bytes that can go out now, negative after a batch overshoots it
+  double bytes_per_ns;
+  double depth; //most credit that can build up
+}media_pacer_t;
 
 typedef struct _ping_pkt_t {
   uint32_t header;
@@ -227,6 +364,7 @@ typedef struct {
   int64_t late_packets;
   int64_t lost_packets;
   int64_t nack_requests;
+  int64_t nack_expired;
   int64_t dropped_frames;
   int pkt_xmit_delay_max;
   int pkt_xmit_delay_min;
@@ -238,6 +376,11 @@ typedef struct {
   int rtt_samples;
   int current_frame_size;
   int max_frame_size;
+  int64_t gso_sends;
+  int64_t gso_packets;
+  int64_t gso_fallbacks; //runs sent without GSO after a transient GSO send error
+  int64_t keyframe_requests;
+  int max_recovery_ms;
 }media_stats_t;
 
 typedef struct {
@@ -257,20 +400,54 @@ typedef struct {
   BOOL nack_slots_initalized;
   int producer;
   int consumer;
-  uint16_t xmit_seq_num;
-  nack_slot_t *nack_slots[NACK_RB_SIZE];
-  OS_MUTEX nack_slots_lock;
+  int nack_ring_slots; //ring size to allocate at connect
+  int64_t nack_ring_max_bytes; //the ring can temporarily grow until both its regions take this much, 0 if it can't
+  int64_t nack_ring_grown_us; //when the ring was last grown
+  // Only replaced by the producer. The send thread and retransmits count
+  // themselves in ring_readers of the ring's region while using it.
+  nack_ring_t *nack_ring;
+  OS_ATOMIC_INT ring_readers[2];
+  nack_ring_t *retired_ring; //replaced by the last resize but still read, see _media_retire_ring()
+  uint16_t commit_seq_num; //end of the last complete frame, packets after it are staged
+  ftl_status_t queue_status; //why the last unit queued nothing, FTL_SUCCESS if it didn't
+  BOOL batching; //commits are published once at the end of a batch
+  uint32_t write_bytes; //bytes of every packet written, wraps
+  uint32_t commit_bytes; //write_bytes at commit_seq_num
+  media_buffer_ref_t buffer_refs[MAX_BUFFER_REFS];
+  OS_ATOMIC_INT buffer_ref_head; //next ref id, written by the producer
+  OS_ATOMIC_INT buffer_ref_tail; //oldest unreleased ref id, written by the send thread
+  uint8_t *ring_region[2]; //arena memory the ring moves between when resized, the second one only if it can grow
+  size_t ring_region_bytes[2];
   int peak_kbps;
   int kbps;
   media_stats_t stats; //cumulative since start of stream
   OS_SEMAPHORE pkt_ready;
+  // The slots form a single producer / single consumer ring. seq_num is private
+  // to the producer, which publishes it through ready_seq_num once packets are
+  // complete. xmit_seq_num is advanced by the send thread after the packets are
+  // on the wire. Both indices hold 16 bit sequence numbers and sit on their own
+  // cache lines. The handle is only as aligned as malloc makes it, so the
+  // groups are kept a whole line apart instead of aligned.
+  uint8_t ready_pad[CACHE_LINE_SIZE];
+  OS_ATOMIC_INT ready_seq_num;
+  OS_ATOMIC_INT ready_bytes; //commit_bytes as of ready_seq_num
+  uint8_t xmit_pad[CACHE_LINE_SIZE];
+  OS_ATOMIC_INT xmit_seq_num;
+  OS_ATOMIC_INT xmit_bytes; //bytes taken off the ring by the send thread, wraps
+  OS_ATOMIC_INT consumer_waiting; //set while the send thread is blocked on pkt_ready
+  uint8_t end_pad[CACHE_LINE_SIZE];
 }ftl_media_component_common_t;
 
+FTL_STATIC_ASSERT(offsetof(ftl_media_component_common_t, ready_seq_num) - offsetof(ftl_media_component_common_t, ready_pad) >= CACHE_LINE_SIZE, ready_line);
+FTL_STATIC_ASSERT(offsetof(ftl_media_component_common_t, xmit_seq_num) - (offsetof(ftl_media_component_common_t, ready_bytes) + sizeof(OS_ATOMIC_INT)) >= CACHE_LINE_SIZE, xmit_line);
+FTL_STATIC_ASSERT(sizeof(ftl_media_component_common_t) - (offsetof(ftl_media_component_common_t, consumer_waiting) + sizeof(OS_ATOMIC_INT)) >= CACHE_LINE_SIZE, end_line);
+
 typedef struct {
   ftl_audio_codec_t codec;
   int64_t dts_usec;
   ftl_media_component_common_t media_component;
   OS_MUTEX mutex;
+  media_submit_queue_t submit;
   BOOL is_ready_to_send;
 } ftl_audio_component_t;
 
@@ -284,9 +461,43 @@ typedef struct {
   float dts_error;
   uint8_t fua_nalu_type;
   BOOL wait_for_idr_frame;
+  // Packets of the current frame are only published once the whole frame has
+  // been queued so a frame that doesn't fit never goes out half sent.
+  int64_t frame_dts_usec;
+  int64_t frame_bytes_queued;
+  int64_t frame_payload_bytes;
+  BOOL frame_is_key;
+  uint32_t frame_buffer_ref; //first buffer ref of the current frame
+  BOOL drop_frame; //the rest of the current frame is discarded
   ftl_media_component_common_t media_component;
   OS_MUTEX mutex;
+  media_submit_queue_t submit;
   BOOL has_sent_first_frame;
+  ftl_queue_callback_t queue_callback;
+  void *queue_callback_context;
+  int queue_high_drain_ms;
+  int queue_low_drain_ms;
+  BOOL queue_above; //the last callback reported the queue above queue_high_drain_ms
+  ftl_keyframe_request_function_t keyframe_request;
+  void *keyframe_request_context;
+  int keyframe_request_interval_ms;
+  OS_MUTEX keyframe_mutex;
+  int64_t last_keyframe_request_us;
+  int64_t recovery_start_us; //when frames started being dropped until a key frame, 0 if they aren't
+  int nal_filter; //FTL_NAL_FILTER_* flags
+  ftl_nal_filter_stats_t nal_filter_stats;
+  media_param_set_t sps; //last SPS and PPS seen
+  media_param_set_t pps;
+  BOOL frame_has_sps; //the current frame carries its own parameter sets
+  BOOL frame_has_pps;
+  BOOL fast_start; //don't wait for audio before the first key frame
+  int64_t first_frame_dts_usec; //dts of the first frame sent, valid once has_sent_first_frame is set
+  int64_t start_us; //when the media connection came up
+  int first_packet_ms; //from start_us to the first video packet on the wire, -1 until then
+  int pacer_burst_ms; //largest burst the pacer lets out at the paced rate
+  int pacer_rate_percent; //of the target bitrate
+  int paced_kbps; //rate the send thread paces at, 0 if it doesn't
+  int pacing; //FTL_PACING_* backend asked for
 } ftl_video_component_t;
 
 typedef struct {
@@ -301,6 +512,16 @@ typedef struct {
   OS_THREAD_HANDLE ping_thread;
   OS_SEMAPHORE ping_thread_shutdown;
   int max_mtu;
+  int configured_mtu;
+  int retention_ms;
+  int retention_rtt_multiplier;
+  int srtt_ms; //smoothed ping rtt, -1 until the first ping returns
+  int memory_flags; //FTL_MEMORY_* flags for the arena
+  OS_MEMORY arena; //backs the packet rings and recv_buf for the life of the handle
+  void *arena_block; //the arena's memory when it came from a custom allocator
+  uint8_t *recv_buf;
+  BOOL gso_enabled;
+  int pacing; //FTL_PACING_* backend in use, user space when the one asked for isn't available
   struct timeval stats_tv;
   int last_rtt_delay;
   struct timeval sender_report_base_ntp;
@@ -322,6 +543,8 @@ typedef struct
     uint64_t min_encoding_bitrate;
 } ftl_adaptive_bitrate_thread_params_t;
 
+typedef struct _shm_input_t shm_input_t;
+
 typedef struct {
   SOCKET ingest_socket;
   ftl_state_t state;
@@ -343,15 +566,19 @@ typedef struct {
   OS_SEMAPHORE connection_thread_shutdown;
   OS_SEMAPHORE keepalive_thread_shutdown;
   OS_SEMAPHORE bitrate_thread_shutdown;
+  ftl_adaptive_bitrate_thread_params_t bitrate_thread_params;
   ftl_media_config_t media;
   ftl_audio_component_t audio;
   ftl_video_component_t video;
   status_queue_t status_q;
   ftl_ingest_t *ingest_list;
   int ingest_count;
+  OS_ATOMIC_INT64 memory_bytes[FTL_ALLOC_TAG_COUNT]; //held by this handle, see ftl_account_memory()
+  shm_input_t *shm_input; //shared memory ring being read, see ftl_ingest_attach_shm
 }  ftl_stream_configuration_private_t;
 
 struct MemoryStruct {
+  ftl_stream_configuration_private_t *ftl;
   char *memory;
   size_t size;
 };
@@ -384,6 +611,15 @@ typedef enum {
   FTL_INGEST_RESP_INTERNAL_SOCKET_TIMEOUT = 903
 } ftl_response_code_t;
 
+// Start code scanners annexb_find_start_code() can use. annexb_init() picks
+// the fastest one the CPU has, the first bytes of a NAL are always scanned
+// scalar.
+typedef enum {
+  ANNEXB_SCAN_SCALAR,
+  ANNEXB_SCAN_SSE2,
+  ANNEXB_SCAN_AVX2
+} annexb_scanner_t;
+
 /**
  * Logs something to the FTL logs
  */
@@ -423,6 +659,13 @@ BOOL is_legacy_ingest(ftl_stream_configuration_private_t *ftl);
 ftl_status_t dequeue_status_msg(ftl_stream_configuration_private_t *ftl, ftl_status_msg_t *stats_msg, int ms_timeout);
 ftl_status_t enqueue_status_msg(ftl_stream_configuration_private_t *ftl, ftl_status_msg_t *stats_msg);
 ftl_status_t _set_ingest_hostname(ftl_stream_configuration_private_t *ftl);
+void ftl_set_allocator_internal(const ftl_allocator_t *allocator);
+BOOL ftl_has_custom_allocator();
+void *ftl_malloc(ftl_stream_configuration_private_t *ftl, size_t size, ftl_alloc_tag_t tag);
+void *ftl_realloc(ftl_stream_configuration_private_t *ftl, void *ptr, size_t size, ftl_alloc_tag_t tag);
+char *ftl_strdup(ftl_stream_configuration_private_t *ftl, const char *str, ftl_alloc_tag_t tag);
+void ftl_free(void *ptr);
+void ftl_account_memory(ftl_stream_configuration_private_t *ftl, ftl_alloc_tag_t tag, int64_t bytes);
 int _get_remote_ip(struct sockaddr *addr, size_t addrlen, char *remote_ip, size_t ip_len);
 
 ftl_status_t _init_control_connection(ftl_stream_configuration_private_t *ftl);
@@ -431,10 +674,26 @@ ftl_status_t _ingest_disconnect(ftl_stream_configuration_private_t *stream_confi
 char * ingest_find_best(ftl_stream_configuration_private_t *ftl);
 void ingest_release(ftl_stream_configuration_private_t *ftl);
 
+ftl_status_t media_arena_create(ftl_stream_configuration_private_t *ftl);
+void media_arena_destroy(ftl_stream_configuration_private_t *ftl);
 ftl_status_t media_init(ftl_stream_configuration_private_t *ftl);
 ftl_status_t media_destroy(ftl_stream_configuration_private_t *ftl);
 int media_send_video(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, uint8_t *data, int32_t len, int end_of_frame);
 int media_send_audio(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, uint8_t *data, int32_t len);
+int media_send_video_zero_copy(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, const uint8_t *data, int32_t len, int end_of_frame, ftl_release_callback_t release, void *context);
+ftl_status_t media_submit_create(ftl_stream_configuration_private_t *ftl);
+void media_submit_destroy(ftl_stream_configuration_private_t *ftl);
+ftl_status_t media_submit(ftl_stream_configuration_private_t *ftl, ftl_media_type_t media_type, int64_t dts_usec, int nal_index, uint8_t *data, int32_t len, int end_of_frame);
+int media_send_batch(ftl_stream_configuration_private_t *ftl, const ftl_media_unit_t *units, int unit_count);
+ftl_status_t media_get_queue_status(ftl_stream_configuration_private_t *ftl, ftl_media_type_t media_type, ftl_queue_status_t *status);
+void annexb_init();
+BOOL annexb_set_scanner(annexb_scanner_t scanner);
+const uint8_t *annexb_find_start_code(const uint8_t *p, const uint8_t *end);
+BOOL annexb_next_nal(const uint8_t **pos, const uint8_t *end, const uint8_t **nal, int32_t *nal_len);
+int annexb_send_video(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, const uint8_t *data, int32_t len);
+int avcc_send_video(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, const uint8_t *data, int32_t len);
+ftl_status_t shm_input_attach(ftl_stream_configuration_private_t *ftl, const char *name);
+ftl_status_t shm_input_detach(ftl_stream_configuration_private_t *ftl);
 ftl_status_t media_speed_test(ftl_stream_configuration_private_t *ftl, int speed_kbps, int duration_ms, speed_test_t *results);
 ftl_status_t internal_ingest_disconnect(ftl_stream_configuration_private_t *ftl);
 ftl_status_t internal_ftl_ingest_destroy(ftl_stream_configuration_private_t *ftl);
@@ -0,0 +1,55 @@
+#ifndef __FTL_SHM_H
+#define __FTL_SHM_H
+
+#include "ftl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Encoder side of the shared memory ring read by ftl_ingest_attach_shm.
+*  Link the ftl_shm_producer library, the encoder process doesn't need libftl.
+*
+*  Units are written straight into the ring: reserve a slot, write one NAL or
+*  audio packet into it, then publish it. The ring is the only buffer, libftl
+*  packetizes out of it and holds each slot until its packets can no longer
+*  be retransmitted. A single thread may produce.
+*  \ingroup ftl_public
+*/
+typedef struct ftl_shm_producer ftl_shm_producer_t;
+
+/*! \brief Creates the ring. Fails if the name is in use, a ring left by a
+*  producer that died has to be removed first, with shm_unlink() on posix. On
+*  posix the name starts with a slash like "/ftl-encoder". slot_count is a power of
+*  two up to 65536 and max_unit_size the largest NAL or audio packet. Enough
+*  slots are needed for the retention window, frames times NALs per frame.
+*  Returns NULL on failure.
+*  \ingroup ftl_public
+*/
+ftl_shm_producer_t *ftl_shm_producer_create(const char *name, int slot_count, int32_t max_unit_size);
+
+/*! \brief Returns where to write the next unit of up to len bytes, or NULL if
+*  the ring is full or len is larger than max_unit_size. Calling it again
+*  before publishing returns the same slot.
+*  \ingroup ftl_public
+*/
+uint8_t *ftl_shm_producer_reserve(ftl_shm_producer_t *producer, int32_t len);
+
+/*! \brief Publishes the reserved slot with len bytes written to it. Arguments
+*  are the same as for ftl_ingest_send_media_dts. Returns 0, or -1 if nothing
+*  was reserved or len is invalid.
+*  \ingroup ftl_public
+*/
+int ftl_shm_producer_publish(ftl_shm_producer_t *producer, ftl_media_type_t media_type, int64_t dts_usec, int32_t len, int end_of_frame);
+
+/*! \brief Removes the ring's name and unmaps it. A consumer already attached
+*  keeps its mapping until it detaches.
+*  \ingroup ftl_public
+*/
+void ftl_shm_producer_destroy(ftl_shm_producer_t *producer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
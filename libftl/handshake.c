@@ -92,7 +92,8 @@ ftl_status_t _init_control_connection(ftl_stream_configuration_private_t *ftl) {
     }
 
     FTL_LOG(ftl, FTL_LOG_DEBUG, "Got IP: %s\n", ingest_ip);
-    ftl->ingest_ip = _strdup(ingest_ip);
+    ftl_free(ftl->ingest_ip);
+    ftl->ingest_ip = ftl_strdup(ftl, ingest_ip, FTL_ALLOC_CONNECTION);
     ftl->socket_family = p->ai_family;
 
     /* Go for broke */
@@ -344,37 +345,27 @@ static ftl_response_code_t _ftl_get_response(ftl_stream_configuration_private_t
 static ftl_response_code_t _ftl_send_command(ftl_stream_configuration_private_t *ftl, BOOL need_response, char *response_buf, int response_len, const char *cmd_fmt, ...) {
   int resp_code = FTL_INGEST_RESP_OK;
   va_list valist;
-  char *buf = NULL;
+  char buf[MAX_INGEST_COMMAND_LEN];
   int len;
-  int buflen = MAX_INGEST_COMMAND_LEN * sizeof(char);
-  char *format = NULL;
+  int buflen = sizeof(buf);
+  const char *terminator = "\r\n\r\n";
 
   do {
-    if ((buf = (char*)malloc(buflen)) == NULL) {
-      resp_code = FTL_INGEST_RESP_INTERNAL_MEMORY_ERROR;
-      break;
-    }
-
-    if ((format = (char*)malloc(strlen(cmd_fmt) + 5)) == NULL) {
-      resp_code = FTL_INGEST_RESP_INTERNAL_MEMORY_ERROR;
-      break;
-    }
-
-    sprintf_s(format, strlen(cmd_fmt) + 5, "%s\r\n\r\n", cmd_fmt);
-
     va_start(valist, cmd_fmt);
 
-    memset(buf, 0, buflen);
-
-    len = vsnprintf(buf, buflen, format, valist);
+    len = vsnprintf(buf, buflen, cmd_fmt, valist);
 
     va_end(valist);
 
-    if (len < 0 || len >= buflen) {
+    // Leave room for the terminator and the null.
+    if (len < 0 || len + (int)strlen(terminator) >= buflen) {
       resp_code = FTL_INGEST_RESP_INTERNAL_COMMAND_ERROR;
       break;
     }
 
+    memcpy(buf + len, terminator, strlen(terminator) + 1);
+    len += (int)strlen(terminator);
+
     send(ftl->ingest_socket, buf, len, 0);
 
     if (need_response) {
@@ -382,14 +373,6 @@ static ftl_response_code_t _ftl_send_command(ftl_stream_configuration_private_t
     }
   } while (0);
 
-  if(buf != NULL){
-    free(buf);
-  }
-
-  if(format != NULL){
-      free(format);
-  }
-
   return resp_code;
 }
 
@@ -106,14 +106,15 @@ ftl_status_t ftl_find_closest_available_ingest(const char* ingestHosts[], int in
 
     ftl_status_t ret_status = FTL_SUCCESS;
     do {
-        if ((ingestElements = calloc(ingestsCount, sizeof(ftl_ingest_t))) == NULL) {
+        if ((ingestElements = ftl_malloc(NULL, ingestsCount * sizeof(ftl_ingest_t), FTL_ALLOC_INGEST_LIST)) == NULL) {
             ret_status = FTL_MALLOC_FAILURE;
             break;
         }
+        memset(ingestElements, 0, ingestsCount * sizeof(ftl_ingest_t));
 
         for (i = 0; i < ingestsCount; i++) {
             size_t host_len = strlen(ingestHosts[i]) + 1;
-            if ((ingestElements[i].name = malloc(host_len)) == NULL) {
+            if ((ingestElements[i].name = ftl_malloc(NULL, host_len, FTL_ALLOC_INGEST_LIST)) == NULL) {
                 ret_status = FTL_MALLOC_FAILURE;
                 break;
             }
@@ -125,12 +126,12 @@ ftl_status_t ftl_find_closest_available_ingest(const char* ingestHosts[], int in
             break;
         }
 
-        if ((handles = (OS_THREAD_HANDLE *)malloc(sizeof(OS_THREAD_HANDLE) * ingestsCount)) == NULL) {
+        if ((handles = (OS_THREAD_HANDLE *)ftl_malloc(NULL, sizeof(OS_THREAD_HANDLE) * ingestsCount, FTL_ALLOC_CONNECTION)) == NULL) {
             ret_status = FTL_MALLOC_FAILURE;
             break;
         }
 
-        if ((data = (_tmp_ingest_thread_data_t *)malloc(sizeof(_tmp_ingest_thread_data_t) * ingestsCount)) == NULL) {
+        if ((data = (_tmp_ingest_thread_data_t *)ftl_malloc(NULL, sizeof(_tmp_ingest_thread_data_t) * ingestsCount, FTL_ALLOC_CONNECTION)) == NULL) {
             ret_status = FTL_MALLOC_FAILURE;
             break;
         }
@@ -140,12 +141,12 @@ ftl_status_t ftl_find_closest_available_ingest(const char* ingestHosts[], int in
     if (ret_status != FTL_SUCCESS) {
         if (ingestElements != NULL) {
             for (i = 0; i < ingestsCount; i++) {
-              free(ingestElements[i].name);
+              ftl_free(ingestElements[i].name);
             }
         }
-        free(ingestElements);
-        free(handles);
-        free(data);
+        ftl_free(ingestElements);
+        ftl_free(handles);
+        ftl_free(data);
         return ret_status;
     }
 
@@ -184,8 +185,8 @@ ftl_status_t ftl_find_closest_available_ingest(const char* ingestHosts[], int in
         }
     }
 
-    free(handles);
-    free(data);
+    ftl_free(handles);
+    ftl_free(data);
 
     if (best) {
         strcpy_s(bestIngestHostComputed, strlen(best->name), best->name);
@@ -194,9 +195,9 @@ ftl_status_t ftl_find_closest_available_ingest(const char* ingestHosts[], int in
     }
 
     for (i = 0; i < ingestsCount; i++) {
-        free(ingestElements[i].name);
+        ftl_free(ingestElements[i].name);
     }
-    free(ingestElements);
+    ftl_free(ingestElements);
 
     return ret_status;
 }
@@ -209,12 +210,13 @@ static size_t _curl_write_callback(void *contents, size_t size, size_t nmemb, vo
   size_t realsize = size * nmemb;
   struct MemoryStruct *mem = (struct MemoryStruct *)userp;
 
-  mem->memory = realloc(mem->memory, mem->size + realsize + 1);
-  if (mem->memory == NULL) {
+  char *memory = ftl_realloc(mem->ftl, mem->memory, mem->size + realsize + 1, FTL_ALLOC_CONNECTION);
+  if (memory == NULL) {
     /* out of memory! */
     printf("not enough memory (realloc returned NULL)\n");
     return 0;
   }
+  mem->memory = memory;
 
   memcpy(&(mem->memory[mem->size]), contents, realsize);
   mem->size += realsize;
@@ -235,7 +237,8 @@ OS_THREAD_ROUTINE _ingest_get_hosts(ftl_stream_configuration_private_t *ftl) {
 
   curl_handle = curl_easy_init();
 
-  chunk.memory = malloc(1);  /* will be grown as needed by realloc */
+  chunk.ftl = ftl;
+  chunk.memory = ftl_malloc(ftl, 1, FTL_ALLOC_CONNECTION);  /* will be grown as needed by realloc */
   chunk.size = 0;    /* no data at this point */
   char ingestBestUrl[1024], vendorName[100], vendorVersion[100], ftlSdkVersion[20];
   struct curl_slist *list = NULL;
@@ -303,11 +306,11 @@ OS_THREAD_ROUTINE _ingest_get_hosts(ftl_stream_configuration_private_t *ftl) {
 
     ftl_ingest_t *ingest_elmt;
 
-    if ((ingest_elmt = malloc(sizeof(ftl_ingest_t))) == NULL) {
+    if ((ingest_elmt = ftl_malloc(ftl, sizeof(ftl_ingest_t), FTL_ALLOC_INGEST_LIST)) == NULL) {
       goto cleanup;
     }
 
-    ingest_elmt->name = _strdup(name);
+    ingest_elmt->name = ftl_strdup(ftl, name, FTL_ALLOC_INGEST_LIST);
     ingest_elmt->rtt = 500;
     ingest_elmt->next = NULL;
 
@@ -327,7 +330,7 @@ OS_THREAD_ROUTINE _ingest_get_hosts(ftl_stream_configuration_private_t *ftl) {
  }
 
 cleanup:
-  free(chunk.memory);
+  ftl_free(chunk.memory);
   curl_easy_cleanup(curl_handle);
   if (ingests != NULL) {
     json_decref(ingests);
@@ -350,19 +353,20 @@ char * ingest_find_best(ftl_stream_configuration_private_t *ftl) {
   while (ftl->ingest_list != NULL) {
     elmt = ftl->ingest_list;
     ftl->ingest_list = elmt->next;
-    free(elmt->name);
-    free(elmt);
+    ftl_free(elmt->name);
+    ftl_free(elmt);
   }
 
   if (_ingest_get_hosts(ftl) <= 0) {
     return NULL;
   }
 
-  if ((handle = (OS_THREAD_HANDLE *)malloc(sizeof(OS_THREAD_HANDLE) * ftl->ingest_count)) == NULL) {
+  if ((handle = (OS_THREAD_HANDLE *)ftl_malloc(ftl, sizeof(OS_THREAD_HANDLE) * ftl->ingest_count, FTL_ALLOC_CONNECTION)) == NULL) {
     return NULL;
   }
 
-  if ((data = (_tmp_ingest_thread_data_t *)malloc(sizeof(_tmp_ingest_thread_data_t) * ftl->ingest_count)) == NULL) {
+  if ((data = (_tmp_ingest_thread_data_t *)ftl_malloc(ftl, sizeof(_tmp_ingest_thread_data_t) * ftl->ingest_count, FTL_ALLOC_CONNECTION)) == NULL) {
+    ftl_free(handle);
     return NULL;
   }
 
@@ -409,12 +413,12 @@ char * ingest_find_best(ftl_stream_configuration_private_t *ftl) {
     elmt = elmt->next;
   }
   
-  free(handle);
-  free(data);
+  ftl_free(handle);
+  ftl_free(data);
 
   if (best){
     FTL_LOG(ftl, FTL_LOG_INFO, "%s had the shortest RTT of %d ms\n", best->name, best->rtt);
-    return _strdup(best->name);
+    return ftl_strdup(ftl, best->name, FTL_ALLOC_HANDLE);
   }
   return NULL;
 }
@@ -428,7 +432,10 @@ void ingest_release(ftl_stream_configuration_private_t *ftl) {
 
   while (elmt != NULL) {
     tmp = elmt->next;
-    free(elmt);
+    ftl_free(elmt->name);
+    ftl_free(elmt);
     elmt = tmp;
   }
+
+  ftl->ingest_list = NULL;
 }
@@ -12,18 +12,59 @@ OS_THREAD_ROUTINE recv_thread(void *data);
 OS_THREAD_ROUTINE ping_thread(void *data);
 OS_THREAD_ROUTINE adaptive_bitrate_thread(void* data);
 ftl_status_t _internal_media_destroy(ftl_stream_configuration_private_t *ftl);
-static int _nack_init(ftl_media_component_common_t *media);
+static int _nack_init(ftl_media_component_common_t *media, int packet_size);
 static int _nack_destroy(ftl_media_component_common_t *media);
+static int _media_packet_size(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc);
 static ftl_media_component_common_t *_media_lookup(ftl_stream_configuration_private_t *ftl, uint32_t ssrc);
-static int _media_make_video_rtp_packet(ftl_stream_configuration_private_t *ftl, uint8_t *in, int in_len, uint8_t *out, int *out_len, int first_pkt);
-static int _media_make_audio_rtp_packet(ftl_stream_configuration_private_t *ftl, uint8_t *in, int in_len, uint8_t *out, int *out_len);
+static int _media_make_video_rtp_packet(ftl_stream_configuration_private_t *ftl, media_cursor_t *in, int in_len, uint8_t *out, int *out_len, int first_pkt);
+static int _media_make_audio_rtp_packet(ftl_stream_configuration_private_t *ftl, media_cursor_t *in, int in_len, uint8_t *out, int *out_len);
+static void _media_cursor_init(media_cursor_t *in, const ftl_media_buffer_t *buffers, int count);
+static uint8_t _media_cursor_peek(media_cursor_t *in);
+static void _media_cursor_copy(media_cursor_t *in, uint8_t *out, int len);
+static void _media_cursor_take(media_cursor_t *in, uint8_t *out, int len);
+static int _media_queue_audio(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, media_cursor_t *in, int32_t len);
+static int _media_queue_video(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, media_cursor_t *in, int32_t len, int end_of_frame);
+static int _media_packetize_video_nal(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, media_cursor_t *in, int32_t len, uint8_t nalu_type, uint8_t nri, int end_of_frame);
+static void _media_end_video_frame(ftl_stream_configuration_private_t *ftl, BOOL mark_last);
+static BOOL _media_filter_video_nal(ftl_stream_configuration_private_t *ftl, uint8_t nalu_type, media_cursor_t *in, int32_t len);
+static BOOL _media_cache_param_set(media_param_set_t *set, media_cursor_t *in, int32_t len);
+static BOOL _media_sei_has_recovery_point(media_cursor_t *in, int32_t len);
+static int _media_queue_param_set(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, media_param_set_t *set);
 static int _media_set_marker_bit(ftl_media_component_common_t *mc, uint8_t *in);
-static int _media_send_packet(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc);
-static int _media_send_slot(ftl_stream_configuration_private_t *ftl, nack_slot_t *slot);
-static nack_slot_t* _media_get_empty_slot(ftl_stream_configuration_private_t *ftl, uint32_t ssrc, uint16_t sn);
+static void _media_commit_packets(ftl_media_component_common_t *mc);
+static void _media_publish_packets(ftl_media_component_common_t *mc);
+static BOOL _media_copy_buffer_ref(ftl_media_component_common_t *mc, uint32_t id, const uint8_t *src, int len, uint8_t *out);
+static void _media_retire_buffers(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, BOOL force);
+static int _media_wait_for_packets(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc);
+static int _media_send_packet_batch(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, int max_bytes, media_pacer_t *txtime_pacer);
+static void _media_update_xmit_stats(ftl_media_component_common_t *mc, nack_ring_t *ring, int idx, int tx_len);
+static int _media_send_batch(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, socket_packet_t *pkts, int count);
+static int64_t _media_now_us();
+static int _media_retention_ms(ftl_stream_configuration_private_t *ftl);
+static int _media_send_buffer(ftl_stream_configuration_private_t *ftl, uint8_t *buf, int len);
+static int _media_get_empty_slot(ftl_stream_configuration_private_t *ftl, uint32_t ssrc, uint16_t sn);
+static int _media_video_packet_count(ftl_stream_configuration_private_t *ftl, int len);
+static BOOL _media_reserve_video_packets(ftl_stream_configuration_private_t *ftl, int needed);
+static void _media_shrink_video_ring(ftl_stream_configuration_private_t *ftl);
+static void _media_commit_video_frame(ftl_stream_configuration_private_t *ftl);
+static void _media_rollback_video_frame(ftl_stream_configuration_private_t *ftl);
+static void _media_abandon_video_frame(ftl_stream_configuration_private_t *ftl, int64_t dts_usec);
+static void _media_request_keyframe(ftl_stream_configuration_private_t *ftl, ftl_keyframe_reason_t reason);
+static void _media_start_recovery(ftl_stream_configuration_private_t *ftl);
+static media_submit_queue_t *_media_submit_queue(ftl_stream_configuration_private_t *ftl, ftl_media_type_t media_type);
+static void _media_submit_reset(media_submit_queue_t *queue);
+static BOOL _media_submit_is_late(media_submit_queue_t *queue, ftl_media_type_t media_type, int64_t dts_usec, int nal_index);
+static BOOL _media_submit_is_next(media_submit_queue_t *queue, ftl_media_type_t media_type, media_submission_t *s);
+static ftl_status_t _media_submit_unit(ftl_stream_configuration_private_t *ftl, ftl_media_type_t media_type, media_submission_t *s);
+static void _media_submit_finish(media_submission_t *s, media_submission_t *own, ftl_status_t status);
+static void _media_submit_drain(ftl_stream_configuration_private_t *ftl, media_submit_queue_t *queue, ftl_media_type_t media_type, media_submission_t *own);
+static void _media_submit_abandon(ftl_stream_configuration_private_t *ftl, media_submit_queue_t *queue, media_submission_t *own);
 static float _media_get_queue_fullness(ftl_stream_configuration_private_t *ftl, uint32_t ssrc);
+static void _media_check_queue_level(ftl_stream_configuration_private_t *ftl);
 void _update_timestamp(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, int64_t dts_usec);
-static void _update_xmit_level(ftl_stream_configuration_private_t *ftl, int *transmit_level, struct timeval *start_tv, int bytes_per_ms);
+static void _media_init_pacing(ftl_stream_configuration_private_t *ftl);
+static void _media_pacer_set_rate(ftl_stream_configuration_private_t *ftl, media_pacer_t *pacer, int kbps);
+static void _media_pacer_refill(media_pacer_t *pacer);
 
 void _clear_stats(media_stats_t *stats);
 static int _update_stats(ftl_stream_configuration_private_t *ftl);
@@ -34,7 +75,7 @@ static int _send_instant_pkt_stats(ftl_stream_configuration_private_t *ftl, ftl_
 size_t ingest_addrlen;
 struct sockaddr *ingest_addr;
 
-ftl_status_t _get_addr_info(short family, char *ip, short port, struct sockaddr **addr, size_t *addrlen) {
+ftl_status_t _get_addr_info(ftl_stream_configuration_private_t *ftl, short family, char *ip, short port, struct sockaddr **addr, size_t *addrlen) {
 
   ftl_status_t retval = FTL_SUCCESS;
 
@@ -45,7 +86,7 @@ ftl_status_t _get_addr_info(short family, char *ip, short port, struct sockaddr
 
         len = sizeof(struct sockaddr_in);
 
-        if ((ipv4_addr = malloc(len)) == NULL) {
+        if ((ipv4_addr = ftl_malloc(ftl, len, FTL_ALLOC_CONNECTION)) == NULL) {
           retval = FTL_MALLOC_FAILURE;
           break;
         }
@@ -56,6 +97,7 @@ ftl_status_t _get_addr_info(short family, char *ip, short port, struct sockaddr
         ipv4_addr->sin_port = htons(port);
 
         if (inet_pton(family, ip, &ipv4_addr->sin_addr) != 1) {
+          ftl_free(ipv4_addr);
           retval = FTL_DNS_FAILURE;
           break;
         }
@@ -69,7 +111,7 @@ ftl_status_t _get_addr_info(short family, char *ip, short port, struct sockaddr
 
         len = sizeof(struct sockaddr_in6);
 
-        if ((ipv6_addr = malloc(len)) == NULL) {
+        if ((ipv6_addr = ftl_malloc(ftl, len, FTL_ALLOC_CONNECTION)) == NULL) {
                 retval = FTL_MALLOC_FAILURE;
                 break;
         }
@@ -80,6 +122,7 @@ ftl_status_t _get_addr_info(short family, char *ip, short port, struct sockaddr
         ipv6_addr->sin6_port = htons(port);
 
         if (inet_pton(family, ip, &ipv6_addr->sin6_addr) != 1) {
+                ftl_free(ipv6_addr);
                 retval = FTL_DNS_FAILURE;
                 break;
         }
@@ -107,31 +150,47 @@ ftl_status_t media_init(ftl_stream_configuration_private_t *ftl) {
     os_init_mutex(&ftl->video.mutex);
     os_init_mutex(&ftl->audio.mutex);
 
+    os_lock_mutex(&ftl->video.submit.mutex);
+    _media_submit_reset(&ftl->video.submit);
+    os_unlock_mutex(&ftl->video.submit.mutex);
+
+    os_lock_mutex(&ftl->audio.submit.mutex);
+    _media_submit_reset(&ftl->audio.submit);
+    os_unlock_mutex(&ftl->audio.submit.mutex);
+
     //use the same socket family as the control connection
     media->media_socket = socket(ftl->socket_family, SOCK_DGRAM, IPPROTO_UDP);
     if (media->media_socket == -1) {
             return FTL_DNS_FAILURE;
     }
 
-    if ((status = _get_addr_info(ftl->socket_family, ftl->ingest_ip, media->assigned_port, &media->ingest_addr, &media->ingest_addrlen)) != FTL_SUCCESS) {
+    if ((status = _get_addr_info(ftl, ftl->socket_family, ftl->ingest_ip, media->assigned_port, &media->ingest_addr, &media->ingest_addrlen)) != FTL_SUCCESS) {
             return status;
     }
 
-    media->max_mtu = MAX_MTU;
+    media->max_mtu = media->configured_mtu;
+    media->gso_enabled = get_socket_gso_supported(media->media_socket);
+    FTL_LOG(ftl, FTL_LOG_INFO, "UDP segmentation offload is %s\n", media->gso_enabled ? "available" : "not available");
+    _media_init_pacing(ftl);
     gettimeofday(&media->stats_tv, NULL);
     media->sender_report_base_ntp.tv_usec = 0;
     media->sender_report_base_ntp.tv_sec = 0;
+    media->srtt_ms = -1;
 
     ftl_media_component_common_t *media_comp[] = { &ftl->video.media_component, &ftl->audio.media_component };
     ftl_media_component_common_t *comp;
 
+    // Make sure cleanup never frees a ring that hasn't been set up yet.
     for (idx = 0; idx < sizeof(media_comp) / sizeof(media_comp[0]); idx++) {
+      media_comp[idx]->nack_slots_initalized = FALSE;
+      media_comp[idx]->nack_ring = NULL;
+    }
 
-      comp = media_comp[idx];
+    for (idx = 0; idx < sizeof(media_comp) / sizeof(media_comp[0]); idx++) {
 
-      comp->nack_slots_initalized = FALSE;
+      comp = media_comp[idx];
 
-      if ((status = _nack_init(comp)) != FTL_SUCCESS) {
+      if ((status = _nack_init(comp, _media_packet_size(ftl, comp))) != FTL_SUCCESS) {
         goto cleanup;
       }
 
@@ -146,12 +205,33 @@ ftl_status_t media_init(ftl_stream_configuration_private_t *ftl) {
       _clear_stats(&comp->stats);
     }
 
+    FTL_LOG(ftl, FTL_LOG_INFO, "Packet queues: video %d x %d bytes, audio %d x %d bytes\n",
+      ftl->video.media_component.nack_ring->size, ftl->video.media_component.nack_ring->stride,
+      ftl->audio.media_component.nack_ring->size, ftl->audio.media_component.nack_ring->stride);
+
     ftl->video.media_component.timestamp_clock = VIDEO_RTP_TS_CLOCK_HZ;
     ftl->audio.media_component.timestamp_clock = AUDIO_SAMPLE_RATE;
     ftl->audio.is_ready_to_send = FALSE;
     ftl->video.has_sent_first_frame = FALSE;
 
     ftl->video.wait_for_idr_frame = TRUE;
+    ftl->video.frame_dts_usec = -1;
+    ftl->video.queue_above = FALSE;
+    ftl->video.frame_bytes_queued = 0;
+    ftl->video.frame_payload_bytes = 0;
+    ftl->video.frame_is_key = FALSE;
+    ftl->video.frame_buffer_ref = 0;
+    ftl->video.frame_has_sps = FALSE;
+    ftl->video.frame_has_pps = FALSE;
+    ftl->video.sps.len = 0;
+    ftl->video.pps.len = 0;
+    memset(&ftl->video.nal_filter_stats, 0, sizeof(ftl->video.nal_filter_stats));
+    ftl->video.drop_frame = FALSE;
+    ftl->video.last_keyframe_request_us = 0;
+    ftl->video.recovery_start_us = _media_now_us();
+    ftl->video.first_frame_dts_usec = -1;
+    ftl->video.start_us = ftl->video.recovery_start_us;
+    ftl->video.first_packet_ms = -1;
 
     // We need set this flag now so it is ready when the thread starts, but also
     // so it is set if we destroy this before the thread starts it will be cleaned up.
@@ -208,6 +288,8 @@ ftl_status_t media_init(ftl_stream_configuration_private_t *ftl) {
 
     ftl_set_state(ftl, FTL_MEDIA_READY);
 
+    _media_request_keyframe(ftl, FTL_KEYFRAME_STREAM_START);
+
     return FTL_SUCCESS;
   } while (0);
 cleanup:
@@ -269,14 +351,24 @@ ftl_status_t _internal_media_destroy(ftl_stream_configuration_private_t *ftl) {
       shutdown_socket(media->media_socket, SD_BOTH);
       close_socket(media->media_socket);
       media->media_socket = INVALID_SOCKET;
-      if (media->ingest_addr) {
-        free(media->ingest_addr);
-      }
+      ftl_free(media->ingest_addr);
+      media->ingest_addr = NULL;
     }
     os_unlock_mutex(&media->mutex);
   }
 
   ftl_media_component_common_t *video_comp = &ftl->video.media_component;
+  if (video_comp->stats.gso_sends > 0) {
+    FTL_LOG(ftl, FTL_LOG_INFO, "Sent %lld video packets in %lld UDP GSO sends\n", video_comp->stats.gso_packets, video_comp->stats.gso_sends);
+  }
+  if (video_comp->stats.gso_fallbacks > 0) {
+    FTL_LOG(ftl, FTL_LOG_INFO, "Sent %lld runs of video packets without UDP GSO after a failed GSO send\n", video_comp->stats.gso_fallbacks);
+  }
+  if (video_comp->stats.nack_expired > 0) {
+    FTL_LOG(ftl, FTL_LOG_INFO, "Ignored %lld of %lld video retransmit requests for expired packets\n", video_comp->stats.nack_expired, video_comp->stats.nack_requests);
+  }
+  // Nothing can send or retransmit anymore, hand all buffers back.
+  _media_retire_buffers(ftl, video_comp, TRUE);
   _nack_destroy(video_comp);
 
   ftl_media_component_common_t *audio_comp = &ftl->audio.media_component;
@@ -319,42 +411,375 @@ ftl_status_t media_destroy(ftl_stream_configuration_private_t *ftl) {
   return ret;
 }
 
-static int _nack_init(ftl_media_component_common_t *media) {
+static uint8_t *_nack_ring_carve(uint8_t **next, size_t bytes) {
+  uint8_t *p = *next;
+  *next += (bytes + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+  return p;
+}
+
+static size_t _nack_ring_stride(int packet_size) {
+  return ((size_t)packet_size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+}
+
+static size_t _nack_ring_bytes(int size, int packet_size) {
+  size_t meta_bytes = sizeof(int32_t) + sizeof(int32_t) + sizeof(OS_ATOMIC_INT) + sizeof(uint8_t) + sizeof(int64_t) + sizeof(int64_t) +
+                      sizeof(uint8_t *) + sizeof(int32_t) + sizeof(uint32_t);
 
+  // Each array starts on its own cache line, plus one line of slack to align
+  // the start of the allocation and one for the header.
+  return sizeof(nack_ring_t) + (size_t)size * (_nack_ring_stride(packet_size) + meta_bytes) + 11 * CACHE_LINE_SIZE;
+}
+
+/*
+ * Lays out a ring of size slots holding packets of up to packet_size bytes in
+ * mem, which must hold _nack_ring_bytes(). The header, the metadata arrays and
+ * the payloads share the region.
+ */
+static nack_ring_t *_nack_ring_create(void *mem, int size, int packet_size) {
+  size_t stride = _nack_ring_stride(packet_size);
+  nack_ring_t *ring;
+  uint8_t *next;
   int i;
-  for (i = 0; i < NACK_RB_SIZE; i++) {
-    if ((media->nack_slots[i] = (nack_slot_t *)malloc(sizeof(nack_slot_t))) == NULL) {
+
+  next = (uint8_t *)(((uintptr_t)mem + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+
+  ring = (nack_ring_t *)_nack_ring_carve(&next, sizeof(nack_ring_t));
+  ring->mem = mem;
+  ring->size = size;
+  ring->packet_size = packet_size;
+  ring->stride = (int)stride;
+  ring->sn = (int32_t *)_nack_ring_carve(&next, size * sizeof(int32_t));
+  ring->len = (int32_t *)_nack_ring_carve(&next, size * sizeof(int32_t));
+  ring->gen = (OS_ATOMIC_INT *)_nack_ring_carve(&next, size * sizeof(OS_ATOMIC_INT));
+  ring->flags = _nack_ring_carve(&next, size * sizeof(uint8_t));
+  ring->insert_us = (int64_t *)_nack_ring_carve(&next, size * sizeof(int64_t));
+  ring->xmit_us = (int64_t *)_nack_ring_carve(&next, size * sizeof(int64_t));
+  ring->ext_data = (const uint8_t **)_nack_ring_carve(&next, size * sizeof(uint8_t *));
+  ring->ext_len = (int32_t *)_nack_ring_carve(&next, size * sizeof(int32_t));
+  ring->ext_ref = (uint32_t *)_nack_ring_carve(&next, size * sizeof(uint32_t));
+  ring->packets = _nack_ring_carve(&next, size * stride);
+
+  for (i = 0; i < ring->size; i++) {
+    ring->sn[i] = -1;
+    ring->len[i] = 0;
+    ring->gen[i] = 0;
+    ring->flags[i] = 0;
+    ring->insert_us[i] = 0;
+    ring->xmit_us[i] = 0;
+    ring->ext_data[i] = NULL;
+    ring->ext_len[i] = 0;
+    ring->ext_ref[i] = 0;
+  }
+
+  return ring;
+}
+
+static size_t _media_arena_round(size_t bytes) {
+  return (bytes + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+// Audio packets are a single opus packet, so its slots can be a lot
+// smaller than the video ones.
+static int _media_packet_size(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc) {
+  int packet_size = ftl->media.configured_mtu;
+
+  if (mc == &ftl->audio.media_component && packet_size > AUDIO_MAX_PACKET_SIZE) {
+    packet_size = AUDIO_MAX_PACKET_SIZE;
+  }
+
+  return packet_size;
+}
+
+/*
+ * Maps the memory all packet rings and the receive buffer of the handle live
+ * in, so nothing is allocated between connect and disconnect. A video ring
+ * that may grow gets a second region to move to, as big as its memory cap
+ * leaves after the first.
+ */
+ftl_status_t media_arena_create(ftl_stream_configuration_private_t *ftl) {
+  ftl_media_config_t *media = &ftl->media;
+  ftl_media_component_common_t *media_comp[] = { &ftl->video.media_component, &ftl->audio.media_component };
+  ftl_media_component_common_t *comp;
+  int regions[sizeof(media_comp) / sizeof(media_comp[0])];
+  size_t total = _media_arena_round(MAX_PACKET_BUFFER);
+  uint8_t *next;
+  int flags = 0;
+  int idx, r;
+
+  for (idx = 0; idx < sizeof(media_comp) / sizeof(media_comp[0]); idx++) {
+    comp = media_comp[idx];
+    comp->ring_region_bytes[0] = _media_arena_round(_nack_ring_bytes(comp->nack_ring_slots, _media_packet_size(ftl, comp)));
+    comp->ring_region_bytes[1] = 0;
+    regions[idx] = 1;
+
+    // Only worth it if the second region holds at least twice the slots.
+    if (comp->nack_ring_max_bytes - (int64_t)comp->ring_region_bytes[0] >= (int64_t)_nack_ring_bytes(comp->nack_ring_slots * 2, _media_packet_size(ftl, comp))) {
+      comp->ring_region_bytes[1] = ((size_t)comp->nack_ring_max_bytes - comp->ring_region_bytes[0]) & ~(size_t)(ARENA_ALIGNMENT - 1);
+      regions[idx] = 2;
+    }
+    else if (comp->nack_ring_max_bytes > 0) {
+      FTL_LOG(ftl, FTL_LOG_WARN, "Packet queue memory cap of %lld bytes leaves no room to grow the queue\n", (long long)comp->nack_ring_max_bytes);
+    }
+
+    total += comp->ring_region_bytes[0] + comp->ring_region_bytes[1];
+  }
+
+  flags |= (media->memory_flags & FTL_MEMORY_LOCK) ? OS_MEMORY_LOCK : 0;
+  flags |= (media->memory_flags & FTL_MEMORY_PREFAULT) ? OS_MEMORY_PREFAULT : 0;
+  flags |= (media->memory_flags & FTL_MEMORY_HUGE_PAGES) ? OS_MEMORY_HUGE_PAGES : 0;
+
+  // A custom allocator decides where the queues live, so only the sdk's own
+  // mapping honors memory_flags.
+  if (ftl_has_custom_allocator()) {
+    if ((media->arena_block = ftl_malloc(ftl, total + ARENA_ALIGNMENT, FTL_ALLOC_PACKET_QUEUE)) == NULL) {
+      return FTL_MALLOC_FAILURE;
+    }
+
+    media->arena.base = (uint8_t *)(((uintptr_t)media->arena_block + ARENA_ALIGNMENT - 1) & ~(uintptr_t)(ARENA_ALIGNMENT - 1));
+    media->arena.size = total;
+    media->arena.flags = 0;
+  }
+  else {
+    if (os_map_memory(&media->arena, total, flags) < 0) {
       return FTL_MALLOC_FAILURE;
     }
 
-    nack_slot_t *slot = media->nack_slots[i];
+    ftl_account_memory(ftl, FTL_ALLOC_PACKET_QUEUE, (int64_t)media->arena.size);
+  }
+
+  if ((flags & ~media->arena.flags) != 0) {
+    FTL_LOG(ftl, FTL_LOG_WARN, "Packet queue memory is%s%s%s\n",
+      ((flags & ~media->arena.flags) & OS_MEMORY_LOCK) ? " not locked" : "",
+      ((flags & ~media->arena.flags) & OS_MEMORY_PREFAULT) ? " not prefaulted" : "",
+      ((flags & ~media->arena.flags) & OS_MEMORY_HUGE_PAGES) ? " not on huge pages" : "");
+  }
+
+  next = media->arena.base;
+  media->recv_buf = next;
+  next += _media_arena_round(MAX_PACKET_BUFFER);
+
+  for (idx = 0; idx < sizeof(media_comp) / sizeof(media_comp[0]); idx++) {
+    comp = media_comp[idx];
+    comp->ring_region[1] = NULL;
+
+    for (r = 0; r < regions[idx]; r++) {
+      comp->ring_region[r] = next;
+      next += comp->ring_region_bytes[r];
+    }
+  }
+
+  return FTL_SUCCESS;
+}
+
+void media_arena_destroy(ftl_stream_configuration_private_t *ftl) {
+  ftl->video.media_component.ring_region[0] = ftl->video.media_component.ring_region[1] = NULL;
+  ftl->audio.media_component.ring_region[0] = ftl->audio.media_component.ring_region[1] = NULL;
+  ftl->media.recv_buf = NULL;
+
+  if (ftl->media.arena_block != NULL) {
+    ftl_free(ftl->media.arena_block);
+    ftl->media.arena_block = NULL;
+    memset(&ftl->media.arena, 0, sizeof(ftl->media.arena));
+  }
+  else if (ftl->media.arena.base != NULL) {
+    ftl_account_memory(ftl, FTL_ALLOC_PACKET_QUEUE, -(int64_t)ftl->media.arena.size);
+    os_unmap_memory(&ftl->media.arena);
+  }
+}
 
-    os_init_mutex(&slot->mutex);
+static int _nack_init(ftl_media_component_common_t *media, int packet_size) {
 
-    slot->len = 0;
-    slot->sn = -1;
-    slot->isPartOfIframe = 0;
+  if (media->ring_region[0] == NULL) {
+    return FTL_MALLOC_FAILURE;
   }
 
-  os_init_mutex(&media->nack_slots_lock);
+  media->nack_ring = _nack_ring_create(media->ring_region[0], media->nack_ring_slots, packet_size);
+
   media->nack_slots_initalized = TRUE;
   media->nack_enabled = TRUE;
-  media->seq_num = media->xmit_seq_num = 0; //TODO: should start at a random value
+  media->seq_num = 0; //TODO: should start at a random value
+  media->commit_seq_num = 0;
+  media->write_bytes = 0;
+  media->commit_bytes = 0;
+  media->batching = FALSE;
+  media->nack_ring_grown_us = 0;
+  media->retired_ring = NULL;
+  os_atomic_store(&media->ring_readers[0], 0);
+  os_atomic_store(&media->ring_readers[1], 0);
+  os_atomic_store(&media->ready_seq_num, 0);
+  os_atomic_store(&media->ready_bytes, 0);
+  os_atomic_store(&media->xmit_seq_num, 0);
+  os_atomic_store(&media->xmit_bytes, 0);
+  os_atomic_store(&media->consumer_waiting, 0);
+  os_atomic_store(&media->buffer_ref_head, 0);
+  os_atomic_store(&media->buffer_ref_tail, 0);
 
   return FTL_SUCCESS;
 }
 
 static int _nack_destroy(ftl_media_component_common_t *media) {
+  media->nack_ring = NULL;
+  media->nack_slots_initalized = FALSE;
+  return 0;
+}
+
+static uint8_t *_nack_slot_packet(nack_ring_t *ring, int idx) {
+  return ring->packets + (size_t)idx * ring->stride;
+}
+
+/*
+ * Copies the newest packets before sequence number end that fit into dst.
+ */
+static void _nack_ring_copy(nack_ring_t *dst, nack_ring_t *src, uint16_t end) {
+  int count = ((dst->size < src->size) ? dst->size : src->size) - 1;
   int i;
-  for (i = 0; i < NACK_RB_SIZE; i++) {
-    if (media->nack_slots[i] != NULL) {
-      os_delete_mutex(&media->nack_slots[i]->mutex);
-      free(media->nack_slots[i]);
-      media->nack_slots[i] = NULL;
+
+  for (i = 1; i <= count; i++) {
+    uint16_t sn = end - (uint16_t)i;
+    int from = sn % src->size;
+    int to = sn % dst->size;
+
+    if (src->sn[from] != sn) {
+      continue;
     }
+
+    dst->sn[to] = sn;
+    dst->len[to] = src->len[from];
+    dst->flags[to] = src->flags[from];
+    dst->insert_us[to] = src->insert_us[from];
+    dst->xmit_us[to] = src->xmit_us[from];
+    dst->ext_data[to] = src->ext_data[from];
+    dst->ext_len[to] = src->ext_len[from];
+    dst->ext_ref[to] = src->ext_ref[from];
+    memcpy(_nack_slot_packet(dst, to), _nack_slot_packet(src, from), src->len[from] - src->ext_len[from]);
   }
-  os_delete_mutex(&media->nack_slots_lock);
-  return 0;
+}
+
+static int _nack_ring_region(ftl_media_component_common_t *mc, nack_ring_t *ring) {
+  return (ring->mem == mc->ring_region[0]) ? 0 : 1;
+}
+
+/*
+ * Pins the ring for threads other than the producer so its region isn't
+ * reused while they read it. Returns NULL without a pin if there is no ring,
+ * otherwise must be paired with _media_release_ring().
+ */
+static nack_ring_t *_media_acquire_ring(ftl_media_component_common_t *mc) {
+  nack_ring_t *ring;
+  int region;
+
+  // A resize that replaced the ring before the pin was counted is seen by
+  // the second load.
+  while ((ring = os_atomic_load_ptr(&mc->nack_ring)) != NULL) {
+    region = _nack_ring_region(mc, ring);
+    os_atomic_add(&mc->ring_readers[region], 1);
+
+    if (os_atomic_load_ptr(&mc->nack_ring) == ring) {
+      break;
+    }
+
+    os_atomic_add(&mc->ring_readers[region], -1);
+  }
+
+  return ring;
+}
+
+static void _media_release_ring(ftl_media_component_common_t *mc, nack_ring_t *ring) {
+  os_atomic_add(&mc->ring_readers[_nack_ring_region(mc, ring)], -1);
+}
+
+/*
+ * Stamps the packets the send thread sent from src after they were copied
+ * into dst. A packet is only sent from one of the rings.
+ */
+static void _nack_ring_copy_xmit_times(nack_ring_t *dst, nack_ring_t *src, uint16_t end) {
+  int count = ((dst->size < src->size) ? dst->size : src->size) - 1;
+  int i;
+
+  for (i = 1; i <= count; i++) {
+    uint16_t sn = end - (uint16_t)i;
+    int from = sn % src->size;
+    int to = sn % dst->size;
+
+    if (src->sn[from] == sn && dst->sn[to] == sn && src->xmit_us[from] != 0 && dst->xmit_us[to] == 0) {
+      dst->xmit_us[to] = src->xmit_us[from];
+    }
+  }
+}
+
+/*
+ * Finishes the last resize once no other thread reads the ring it replaced:
+ * carries over the send times stamped on that ring and gives its pages back
+ * until the ring moves there again. Returns FALSE while it is still read.
+ */
+static BOOL _media_retire_ring(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc) {
+  nack_ring_t *old = mc->retired_ring;
+  int region;
+
+  if (old == NULL) {
+    return TRUE;
+  }
+
+  region = _nack_ring_region(mc, old);
+
+  // Pairs with the pin in _media_acquire_ring(), the new ring was published
+  // before this load.
+  os_atomic_fence();
+  if (os_atomic_load(&mc->ring_readers[region]) != 0) {
+    return FALSE;
+  }
+
+  _nack_ring_copy_xmit_times(mc->nack_ring, old, mc->seq_num);
+
+  if (ftl->media.arena_block == NULL) {
+    os_discard_memory(&ftl->media.arena, (uint8_t *)old->mem - ftl->media.arena.base, mc->ring_region_bytes[region]);
+  }
+
+  mc->retired_ring = NULL;
+
+  return TRUE;
+}
+
+/*
+ * Replaces the ring with one of size slots in the other arena region keeping
+ * as much packet history as fits. Called by the producer, also while the send
+ * thread is backlogged: queued packets are copied before the new ring is
+ * published. The old ring is retired once the send thread and retransmits
+ * stop reading it, the producer never waits for them. Returns FALSE if the
+ * ring was kept.
+ */
+static BOOL _media_resize_ring(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, int size) {
+  nack_ring_t *old = mc->nack_ring;
+  nack_ring_t *ring;
+  int region = !_nack_ring_region(mc, old);
+  uint8_t *mem = mc->ring_region[region];
+
+  // A smaller ring must still hold everything not yet sent. xmit_seq_num
+  // only moves forward so this can't become false later.
+  if ((uint16_t)(mc->seq_num - (uint16_t)os_atomic_load(&mc->xmit_seq_num)) >= size) {
+    return FALSE;
+  }
+
+  if (mem == NULL || _nack_ring_bytes(size, old->packet_size) > mc->ring_region_bytes[region]) {
+    FTL_LOG(ftl, FTL_LOG_WARN, "No room for a %d packet queue\n", size);
+    return FALSE;
+  }
+
+  // The region may still hold the ring before the last resize.
+  if (!_media_retire_ring(ftl, mc)) {
+    return FALSE;
+  }
+
+  ring = _nack_ring_create(mem, size, old->packet_size);
+
+  _nack_ring_copy(ring, old, mc->seq_num);
+
+  os_atomic_store_ptr(&mc->nack_ring, ring);
+
+  mc->retired_ring = old;
+  _media_retire_ring(ftl, mc);
+
+  return TRUE;
 }
 
 void _clear_stats(media_stats_t *stats) {
@@ -367,6 +792,7 @@ void _clear_stats(media_stats_t *stats) {
   stats->late_packets = 0;
   stats->lost_packets = 0;
   stats->nack_requests = 0;
+  stats->nack_expired = 0;
   stats->dropped_frames = 0;
   stats->bytes_queued = 0;
   stats->packets_queued = 0;
@@ -380,6 +806,9 @@ void _clear_stats(media_stats_t *stats) {
   stats->rtt_samples = 0;
   stats->current_frame_size = 0;
   stats->max_frame_size = 0;
+  stats->gso_sends = 0;
+  stats->gso_packets = 0;
+  stats->gso_fallbacks = 0;
   gettimeofday(&stats->start_time, NULL);
 }
 
@@ -415,6 +844,11 @@ ftl_status_t media_speed_test(ftl_stream_configuration_private_t *ftl, int speed
   ftl_status_t retval = FTL_SPEED_TEST_ABORTED;
   int64_t transmit_level = MAX_MTU;
   unsigned char data[MAX_MTU];
+  uint8_t pkt[MAX_MTU];
+  int pkt_len;
+  int data_len = media->max_mtu - RTP_HEADER_BASE_LEN;
+  ftl_media_buffer_t test_buf = { data, data_len };
+  media_cursor_t in;
   int bytes_per_ms;
   int64_t total_ms = 0;
   struct timeval stop_tv, start_tv, delta_tv, sendToTimeLoopTime_tv;
@@ -422,8 +856,7 @@ ftl_status_t media_speed_test(ftl_stream_configuration_private_t *ftl, int speed
   int64_t ms_elapsed;
   int64_t total_sent = 0;
   int64_t pkts_sent = 0;
-  ping_pkt_t *ping;
-  nack_slot_t slot;
+  ping_pkt_t ping;
   uint8_t fmt = 1; //generic nack
   uint8_t ptype = PING_PTYPE;
   int wait_retries;
@@ -440,20 +873,17 @@ ftl_status_t media_speed_test(ftl_stream_configuration_private_t *ftl, int speed
   ftl_set_state(ftl, FTL_DISABLE_TX_PING_PKTS);
   ftl->video.has_sent_first_frame = TRUE;
 
-  ping = (ping_pkt_t*)slot.packet;
-
   int rtp_hdr_len = 0;
-  slot.len = sizeof(ping_pkt_t);
 
-  ping->header = htonl((2 << 30) | (fmt << 24) | (ptype << 16) | sizeof(ping_pkt_t));
+  ping.header = htonl((2 << 30) | (fmt << 24) | (ptype << 16) | sizeof(ping_pkt_t));
 
   // Send ping packet first to get an accurate estimate of rtt under ideal conditions.
   // We send it multiplies times to try to ensure one makes it on poor connections.
   ftl->media.last_rtt_delay = -1;
-  gettimeofday(&ping->xmit_time, NULL);
-  _media_send_slot(ftl, &slot);
-  _media_send_slot(ftl, &slot);
-  _media_send_slot(ftl, &slot);
+  gettimeofday(&ping.xmit_time, NULL);
+  _media_send_buffer(ftl, (uint8_t *)&ping, sizeof(ping));
+  _media_send_buffer(ftl, (uint8_t *)&ping, sizeof(ping));
+  _media_send_buffer(ftl, (uint8_t *)&ping, sizeof(ping));
 
   wait_retries = 5;
   while ((initial_rtt = ftl->media.last_rtt_delay) < 0 && wait_retries-- > 0) {
@@ -484,12 +914,18 @@ ftl_status_t media_speed_test(ftl_stream_configuration_private_t *ftl, int speed
 
     while (transmit_level > 0) {
       pkts_sent++;
-      if ((bytes_sent = media_send_audio(ftl, 0, data, sizeof(data))) < sizeof(data)) {
+
+      // Test packets go straight to the socket, they can't be retransmitted
+      // and would only overrun the audio queue which is sized for audio.
+      pkt_len = sizeof(pkt);
+      _media_cursor_init(&in, &test_buf, 1);
+      _media_make_audio_rtp_packet(ftl, &in, data_len, pkt, &pkt_len);
+      if ((bytes_sent = _media_send_buffer(ftl, pkt, pkt_len)) < pkt_len) {
         error = 1;
         break;
       }
 
-      // Sendto (which is called in media_send_audio) can block if the computer's network connection is bad
+      // Sendto can block if the computer's network connection is bad
       // and the local OS send buffer is full. We want this behavior when streaming normally for the send thread
       // to throttle the amount of data we send, but during the speed test this causes us to block the send loop and makes
       // the speed test too long and return inaccurate values.
@@ -517,8 +953,8 @@ ftl_status_t media_speed_test(ftl_stream_configuration_private_t *ftl, int speed
     while (ftl->media.last_rtt_delay < 0 && wait_retries-- > 0)
     {
       // Send the ping packet
-      gettimeofday(&ping->xmit_time, NULL);
-      _media_send_slot(ftl, &slot);
+      gettimeofday(&ping.xmit_time, NULL);
+      _media_send_buffer(ftl, (uint8_t *)&ping, sizeof(ping));
 
       // Sleep for a bit.
       sleep_ms(PING_TX_INTERVAL_MS);
@@ -560,7 +996,13 @@ ftl_status_t media_speed_test(ftl_stream_configuration_private_t *ftl, int speed
 
   // Reset all vars that were effected by the test.
   mc->seq_num = 0;
-  mc->xmit_seq_num = 0;
+  mc->commit_seq_num = 0;
+  mc->write_bytes = 0;
+  mc->commit_bytes = 0;
+  os_atomic_store(&mc->ready_seq_num, 0);
+  os_atomic_store(&mc->ready_bytes, 0);
+  os_atomic_store(&mc->xmit_seq_num, 0);
+  os_atomic_store(&mc->xmit_bytes, 0);
   mc->timestamp = 0;
   mc->producer = 0;
   mc->consumer = 0;
@@ -579,361 +1021,1748 @@ ftl_status_t media_speed_test(ftl_stream_configuration_private_t *ftl, int speed
 }
 
 int media_send_audio(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, uint8_t *data, int32_t len) {
-  ftl_media_component_common_t *mc = &ftl->audio.media_component;
-  uint8_t nalu_type = 0;
+  ftl_media_buffer_t buf = { data, len };
+  media_cursor_t in;
   int bytes_sent = 0;
 
-  int pkt_len;
-  int payload_size;
-  nack_slot_t *slot;
-  int remaining = len;
-  int retries = 0;
+  _media_cursor_init(&in, &buf, 1);
 
+  // Wait for a concurrent caller rather than silently dropping the packet.
+  os_lock_mutex(&ftl->audio.mutex);
 
-  // When we get our first audio packet, indicate that we are ready to send.
-  // However, don't send audio data until the video is also sending.
-  ftl->audio.is_ready_to_send = TRUE;
-  if (!ftl->video.has_sent_first_frame)
-  {
-    return 0;
+  if (ftl_get_state(ftl, FTL_MEDIA_READY)) {
+    bytes_sent = _media_queue_audio(ftl, dts_usec, &in, len);
+  }
+
+  os_unlock_mutex(&ftl->audio.mutex);
+
+  return bytes_sent;
+}
+
+int media_send_video(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, uint8_t *data, int32_t len, int end_of_frame) {
+  ftl_media_buffer_t buf = { data, len };
+  media_cursor_t in;
+  int bytes_queued = 0;
+
+  _media_cursor_init(&in, &buf, 1);
+
+  os_lock_mutex(&ftl->video.mutex);
+
+  if (ftl_get_state(ftl, FTL_MEDIA_READY)) {
+    bytes_queued = _media_queue_video(ftl, dts_usec, &in, len, end_of_frame);
+  }
+
+  os_unlock_mutex(&ftl->video.mutex);
+
+  return bytes_queued;
+}
+
+/*
+ * Like media_send_video but the packets point into data, which is held by a
+ * buffer ref until the send thread releases it. Falls back to copying when all
+ * refs are in use.
+ */
+int media_send_video_zero_copy(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, const uint8_t *data, int32_t len, int end_of_frame, ftl_release_callback_t release, void *context) {
+  ftl_media_component_common_t *mc = &ftl->video.media_component;
+  ftl_media_buffer_t buf = { data, len };
+  media_cursor_t in;
+  media_buffer_ref_t *ref;
+  uint32_t id;
+  BOOL kept = FALSE;
+  int bytes_queued = 0;
+
+  _media_cursor_init(&in, &buf, 1);
+
+  os_lock_mutex(&ftl->video.mutex);
+
+  if (ftl_get_state(ftl, FTL_MEDIA_READY)) {
+    id = (uint32_t)mc->buffer_ref_head;
+    ref = &mc->buffer_refs[id % MAX_BUFFER_REFS];
+
+    if (id - (uint32_t)os_atomic_load(&mc->buffer_ref_tail) < MAX_BUFFER_REFS) {
+      ref->data = data;
+      ref->len = len;
+      ref->release = release;
+      ref->context = context;
+      ref->id = id;
+      ref->start_sn = mc->seq_num;
+      ref->sent_us = 0;
+      os_atomic_store(&ref->end_sn, mc->seq_num);
+      os_atomic_store(&ref->live, 1);
+
+      in.by_reference = TRUE;
+      in.ref = id;
+    }
+
+    bytes_queued = _media_queue_video(ftl, dts_usec, &in, len, end_of_frame);
+
+    if (in.by_reference && bytes_queued > 0) {
+      os_atomic_store(&ref->end_sn, mc->seq_num);
+      os_atomic_store(&mc->buffer_ref_head, id + 1);
+      kept = TRUE;
+    }
+    else if (in.by_reference) {
+      os_atomic_store(&ref->live, 0);
+    }
+  }
+
+  os_unlock_mutex(&ftl->video.mutex);
+
+  // Dropped or copied, either way we are done with it.
+  if (!kept) {
+    release(context, data);
+  }
+
+  return bytes_queued;
+}
+
+/*
+ * Queues every unit taking each media lock once. Packets are committed as
+ * usual but only published, waking the send threads, after the last unit.
+ */
+int media_send_batch(ftl_stream_configuration_private_t *ftl, const ftl_media_unit_t *units, int unit_count) {
+  ftl_media_component_common_t *audio_mc = &ftl->audio.media_component;
+  ftl_media_component_common_t *video_mc = &ftl->video.media_component;
+  BOOL has_audio = FALSE, has_video = FALSE;
+  media_cursor_t in;
+  int bytes_queued = 0;
+  int32_t len;
+  int i, b;
+
+  for (i = 0; i < unit_count; i++) {
+    has_audio |= (units[i].media_type == FTL_AUDIO_DATA);
+    has_video |= (units[i].media_type == FTL_VIDEO_DATA);
+  }
+
+  // Same order as media_destroy.
+  if (has_audio) {
+    os_lock_mutex(&ftl->audio.mutex);
+  }
+  if (has_video) {
+    os_lock_mutex(&ftl->video.mutex);
+  }
+
+  if (ftl_get_state(ftl, FTL_MEDIA_READY)) {
+    audio_mc->batching = has_audio;
+    video_mc->batching = has_video;
+
+    for (i = 0; i < unit_count; i++) {
+      const ftl_media_unit_t *unit = &units[i];
+
+      for (len = 0, b = 0; b < unit->buffer_count && len >= 0; b++) {
+        len = (unit->buffers[b].len < 0) ? -1 : len + unit->buffers[b].len;
+      }
+
+      if (len <= 0) {
+        continue;
+      }
+
+      _media_cursor_init(&in, unit->buffers, unit->buffer_count);
+
+      if (unit->media_type == FTL_AUDIO_DATA) {
+        bytes_queued += _media_queue_audio(ftl, unit->dts_usec, &in, len);
+      }
+      else if (unit->media_type == FTL_VIDEO_DATA) {
+        bytes_queued += _media_queue_video(ftl, unit->dts_usec, &in, len, unit->end_of_frame);
+      }
+    }
+
+    if (has_audio) {
+      audio_mc->batching = FALSE;
+      _media_publish_packets(audio_mc);
+    }
+    if (has_video) {
+      video_mc->batching = FALSE;
+      _media_publish_packets(video_mc);
+    }
+  }
+
+  if (has_video) {
+    os_unlock_mutex(&ftl->video.mutex);
+  }
+  if (has_audio) {
+    os_unlock_mutex(&ftl->audio.mutex);
+  }
+
+  return bytes_queued;
+}
+
+ftl_status_t media_submit_create(ftl_stream_configuration_private_t *ftl) {
+  media_submit_queue_t *queues[] = { &ftl->audio.submit, &ftl->video.submit };
+  media_submit_queue_t *queue;
+  int q, i;
+
+  for (q = 0; q < 2; q++) {
+    queue = queues[q];
+    queue->free_list = NULL;
+    queue->pending = NULL;
+    queue->combining = FALSE;
+    _media_submit_reset(queue);
+
+    for (i = 0; i < MAX_MEDIA_SUBMITTERS; i++) {
+      if (os_semaphore_create(&queue->pool[i].done_sem, "/SubmitDone", O_CREAT, 0) < 0) {
+        break;
+      }
+      queue->pool[i].next = queue->free_list;
+      queue->free_list = &queue->pool[i];
+    }
+
+    if (i < MAX_MEDIA_SUBMITTERS) {
+      while (i-- > 0) {
+        os_semaphore_delete(&queue->pool[i].done_sem);
+      }
+      queue->free_list = NULL;
+      return FTL_MALLOC_FAILURE;
+    }
+
+    os_init_mutex(&queue->mutex);
+    queue->created = TRUE;
+  }
+
+  return FTL_SUCCESS;
+}
+
+void media_submit_destroy(ftl_stream_configuration_private_t *ftl) {
+  media_submit_queue_t *queues[] = { &ftl->audio.submit, &ftl->video.submit };
+  int q, i;
+
+  for (q = 0; q < 2; q++) {
+    if (!queues[q]->created) {
+      continue;
+    }
+
+    for (i = 0; i < MAX_MEDIA_SUBMITTERS; i++) {
+      os_semaphore_delete(&queues[q]->pool[i].done_sem);
+    }
+
+    os_delete_mutex(&queues[q]->mutex);
+    queues[q]->created = FALSE;
+  }
+}
+
+/*
+ * Queues a unit in dts and nal_index order among concurrent callers. The unit
+ * goes on the pending list and whichever caller finds no one else combining
+ * queues every pending unit that is next in order, its own and other
+ * threads', so units are never copied and the media mutex sees one submitter
+ * at a time. A caller whose unit isn't next waits for it to be done. When the
+ * NALs in front of it don't show up in time their frame is given up on.
+ */
+ftl_status_t media_submit(ftl_stream_configuration_private_t *ftl, ftl_media_type_t media_type, int64_t dts_usec, int nal_index, uint8_t *data, int32_t len, int end_of_frame) {
+  media_submit_queue_t *queue = _media_submit_queue(ftl, media_type);
+  media_submission_t *s, *p, **pp;
+  ftl_status_t status;
+  BOOL timed_out;
+
+  os_lock_mutex(&queue->mutex);
+
+  do {
+    if (!ftl_get_state(ftl, FTL_MEDIA_READY)) {
+      status = FTL_NOT_CONNECTED;
+      break;
+    }
+
+    if (_media_submit_is_late(queue, media_type, dts_usec, nal_index)) {
+      status = FTL_MEDIA_REJECTED;
+      break;
+    }
+
+    if ((s = queue->free_list) == NULL) {
+      status = FTL_QUEUE_FULL;
+      break;
+    }
+
+    queue->free_list = s->next;
+
+    s->dts_usec = dts_usec;
+    s->nal_index = nal_index;
+    s->data = data;
+    s->len = len;
+    s->end_of_frame = end_of_frame;
+    s->done = FALSE;
+    s->status = FTL_SUCCESS;
+
+    for (pp = &queue->pending; *pp != NULL; pp = &(*pp)->next) {
+      if ((*pp)->dts_usec > dts_usec || ((*pp)->dts_usec == dts_usec && (*pp)->nal_index > nal_index)) {
+        break;
+      }
+    }
+    s->next = *pp;
+    *pp = s;
+
+    _media_submit_drain(ftl, queue, media_type, s);
+
+    while (!s->done) {
+      os_unlock_mutex(&queue->mutex);
+      timed_out = (os_semaphore_pend(&s->done_sem, SUBMIT_ORDER_TIMEOUT_MS) != 0);
+      os_lock_mutex(&queue->mutex);
+
+      // Whoever is combining will get to it or wake us up again.
+      if (s->done || queue->combining) {
+        continue;
+      }
+
+      if (!ftl_get_state(ftl, FTL_MEDIA_READY)) {
+        while ((p = queue->pending) != NULL) {
+          queue->pending = p->next;
+          _media_submit_finish(p, s, FTL_NOT_CONNECTED);
+        }
+      }
+      else if (timed_out && media_type == FTL_VIDEO_DATA) {
+        _media_submit_abandon(ftl, queue, s);
+      }
+
+      _media_submit_drain(ftl, queue, media_type, s);
+    }
+
+    status = s->status;
+
+    s->next = queue->free_list;
+    queue->free_list = s;
+  } while (0);
+
+  os_unlock_mutex(&queue->mutex);
+
+  return status;
+}
+
+/*
+ * Packetizes one audio unit into the queue. Called with the audio mutex held
+ * while the media is ready.
+ */
+static int _media_queue_audio(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, media_cursor_t *in, int32_t len) {
+  ftl_media_component_common_t *mc = &ftl->audio.media_component;
+  nack_ring_t *ring = mc->nack_ring;
+  int bytes_sent = 0;
+  int pkt_len;
+  int payload_size;
+  int slot;
+  int remaining = len;
+
+  mc->queue_status = FTL_SUCCESS;
+
+  // When we get our first audio packet, indicate that we are ready to send.
+  // However, don't send audio data until the video is also sending.
+  ftl->audio.is_ready_to_send = TRUE;
+  if (!ftl->video.has_sent_first_frame)
+  {
+    mc->queue_status = FTL_STATUS_WAITING_FOR_KEY_FRAME;
+    return 0;
+  }
+
+  // With fast start the video may have been running for a while, so audio
+  // takes the first frame's dts as its base to stay in sync with it.
+  if (ftl->video.fast_start && mc->base_dts_usec < 0) {
+    os_atomic_fence();
+
+    if (dts_usec < ftl->video.first_frame_dts_usec) {
+      mc->queue_status = FTL_STATUS_WAITING_FOR_KEY_FRAME;
+      return 0;
+    }
+
+    mc->base_dts_usec = ftl->video.first_frame_dts_usec;
+    FTL_LOG(ftl, FTL_LOG_INFO, "Audio started %d ms into the video\n", (int)((dts_usec - mc->base_dts_usec) / 1000));
+  }
+
+  _update_timestamp(ftl, mc, dts_usec);
+
+  while (remaining > 0) {
+    uint16_t sn = mc->seq_num;
+    uint8_t *pkt_buf;
+
+    if ((slot = _media_get_empty_slot(ftl, mc->ssrc, sn)) < 0) {
+      mc->queue_status = FTL_QUEUE_FULL;
+      break;
+    }
+
+    // An odd generation makes retransmits skip the slot while it is rewritten.
+    os_atomic_add(&ring->gen[slot], 1);
+
+    pkt_buf = _nack_slot_packet(ring, slot);
+    pkt_len = ring->packet_size;
+
+    payload_size = _media_make_audio_rtp_packet(ftl, in, remaining, pkt_buf, &pkt_len);
+
+    remaining -= payload_size;
+    bytes_sent += pkt_len;
+    mc->write_bytes += pkt_len;
+    mc->stats.payload_bytes_sent += payload_size;
+
+    ring->len[slot] = pkt_len;
+    ring->ext_len[slot] = 0;
+    ring->sn[slot] = sn;
+    ring->flags[slot] = NACK_SLOT_LAST;
+    ring->insert_us[slot] = _media_now_us();
+
+    os_atomic_add(&ring->gen[slot], 1);
+  }
+
+  _media_commit_packets(mc);
+
+  return bytes_sent;
+}
+
+/*
+ * Packetizes one NAL into the queue. Called with the video mutex held while
+ * the media is ready.
+ */
+static int _media_queue_video(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, media_cursor_t *in, int32_t len, int end_of_frame) {
+  ftl_media_component_common_t *mc = &ftl->video.media_component;
+  ftl_video_component_t *video = &ftl->video;
+  uint8_t nalu_type = 0;
+  uint8_t nri;
+  int bytes_queued = 0;
+  BOOL resumed = FALSE;
+
+  mc->queue_status = FTL_SUCCESS;
+
+  // Before we send any video we want to make sure the audio stream
+  // is also ready to run. If the stream isn't ready drop this data.
+  if (!ftl->audio.is_ready_to_send && !video->fast_start)
+  {
+    if (end_of_frame)
+    {
+      mc->stats.dropped_frames++;
+    }
+    mc->queue_status = FTL_NOT_ACTIVE_STREAM;
+    return bytes_queued;
+  }
+
+  nalu_type = _media_cursor_peek(in) & 0x1F;
+  nri = (_media_cursor_peek(in) >> 5) & 0x3;
+
+  // A new timestamp also starts a new frame, for callers that never set end_of_frame.
+  if (dts_usec != video->frame_dts_usec) {
+    if (video->drop_frame) {
+      video->drop_frame = FALSE;
+    }
+    else if (mc->seq_num != mc->commit_seq_num) {
+      _media_commit_video_frame(ftl);
+    }
+    video->frame_dts_usec = dts_usec;
+  }
+
+  // Drop the rest of a frame that didn't fit in the queue.
+  if (video->drop_frame) {
+    if (end_of_frame) {
+      video->drop_frame = FALSE;
+    }
+    mc->queue_status = FTL_QUEUE_FULL;
+    return bytes_queued;
+  }
+
+  if (ftl->video.wait_for_idr_frame) {
+    // An IDR without parameter sets will do when we have them cached, and so
+    // will a recovery point, which is all intra refresh encoders send.
+    if (video->sps.len > 0 && video->pps.len > 0) {
+      resumed = (nalu_type == H264_NALU_TYPE_IDR) ||
+        (nalu_type == H264_NALU_TYPE_SEI && _media_sei_has_recovery_point(in, len));
+    }
+
+    if (nalu_type == H264_NALU_TYPE_SPS || resumed) {
+
+      ftl->video.wait_for_idr_frame = FALSE;
+
+      if (video->recovery_start_us != 0) {
+        int recovery_ms = (int)((_media_now_us() - video->recovery_start_us) / 1000);
+
+        if (recovery_ms > mc->stats.max_recovery_ms) {
+          mc->stats.max_recovery_ms = recovery_ms;
+        }
+        video->recovery_start_us = 0;
+        FTL_LOG(ftl, FTL_LOG_DEBUG, "Waited %d ms for a key frame\n", recovery_ms);
+      }
+
+      if (!ftl->video.has_sent_first_frame) {
+        FTL_LOG(ftl, FTL_LOG_INFO, "%s and we have the first iframe, starting stream. (dropped %d frames)\n",
+          video->fast_start ? "Fast start" : "Audio is ready", mc->stats.dropped_frames);
+        video->first_frame_dts_usec = dts_usec;
+        // The audio thread reads first_frame_dts_usec once it sees the flag.
+        os_atomic_fence();
+        ftl->video.has_sent_first_frame = TRUE;
+      }
+      else {
+        FTL_LOG(ftl, FTL_LOG_INFO, "Got %s, continuing (dropped %d frames)\n",
+          nalu_type == H264_NALU_TYPE_SEI ? "recovery point" : "key frame", mc->stats.dropped_frames);
+      }
+    }
+    else {
+      if (end_of_frame) {
+        mc->stats.dropped_frames++;
+        // Ask again in case the last request came too soon or was ignored.
+        _media_request_keyframe(ftl, video->has_sent_first_frame ? FTL_KEYFRAME_FRAME_DROPPED : FTL_KEYFRAME_STREAM_START);
+      }
+      mc->queue_status = FTL_STATUS_WAITING_FOR_KEY_FRAME;
+      return bytes_queued;
+    }
+  }
+
+  if (_media_filter_video_nal(ftl, nalu_type, in, len)) {
+    if (end_of_frame) {
+      _media_end_video_frame(ftl, TRUE);
+    }
+    return bytes_queued;
+  }
+
+  // Key frames and recovery points go out with parameter sets, from the
+  // cache if the encoder didn't send them or they were filtered as repeats.
+  if (resumed || (nalu_type == H264_NALU_TYPE_IDR && (video->nal_filter & FTL_NAL_FILTER_REPEATED_PARAMS))) {
+    if (!video->frame_has_sps && video->sps.len > 0) {
+      bytes_queued += _media_queue_param_set(ftl, dts_usec, &video->sps);
+    }
+    if (!video->frame_has_pps && video->pps.len > 0 && mc->queue_status == FTL_SUCCESS) {
+      bytes_queued += _media_queue_param_set(ftl, dts_usec, &video->pps);
+    }
+    if (mc->queue_status != FTL_SUCCESS) {
+      return bytes_queued;
+    }
+  }
+
+  return bytes_queued + _media_packetize_video_nal(ftl, dts_usec, in, len, nalu_type, nri, end_of_frame);
+}
+
+/*
+ * Splits an admitted NAL into packets staged for the current frame, or drops
+ * the frame if they don't fit.
+ */
+static int _media_packetize_video_nal(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, media_cursor_t *in, int32_t len, uint8_t nalu_type, uint8_t nri, int end_of_frame) {
+  ftl_media_component_common_t *mc = &ftl->video.media_component;
+  ftl_video_component_t *video = &ftl->video;
+  int bytes_queued = 0;
+  int pkt_len;
+  int payload_size;
+  nack_ring_t *ring;
+  int slot;
+  int remaining = len;
+  int first_fu = 1;
+
+  if (mc->retired_ring != NULL) {
+    _media_retire_ring(ftl, mc);
+  }
+
+  // Give back memory from an earlier oversized key frame between frames.
+  if (mc->nack_ring->size > mc->nack_ring_slots && mc->seq_num == (uint16_t)os_atomic_load(&mc->ready_seq_num)) {
+    _media_shrink_video_ring(ftl);
+  }
+
+  _update_timestamp(ftl, mc, dts_usec);
+
+  if (nalu_type == H264_NALU_TYPE_SPS || nalu_type == H264_NALU_TYPE_PPS || nalu_type == H264_NALU_TYPE_IDR) {
+    video->frame_is_key = TRUE;
+  }
+
+  // Admit the NAL only if all of its packets fit, otherwise the whole
+  // frame is dropped including anything already staged for it.
+  if (!_media_reserve_video_packets(ftl, _media_video_packet_count(ftl, len))) {
+    _media_rollback_video_frame(ftl);
+    mc->stats.dropped_frames++;
+    if (nri) {
+      FTL_LOG(ftl, FTL_LOG_INFO, "Video queue full, dropping frames until next key frame\n");
+      ftl->video.wait_for_idr_frame = TRUE;
+      _media_start_recovery(ftl);
+    }
+    video->drop_frame = !end_of_frame;
+    mc->queue_status = FTL_QUEUE_FULL;
+    return bytes_queued;
+  }
+
+  ring = mc->nack_ring;
+
+  if (nalu_type == H264_NALU_TYPE_IDR) {
+    mc->tmp_seq_num = mc->seq_num;
+  }
+  else if (nalu_type == H264_NALU_TYPE_SPS) {
+    video->frame_has_sps = TRUE;
+  }
+  else if (nalu_type == H264_NALU_TYPE_PPS) {
+    video->frame_has_pps = TRUE;
+  }
+
+  while (remaining > 0) {
+    uint16_t sn = mc->seq_num;
+    uint8_t *pkt_buf;
+
+    slot = sn % ring->size;
+
+    // An odd generation makes retransmits skip the slot while it is rewritten.
+    os_atomic_add(&ring->gen[slot], 1);
+
+    pkt_buf = _nack_slot_packet(ring, slot);
+    pkt_len = ring->packet_size;
+
+    ring->flags[slot] = (nalu_type == H264_NALU_TYPE_IDR) ? NACK_SLOT_IFRAME : 0;
+
+    payload_size = _media_make_video_rtp_packet(ftl, in, remaining, pkt_buf, &pkt_len, first_fu);
+
+    first_fu = 0;
+    remaining -= payload_size;
+    bytes_queued += pkt_len;
+    video->frame_payload_bytes += payload_size;
+    mc->stats.payload_bytes_sent += payload_size;
+
+    /*if all data has been consumed set marker bit*/
+    if (remaining <= 0 && end_of_frame) {
+      _media_set_marker_bit(mc, pkt_buf);
+      ring->flags[slot] |= NACK_SLOT_LAST;
+    }
+
+    ring->len[slot] = pkt_len;
+    ring->ext_data[slot] = in->ext;
+    ring->ext_len[slot] = in->by_reference ? in->ext_len : 0;
+    ring->ext_ref[slot] = in->ref;
+    ring->sn[slot] = sn;
+    ring->insert_us[slot] = _media_now_us();
+
+    os_atomic_add(&ring->gen[slot], 1);
+
+    video->frame_bytes_queued += pkt_len;
+    mc->write_bytes += pkt_len;
+    mc->stats.packets_queued++;
+    mc->stats.bytes_queued += pkt_len;
+  }
+
+  mc->stats.current_frame_size += len;
+
+  if (end_of_frame) {
+    _media_end_video_frame(ftl, FALSE);
+  }
+
+  return bytes_queued;
+}
+
+/*
+ * Completes the frame after its last NAL. When that NAL was filtered out the
+ * marker goes on the last packet staged for the frame instead.
+ */
+static void _media_end_video_frame(ftl_stream_configuration_private_t *ftl, BOOL mark_last) {
+  ftl_media_component_common_t *mc = &ftl->video.media_component;
+  nack_ring_t *ring = mc->nack_ring;
+  int slot;
+
+  if (mark_last && mc->seq_num != mc->commit_seq_num) {
+    slot = (uint16_t)(mc->seq_num - 1) % ring->size;
+
+    os_atomic_add(&ring->gen[slot], 1);
+    _media_set_marker_bit(mc, _nack_slot_packet(ring, slot));
+    ring->flags[slot] |= NACK_SLOT_LAST;
+    os_atomic_add(&ring->gen[slot], 1);
+  }
+
+  _media_commit_video_frame(ftl);
+
+  mc->stats.frames_received++;
+
+  if (mc->stats.current_frame_size > mc->stats.max_frame_size) {
+    mc->stats.max_frame_size = mc->stats.current_frame_size;
+  }
+
+  mc->stats.current_frame_size = 0;
+}
+
+/*
+ * Returns TRUE for NALs nal_filter drops before packetizing, counting the
+ * bytes saved. Also keeps the parameter set cache current.
+ */
+static BOOL _media_filter_video_nal(ftl_stream_configuration_private_t *ftl, uint8_t nalu_type, media_cursor_t *in, int32_t len) {
+  ftl_video_component_t *video = &ftl->video;
+  ftl_nal_filter_stats_t *saved = &video->nal_filter_stats;
+  int filter = video->nal_filter;
+
+  switch (nalu_type) {
+  case H264_NALU_TYPE_FILLER:
+    if (filter & FTL_NAL_FILTER_FILLER) {
+      saved->filler_bytes += len;
+      return TRUE;
+    }
+    break;
+  case H264_NALU_TYPE_DELIM:
+    if (filter & FTL_NAL_FILTER_AUD) {
+      saved->aud_bytes += len;
+      return TRUE;
+    }
+    break;
+  case H264_NALU_TYPE_SEI:
+    // Recovery points are kept, a decoder joining an intra refresh stream needs them.
+    if ((filter & FTL_NAL_FILTER_SEI) && !_media_sei_has_recovery_point(in, len)) {
+      saved->sei_bytes += len;
+      return TRUE;
+    }
+    break;
+  case H264_NALU_TYPE_SPS:
+    if (_media_cache_param_set(&video->sps, in, len) && (filter & FTL_NAL_FILTER_REPEATED_PARAMS)) {
+      saved->sps_bytes += len;
+      return TRUE;
+    }
+    break;
+  case H264_NALU_TYPE_PPS:
+    if (_media_cache_param_set(&video->pps, in, len) && (filter & FTL_NAL_FILTER_REPEATED_PARAMS)) {
+      saved->pps_bytes += len;
+      return TRUE;
+    }
+    break;
+  }
+
+  return FALSE;
+}
+
+/*
+ * Stores a parameter set in the cache without consuming it. Returns TRUE if
+ * it is the same as the cached one. Sets too big for the cache clear it.
+ */
+static BOOL _media_cache_param_set(media_param_set_t *set, media_cursor_t *in, int32_t len) {
+  uint8_t nal[MAX_PARAM_SET_SIZE];
+  media_cursor_t probe = *in;
+
+  if (len > MAX_PARAM_SET_SIZE) {
+    set->len = 0;
+    return FALSE;
+  }
+
+  _media_cursor_copy(&probe, nal, len);
+
+  if (set->len == len && memcmp(set->data, nal, len) == 0) {
+    return TRUE;
+  }
+
+  memcpy(set->data, nal, len);
+  set->len = len;
+
+  return FALSE;
+}
+
+/*
+ * Looks for a recovery point message in an SEI NAL without consuming it.
+ * H.264 signals gradual decoder refresh this way, with recovery_frame_cnt
+ * giving the length of the refresh. Only the start of the NAL is searched,
+ * encoders put recovery points ahead of large payloads.
+ */
+static BOOL _media_sei_has_recovery_point(media_cursor_t *in, int32_t len) {
+  uint8_t sei[MAX_SEI_PROBE_SIZE];
+  media_cursor_t probe = *in;
+  int n = (len < MAX_SEI_PROBE_SIZE) ? len : MAX_SEI_PROBE_SIZE;
+  int i, rbsp_len = 0, zeros = 0;
+  int pos = 0;
+
+  _media_cursor_copy(&probe, sei, n);
+
+  // Strip the NAL header and emulation prevention bytes.
+  for (i = 1; i < n; i++) {
+    if (zeros >= 2 && sei[i] == 3) {
+      zeros = 0;
+      continue;
+    }
+    zeros = (sei[i] == 0) ? zeros + 1 : 0;
+    sei[rbsp_len++] = sei[i];
+  }
+
+  // Messages run until the rbsp trailing bits.
+  while (pos < rbsp_len && sei[pos] != 0x80) {
+    int payload_type = 0;
+    int payload_size = 0;
+
+    while (pos < rbsp_len && sei[pos] == 0xFF) {
+      payload_type += 255;
+      pos++;
+    }
+    if (pos >= rbsp_len) {
+      break;
+    }
+    payload_type += sei[pos++];
+
+    while (pos < rbsp_len && sei[pos] == 0xFF) {
+      payload_size += 255;
+      pos++;
+    }
+    if (pos >= rbsp_len) {
+      break;
+    }
+    payload_size += sei[pos++];
+
+    if (payload_type == H264_SEI_RECOVERY_POINT) {
+      return TRUE;
+    }
+
+    pos += payload_size;
+  }
+
+  return FALSE;
+}
+
+// Queues a cached parameter set in front of a key frame that came without it.
+static int _media_queue_param_set(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, media_param_set_t *set) {
+  ftl_media_buffer_t buf = { set->data, set->len };
+  media_cursor_t in;
+  int bytes_queued;
+
+  _media_cursor_init(&in, &buf, 1);
+
+  bytes_queued = _media_packetize_video_nal(ftl, dts_usec, &in, set->len, set->data[0] & 0x1F, (set->data[0] >> 5) & 0x3, FALSE);
+  if (bytes_queued > 0) {
+    ftl->video.nal_filter_stats.injected_bytes += set->len;
+  }
+
+  return bytes_queued;
+}
+
+static media_submit_queue_t *_media_submit_queue(ftl_stream_configuration_private_t *ftl, ftl_media_type_t media_type) {
+  return (media_type == FTL_AUDIO_DATA) ? &ftl->audio.submit : &ftl->video.submit;
+}
+
+static void _media_submit_reset(media_submit_queue_t *queue) {
+  queue->frame_dts_usec = 0;
+  queue->in_frame = FALSE;
+  queue->next_nal_index = 0;
+  queue->last_dts_usec = 0;
+  queue->have_last = FALSE;
+}
+
+/*
+ * A video unit is late once its frame was finished or given up on, or the
+ * NAL after it was already queued. Audio is never late.
+ */
+static BOOL _media_submit_is_late(media_submit_queue_t *queue, ftl_media_type_t media_type, int64_t dts_usec, int nal_index) {
+  if (media_type != FTL_VIDEO_DATA) {
+    return FALSE;
+  }
+
+  if (queue->have_last && dts_usec <= queue->last_dts_usec) {
+    return TRUE;
+  }
+
+  if (queue->in_frame) {
+    return dts_usec < queue->frame_dts_usec || (dts_usec == queue->frame_dts_usec && nal_index < queue->next_nal_index);
+  }
+
+  return FALSE;
+}
+
+static BOOL _media_submit_is_next(media_submit_queue_t *queue, ftl_media_type_t media_type, media_submission_t *s) {
+  if (media_type != FTL_VIDEO_DATA) {
+    return TRUE;
+  }
+
+  if (queue->in_frame) {
+    return s->dts_usec == queue->frame_dts_usec && s->nal_index == queue->next_nal_index;
+  }
+
+  return s->nal_index == 0;
+}
+
+static ftl_status_t _media_submit_unit(ftl_stream_configuration_private_t *ftl, ftl_media_type_t media_type, media_submission_t *s) {
+  ftl_media_component_common_t *mc;
+  ftl_media_buffer_t buf = { s->data, s->len };
+  media_cursor_t in;
+  OS_MUTEX *mutex;
+  ftl_status_t status = FTL_NOT_CONNECTED;
+
+  if (media_type == FTL_AUDIO_DATA) {
+    mc = &ftl->audio.media_component;
+    mutex = &ftl->audio.mutex;
+  }
+  else {
+    mc = &ftl->video.media_component;
+    mutex = &ftl->video.mutex;
+  }
+
+  _media_cursor_init(&in, &buf, 1);
+
+  os_lock_mutex(mutex);
+
+  if (ftl_get_state(ftl, FTL_MEDIA_READY)) {
+    if (media_type == FTL_AUDIO_DATA) {
+      _media_queue_audio(ftl, s->dts_usec, &in, s->len);
+    }
+    else {
+      _media_queue_video(ftl, s->dts_usec, &in, s->len, s->end_of_frame);
+    }
+    status = mc->queue_status;
+  }
+
+  os_unlock_mutex(mutex);
+
+  return status;
+}
+
+// Hands a unit back to its submitter, which is waiting unless it is own.
+static void _media_submit_finish(media_submission_t *s, media_submission_t *own, ftl_status_t status) {
+  s->status = status;
+  s->done = TRUE;
+
+  if (s != own) {
+    os_semaphore_post(&s->done_sem);
+  }
+}
+
+/*
+ * Queues pending units for as long as the head is next in order. Called with
+ * the submit mutex held, which is dropped around each unit.
+ */
+static void _media_submit_drain(ftl_stream_configuration_private_t *ftl, media_submit_queue_t *queue, ftl_media_type_t media_type, media_submission_t *own) {
+  media_submission_t *s;
+  ftl_status_t status;
+
+  if (queue->combining) {
+    return;
+  }
+
+  queue->combining = TRUE;
+
+  while ((s = queue->pending) != NULL) {
+    if (_media_submit_is_late(queue, media_type, s->dts_usec, s->nal_index)) {
+      queue->pending = s->next;
+      _media_submit_finish(s, own, FTL_MEDIA_REJECTED);
+      continue;
+    }
+
+    if (!_media_submit_is_next(queue, media_type, s)) {
+      break;
+    }
+
+    queue->pending = s->next;
+
+    os_unlock_mutex(&queue->mutex);
+    status = _media_submit_unit(ftl, media_type, s);
+    os_lock_mutex(&queue->mutex);
+
+    if (media_type == FTL_VIDEO_DATA) {
+      if (s->end_of_frame) {
+        queue->in_frame = FALSE;
+        queue->next_nal_index = 0;
+        queue->last_dts_usec = s->dts_usec;
+        queue->have_last = TRUE;
+      }
+      else {
+        queue->in_frame = TRUE;
+        queue->frame_dts_usec = s->dts_usec;
+        queue->next_nal_index = s->nal_index + 1;
+      }
+    }
+
+    _media_submit_finish(s, own, status);
+  }
+
+  queue->combining = FALSE;
+}
+
+/*
+ * Gives up on the video frame holding up the pending units and rejects what
+ * arrived of it. Called with the submit mutex held and no one combining.
+ */
+static void _media_submit_abandon(ftl_stream_configuration_private_t *ftl, media_submit_queue_t *queue, media_submission_t *own) {
+  media_submission_t *s;
+  int64_t dts_usec = queue->in_frame ? queue->frame_dts_usec : queue->pending->dts_usec;
+
+  // Units submitted meanwhile wait for the next drain.
+  queue->combining = TRUE;
+  os_unlock_mutex(&queue->mutex);
+
+  os_lock_mutex(&ftl->video.mutex);
+  if (ftl_get_state(ftl, FTL_MEDIA_READY)) {
+    _media_abandon_video_frame(ftl, dts_usec);
+  }
+  os_unlock_mutex(&ftl->video.mutex);
+
+  os_lock_mutex(&queue->mutex);
+  queue->combining = FALSE;
+
+  queue->in_frame = FALSE;
+  queue->next_nal_index = 0;
+  queue->last_dts_usec = dts_usec;
+  queue->have_last = TRUE;
+
+  while ((s = queue->pending) != NULL && s->dts_usec <= dts_usec) {
+    queue->pending = s->next;
+    _media_submit_finish(s, own, FTL_MEDIA_REJECTED);
+  }
+}
+
+/*
+ * Number of RTP packets _media_make_video_rtp_packet() will split a NAL of
+ * len bytes into.
+ */
+static int _media_video_packet_count(ftl_stream_configuration_private_t *ftl, int len) {
+  int fua_payload = ftl->media.max_mtu - RTP_HEADER_BASE_LEN - RTP_FUA_HEADER_LEN;
+
+  if (len <= ftl->media.max_mtu - RTP_HEADER_BASE_LEN) {
+    return 1;
+  }
+
+  // The NAL header byte is carried in the FU-A header.
+  return (len - 1 + fua_payload - 1) / fua_payload;
+}
+
+/*
+ * Makes sure needed more video packets fit in the queue on top of the ones
+ * already queued or staged. Key frames may grow the ring up to its memory cap.
+ */
+static BOOL _media_reserve_video_packets(ftl_stream_configuration_private_t *ftl, int needed) {
+  ftl_media_component_common_t *mc = &ftl->video.media_component;
+  int queued = (uint16_t)(mc->seq_num - (uint16_t)os_atomic_load(&mc->xmit_seq_num));
+  int size = mc->nack_ring->size;
+  int region = !_nack_ring_region(mc, mc->nack_ring);
+
+  if (queued + needed < size) {
+    return TRUE;
+  }
+
+  if (!ftl->video.frame_is_key) {
+    return FALSE;
+  }
+
+  while (size <= queued + needed && size < MAX_NACK_RB_SIZE) {
+    size <<= 1;
+  }
+
+  if (size <= queued + needed || mc->ring_region[region] == NULL || _nack_ring_bytes(size, ftl->media.max_mtu) > mc->ring_region_bytes[region]) {
+    FTL_LOG(ftl, FTL_LOG_WARN, "Key frame needs %d packets, more than the video queue can grow to\n", queued + needed);
+    return FALSE;
+  }
+
+  if (!_media_resize_ring(ftl, mc, size)) {
+    return FALSE;
+  }
+
+  FTL_LOG(ftl, FTL_LOG_INFO, "Grew video queue to %d packets for an oversized key frame\n", size);
+  mc->nack_ring_grown_us = _media_now_us();
+
+  return TRUE;
+}
+
+static void _media_shrink_video_ring(ftl_stream_configuration_private_t *ftl) {
+  ftl_media_component_common_t *mc = &ftl->video.media_component;
+
+  // Keep the grown ring around long enough to serve retransmits of the key frame.
+  if (_media_now_us() - mc->nack_ring_grown_us < (int64_t)_media_retention_ms(ftl) * 1000) {
+    return;
+  }
+
+  if (_media_resize_ring(ftl, mc, mc->nack_ring_slots)) {
+    FTL_LOG(ftl, FTL_LOG_INFO, "Returned video queue to %d packets\n", mc->nack_ring_slots);
+  }
+}
+
+static void _media_commit_video_frame(ftl_stream_configuration_private_t *ftl) {
+  ftl_video_component_t *video = &ftl->video;
+
+  _media_commit_packets(&video->media_component);
+
+  video->frame_buffer_ref = (uint32_t)video->media_component.buffer_ref_head;
+  video->frame_bytes_queued = 0;
+  video->frame_payload_bytes = 0;
+  video->frame_is_key = FALSE;
+  video->frame_has_sps = FALSE;
+  video->frame_has_pps = FALSE;
+}
+
+/*
+ * Forgets the packets staged for the current frame, none of them were
+ * published so the send thread never saw them.
+ */
+static void _media_rollback_video_frame(ftl_stream_configuration_private_t *ftl) {
+  ftl_video_component_t *video = &ftl->video;
+  ftl_media_component_common_t *mc = &video->media_component;
+  uint16_t ready = mc->commit_seq_num;
+  uint32_t id;
+
+  // Buffers of the frame have no packets left, the send thread can release
+  // them right away.
+  for (id = video->frame_buffer_ref; id != (uint32_t)mc->buffer_ref_head; id++) {
+    media_buffer_ref_t *ref = &mc->buffer_refs[id % MAX_BUFFER_REFS];
+    os_atomic_store(&ref->end_sn, ref->start_sn);
+  }
+
+  mc->stats.packets_queued -= (uint16_t)(mc->seq_num - ready);
+  mc->stats.bytes_queued -= video->frame_bytes_queued;
+  mc->stats.payload_bytes_sent -= video->frame_payload_bytes;
+  mc->stats.current_frame_size = 0;
+  mc->seq_num = ready;
+  mc->write_bytes = mc->commit_bytes;
+
+  video->frame_bytes_queued = 0;
+  video->frame_payload_bytes = 0;
+  video->frame_is_key = FALSE;
+  video->frame_has_sps = FALSE;
+  video->frame_has_pps = FALSE;
+}
+
+/*
+ * Gives up on a frame some of whose NALs never arrived. What was staged for
+ * it is dropped and so is everything up to the next key frame, which may
+ * reference it.
+ */
+static void _media_abandon_video_frame(ftl_stream_configuration_private_t *ftl, int64_t dts_usec) {
+  ftl_video_component_t *video = &ftl->video;
+  ftl_media_component_common_t *mc = &video->media_component;
+
+  if (video->frame_dts_usec == dts_usec) {
+    _media_rollback_video_frame(ftl);
+  }
+
+  mc->stats.dropped_frames++;
+  video->drop_frame = FALSE;
+  video->wait_for_idr_frame = TRUE;
+  _media_start_recovery(ftl);
+
+  FTL_LOG(ftl, FTL_LOG_WARN, "Gave up on the frame at %lld us after waiting %d ms for its missing NALs\n", (long long)dts_usec, SUBMIT_ORDER_TIMEOUT_MS);
+}
+
+/*
+ * Asks the encoder for a key frame unless one was asked for less than
+ * keyframe_request_interval_ms ago. Called from the send calls, the recv
+ * thread and media_init.
+ */
+static void _media_request_keyframe(ftl_stream_configuration_private_t *ftl, ftl_keyframe_reason_t reason) {
+  ftl_video_component_t *video = &ftl->video;
+  int64_t now_us = _media_now_us();
+  BOOL request = FALSE;
+
+  if (video->keyframe_request == NULL) {
+    return;
+  }
+
+  os_lock_mutex(&video->keyframe_mutex);
+  if (video->last_keyframe_request_us == 0 || now_us - video->last_keyframe_request_us >= (int64_t)video->keyframe_request_interval_ms * 1000) {
+    video->last_keyframe_request_us = now_us;
+    video->media_component.stats.keyframe_requests++;
+    request = TRUE;
+  }
+  os_unlock_mutex(&video->keyframe_mutex);
+
+  if (request) {
+    FTL_LOG(ftl, FTL_LOG_DEBUG, "Requesting a key frame (reason %d)\n", reason);
+    video->keyframe_request(video->keyframe_request_context, reason);
+  }
+}
+
+// Frames are dropped until the next key frame from now on, ask for one.
+static void _media_start_recovery(ftl_stream_configuration_private_t *ftl) {
+  if (ftl->video.recovery_start_us == 0) {
+    ftl->video.recovery_start_us = _media_now_us();
+  }
+
+  _media_request_keyframe(ftl, FTL_KEYFRAME_FRAME_DROPPED);
+}
+
+static ftl_media_component_common_t *_media_lookup(ftl_stream_configuration_private_t *ftl, uint32_t ssrc) {
+  ftl_media_component_common_t *mc = NULL;
+
+  /*check audio*/
+  mc = &ftl->audio.media_component;
+  if (mc->ssrc == ssrc) {
+    return mc;
+  }
+
+  /*check video*/
+  mc = &ftl->video.media_component;
+  if (mc->ssrc == ssrc) {
+    return mc;
+  }
+
+  return NULL;
+}
+
+/*
+ * Returns the slot index for sn or -1 if the queue is full.
+ */
+static int _media_get_empty_slot(ftl_stream_configuration_private_t *ftl, uint32_t ssrc, uint16_t sn) {
+  ftl_media_component_common_t *mc;
+
+  if ((mc = _media_lookup(ftl, ssrc)) == NULL) {
+    FTL_LOG(ftl, FTL_LOG_ERROR, "Unable to find ssrc %d\n", ssrc);
+    return -1;
+  }
+
+  // If the next sequence number would land on the slot the send thread is
+  // still working on the queue is full. The subtraction is done in uint16 to
+  // handle the sequence number rollover.
+  uint16_t queued = sn - (uint16_t)os_atomic_load(&mc->xmit_seq_num);
+  if (queued >= mc->nack_ring->size - 1) {
+    return -1;
+  }
+
+  return sn % mc->nack_ring->size;
+}
+
+static float _media_get_queue_fullness(ftl_stream_configuration_private_t *ftl, uint32_t ssrc) {
+  ftl_media_component_common_t *mc;
+
+  if ((mc = _media_lookup(ftl, ssrc)) == NULL) {
+    FTL_LOG(ftl, FTL_LOG_ERROR, "Unable to find ssrc %d\n", ssrc);
+    return -1;
+  }
+
+  nack_ring_t *ring;
+  int size = 0;
+
+  if ((ring = _media_acquire_ring(mc)) != NULL) {
+    size = ring->size;
+    _media_release_ring(mc, ring);
+  }
+
+  if (size == 0) {
+    return 0;
+  }
+
+  uint16_t packets_queued = (uint16_t)os_atomic_load(&mc->ready_seq_num) - (uint16_t)os_atomic_load(&mc->xmit_seq_num);
+
+  return (float)packets_queued / (float)size;
+}
+
+/*
+ * Reads the published but unsent part of the ring without locks. xmit is
+ * loaded before ready so the send thread can't appear to be ahead.
+ */
+ftl_status_t media_get_queue_status(ftl_stream_configuration_private_t *ftl, ftl_media_type_t media_type, ftl_queue_status_t *status) {
+  ftl_media_component_common_t *mc = (media_type == FTL_AUDIO_DATA) ? &ftl->audio.media_component : &ftl->video.media_component;
+  nack_ring_t *ring;
+  uint16_t tail, ready;
+  uint32_t xmit_bytes, ready_bytes;
+  int slot;
+  int kbps;
+
+  memset(status, 0, sizeof(ftl_queue_status_t));
+  status->drain_time_ms = -1;
+
+  if (!ftl_get_state(ftl, FTL_MEDIA_READY)) {
+    return FTL_NOT_CONNECTED;
+  }
+
+  tail = (uint16_t)os_atomic_load(&mc->xmit_seq_num);
+  xmit_bytes = (uint32_t)os_atomic_load(&mc->xmit_bytes);
+  ready = (uint16_t)os_atomic_load(&mc->ready_seq_num);
+  ready_bytes = (uint32_t)os_atomic_load(&mc->ready_bytes);
+
+  status->queued_packets = (uint16_t)(ready - tail);
+  status->queued_bytes = ready_bytes - xmit_bytes;
+
+  if (status->queued_packets > 0 && (ring = _media_acquire_ring(mc)) != NULL) {
+    slot = tail % ring->size;
+
+    // The packet may have been sent meanwhile, then the slot holds another one.
+    if (ring->sn[slot] == tail) {
+      status->oldest_packet_age_ms = (int)((_media_now_us() - ring->insert_us[slot]) / 1000);
+      if (status->oldest_packet_age_ms < 0) {
+        status->oldest_packet_age_ms = 0;
+      }
+    }
+
+    _media_release_ring(mc, ring);
+  }
+
+  // Only video is paced.
+  if (media_type == FTL_VIDEO_DATA && (kbps = ftl->video.paced_kbps) > 0) {
+    status->rate_kbps = kbps;
+    status->drain_time_ms = (int)(status->queued_bytes * 8 / kbps);
+  }
+
+  return FTL_SUCCESS;
+}
+
+/*
+ * Tells the queue callback when the video queue crosses its thresholds.
+ * Called by the video send thread around every batch.
+ */
+static void _media_check_queue_level(ftl_stream_configuration_private_t *ftl) {
+  ftl_video_component_t *video = &ftl->video;
+  ftl_queue_status_t status;
+
+  if (video->queue_callback == NULL) {
+    return;
+  }
+
+  if (media_get_queue_status(ftl, FTL_VIDEO_DATA, &status) != FTL_SUCCESS || status.drain_time_ms < 0) {
+    return;
   }
 
-  if (os_trylock_mutex(&ftl->audio.mutex)) {
+  if (!video->queue_above && status.drain_time_ms >= video->queue_high_drain_ms) {
+    video->queue_above = TRUE;
+    video->queue_callback(video->queue_callback_context, &status, 1);
+  }
+  else if (video->queue_above && status.drain_time_ms <= video->queue_low_drain_ms) {
+    video->queue_above = FALSE;
+    video->queue_callback(video->queue_callback_context, &status, 0);
+  }
+}
+
+static int64_t _media_now_us() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (int64_t)timeval_to_us(&now);
+}
 
-    if (ftl_get_state(ftl, FTL_MEDIA_READY)) {
+/*
+ * How long sent packets can still be retransmitted. A retransmit that arrives
+ * many round trips after the original is useless to the ingest, so this is a
+ * multiple of the smoothed rtt capped by the configured retention.
+ */
+static int _media_retention_ms(ftl_stream_configuration_private_t *ftl) {
+  ftl_media_config_t *media = &ftl->media;
+  int retention_ms;
 
-      _update_timestamp(ftl, mc, dts_usec);
+  if (media->srtt_ms < 0) {
+    return media->retention_ms;
+  }
 
-      while (remaining > 0) {
-        uint16_t sn = mc->seq_num;
-        uint32_t ssrc = mc->ssrc;
-        uint8_t *pkt_buf;
+  retention_ms = media->srtt_ms * media->retention_rtt_multiplier;
 
-        if ((slot = _media_get_empty_slot(ftl, ssrc, sn)) == NULL) {
-          return 0;
-        }
+  if (retention_ms < MIN_RETENTION_MS) {
+    retention_ms = MIN_RETENTION_MS;
+  }
 
-        pkt_buf = slot->packet;
-        pkt_len = sizeof(slot->packet);
+  if (retention_ms > media->retention_ms) {
+    retention_ms = media->retention_ms;
+  }
 
-        os_lock_mutex(&slot->mutex);
+  return retention_ms;
+}
 
-        payload_size = _media_make_audio_rtp_packet(ftl, data, remaining, pkt_buf, &pkt_len);
+/*
+ * Sends one packet that is private to the calling thread (ping, sender report
+ * and retransmit packets).
+ */
+static int _media_send_buffer(ftl_stream_configuration_private_t *ftl, uint8_t *buf, int len) {
+  int tx_len;
 
-        remaining -= payload_size;
-        data += payload_size;
-        bytes_sent += pkt_len;
-        mc->stats.payload_bytes_sent += payload_size;
+  if ((tx_len = sendto(ftl->media.media_socket, buf, len, 0, (struct sockaddr*) ftl->media.ingest_addr, (int)ftl->media.ingest_addrlen)) == SOCKET_ERROR)
+  {
+    FTL_LOG(ftl, FTL_LOG_ERROR, "sendto() failed with error: %s", get_socket_error());
+  }
+  
+  return tx_len;
+}
 
-        slot->len = pkt_len;
-        slot->sn = sn;
-        slot->last = 1;
-        gettimeofday(&slot->insert_time, NULL);
+static void _media_update_xmit_stats(ftl_media_component_common_t *mc, nack_ring_t *ring, int idx, int tx_len) {
+  float xmit_delay_delta;
 
-        os_unlock_mutex(&slot->mutex);
+  if (ring->flags[idx] & NACK_SLOT_LAST) {
+    mc->stats.frames_sent++;
+  }
+  mc->stats.packets_sent++;
+  if (tx_len > 0) {
+    mc->stats.bytes_sent += tx_len;
+  }
 
-        os_semaphore_post(&mc->pkt_ready);
-      }
-    }
+  xmit_delay_delta = (float)(ring->xmit_us[idx] - ring->insert_us[idx]) / 1000.f;
 
-    os_unlock_mutex(&ftl->audio.mutex);
+  if (xmit_delay_delta > mc->stats.pkt_xmit_delay_max) {
+    mc->stats.pkt_xmit_delay_max = (int)xmit_delay_delta;
+  }
+  else if (xmit_delay_delta < mc->stats.pkt_xmit_delay_min) {
+    mc->stats.pkt_xmit_delay_min = (int)xmit_delay_delta;
   }
 
-  return bytes_sent;
+  mc->stats.total_xmit_delay += (int)xmit_delay_delta;
+  mc->stats.xmit_delay_samples++;
 }
 
-int media_send_video(ftl_stream_configuration_private_t *ftl, int64_t dts_usec, uint8_t *data, int32_t len, int end_of_frame) {
-  ftl_media_component_common_t *mc = &ftl->video.media_component;
-  uint8_t nalu_type = 0;
-  uint8_t nri;
-  int bytes_queued = 0;
-  int pkt_len;
-  int payload_size;
-  nack_slot_t *slot;
-  int remaining = len;
-  int first_fu = 1;
+/*
+ * Returns how many packets starting at pkts can go out as one UDP GSO
+ * super-buffer: a run of equally sized packets (typically the FU-A fragments
+ * of one NAL) optionally followed by a single shorter one.
+ */
+static int _media_gso_run_length(socket_packet_t *pkts, int count) {
+  int segment_size = pkts[0].len;
+  int run_bytes = segment_size;
+  int run = 1;
 
-  // Before we send any video we want to make sure the audio stream
-  // is also ready to run. If the stream isn't ready drop this data.
-  if (!ftl->audio.is_ready_to_send)
-  {
-    if (end_of_frame)
-    {
-      mc->stats.dropped_frames++;
+  while (run < count && run_bytes + pkts[run].len <= MAX_GSO_BYTES) {
+    int len = pkts[run].len;
+
+    if (len > segment_size) {
+      break;
+    }
+
+    run_bytes += len;
+    run++;
+
+    if (len < segment_size) {
+      break;
     }
-    return bytes_queued;
   }
 
-  if (os_trylock_mutex(&ftl->video.mutex)) {
+  return run;
+}
 
-    if (ftl_get_state(ftl, FTL_MEDIA_READY)) {
+/*
+ * Sends packets in order, using UDP segmentation offload for runs of same
+ * sized packets when the kernel supports it and sendmmsg() batches for the
+ * rest. Returns the number of packets sent.
+ */
+static int _media_send_batch(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, socket_packet_t *pkts, int count) {
+  ftl_media_config_t *media = &ftl->media;
+  int sent = 0;
+  int ret, n;
 
-      nalu_type = data[0] & 0x1F;
-      nri = (data[0] >> 5) & 0x3;
+  while (sent < count) {
 
-      if (ftl->video.wait_for_idr_frame) {
-        if (nalu_type == H264_NALU_TYPE_SPS) {
+    if (media->gso_enabled) {
+      n = _media_gso_run_length(pkts + sent, count - sent);
 
-          ftl->video.wait_for_idr_frame = FALSE;
+      if (n >= MIN_GSO_SEGMENTS) {
+        if (send_socket_gso(media->media_socket, pkts + sent, n, pkts[sent].len, media->ingest_addr, (int)media->ingest_addrlen) != SOCKET_ERROR) {
+          mc->stats.gso_sends++;
+          mc->stats.gso_packets += n;
+          sent += n;
+          continue;
+        }
 
-          if (!ftl->video.has_sent_first_frame) {
-            FTL_LOG(ftl, FTL_LOG_INFO, "Audio is ready and we have the first iframe, starting stream. (dropped %d frames)\n", mc->stats.dropped_frames);
-            ftl->video.has_sent_first_frame = TRUE;
-          }
-          else {
-            FTL_LOG(ftl, FTL_LOG_INFO, "Got key frame, continuing (dropped %d frames)\n", mc->stats.dropped_frames);
-          }
+        // Only an error saying GSO can't work here turns it off, a full
+        // buffer under load just sends this run without it.
+        if (get_socket_gso_unsupported_error()) {
+          FTL_LOG(ftl, FTL_LOG_WARN, "UDP GSO send failed (%s), falling back to batched sends\n", get_socket_error());
+          media->gso_enabled = FALSE;
         }
         else {
-          if (end_of_frame) {
-            mc->stats.dropped_frames++;
-          }
-          os_unlock_mutex(&ftl->video.mutex);
-          return bytes_queued;
+          mc->stats.gso_fallbacks++;
         }
       }
-
-      _update_timestamp(ftl, mc, dts_usec);
-
-      if (nalu_type == H264_NALU_TYPE_IDR) {
-        mc->tmp_seq_num = mc->seq_num;
+      else {
+        // Batch everything up to the start of the next run.
+        n = 1;
+        while (sent + n < count && _media_gso_run_length(pkts + sent + n, count - sent - n) < MIN_GSO_SEGMENTS) {
+          n++;
+        }
       }
+    }
+    else {
+      n = count - sent;
+    }
 
-      while (remaining > 0) {
-        uint16_t sn = mc->seq_num;
-        uint32_t ssrc = mc->ssrc;
-        uint8_t *pkt_buf;
+    if ((ret = send_socket_batch(media->media_socket, pkts + sent, n, media->ingest_addr, (int)media->ingest_addrlen)) == SOCKET_ERROR) {
+      break;
+    }
 
-        if ((slot = _media_get_empty_slot(ftl, ssrc, sn)) == NULL) {
-          if (nri) {
-            FTL_LOG(ftl, FTL_LOG_INFO, "Video queue full, dropping packets until next key frame\n");
-            ftl->video.wait_for_idr_frame = TRUE;
-          }
-          os_unlock_mutex(&ftl->video.mutex);
-          return bytes_queued;
-        }       
+    sent += ret;
 
-        os_lock_mutex(&slot->mutex);
+    if (ret < n) {
+      break;
+    }
+  }
 
-        pkt_buf = slot->packet;
-        pkt_len = sizeof(slot->packet);
+  return sent;
+}
 
-        slot->first = 0;
-        slot->last = 0;
+/*
+ * Marks the packets written so far as complete and publishes them unless a
+ * batch is being queued.
+ */
+static void _media_commit_packets(ftl_media_component_common_t *mc) {
+  mc->commit_seq_num = mc->seq_num;
+  mc->commit_bytes = mc->write_bytes;
 
-        payload_size = _media_make_video_rtp_packet(ftl, data, remaining, pkt_buf, &pkt_len, first_fu);
+  if (!mc->batching) {
+    _media_publish_packets(mc);
+  }
+}
 
-        first_fu = 0;
-        remaining -= payload_size;
-        data += payload_size;
-        bytes_queued += pkt_len;
-        mc->stats.payload_bytes_sent += payload_size;
+/*
+ * Makes every committed packet visible to the send thread and wakes it if it
+ * is blocked waiting for data.
+ */
+static void _media_publish_packets(ftl_media_component_common_t *mc) {
+  if (mc->commit_seq_num == (uint16_t)os_atomic_load(&mc->ready_seq_num)) {
+    return;
+  }
 
-        /*if all data has been consumed set marker bit*/
-        if (remaining <= 0 && end_of_frame) {
-          _media_set_marker_bit(mc, pkt_buf);
-          slot->last = 1;
-        }
+  os_atomic_store(&mc->ready_bytes, (int32_t)mc->commit_bytes);
+  os_atomic_store(&mc->ready_seq_num, mc->commit_seq_num);
 
-        slot->len = pkt_len;
-        slot->sn = sn;
-        gettimeofday(&slot->insert_time, NULL);
-        slot->isPartOfIframe = nalu_type == H264_NALU_TYPE_IDR;
+  // Pairs with the fence in _media_wait_for_packets, either the send thread
+  // sees the new head or we see it waiting.
+  os_atomic_fence();
 
-        os_unlock_mutex(&slot->mutex);
-        os_semaphore_post(&mc->pkt_ready);
+  if (os_atomic_load(&mc->consumer_waiting) && os_atomic_exchange(&mc->consumer_waiting, 0)) {
+    os_semaphore_post(&mc->pkt_ready);
+  }
+}
 
-        mc->stats.packets_queued++;
-        mc->stats.bytes_queued += pkt_len;
-      }
+/*
+ * Blocks the send thread until packets are published. Returns the number of
+ * packets ready to send or 0 if the thread is shutting down.
+ */
+static int _media_wait_for_packets(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc) {
+  uint16_t tail = (uint16_t)os_atomic_load(&mc->xmit_seq_num);
+  uint16_t ready;
 
-      mc->stats.current_frame_size += len;
+  while ((ready = (uint16_t)os_atomic_load(&mc->ready_seq_num) - tail) == 0) {
 
-      if (end_of_frame) {
-        mc->stats.frames_received++;
+    if (!ftl_get_state(ftl, FTL_TX_THRD)) {
+      return 0;
+    }
 
-        if (mc->stats.current_frame_size > mc->stats.max_frame_size) {
-          mc->stats.max_frame_size = mc->stats.current_frame_size;
-        }
+    os_atomic_store(&mc->consumer_waiting, 1);
+    os_atomic_fence();
 
-        mc->stats.current_frame_size = 0;
+    // Check again now the producer is guaranteed to see the flag. A post can
+    // be left over from an earlier wake up, that only costs an extra loop.
+    if ((uint16_t)os_atomic_load(&mc->ready_seq_num) == tail) {
+      if (os_atomic_load(&mc->buffer_ref_tail) != os_atomic_load(&mc->buffer_ref_head)) {
+        os_semaphore_pend(&mc->pkt_ready, BUFFER_RETIRE_INTERVAL_MS);
+        _media_retire_buffers(ftl, mc, FALSE);
+      }
+      else {
+        os_semaphore_pend(&mc->pkt_ready, FOREVER);
       }
     }
 
-    os_unlock_mutex(&ftl->video.mutex);
+    os_atomic_store(&mc->consumer_waiting, 0);
   }
 
-  return bytes_queued;
+  return ftl_get_state(ftl, FTL_TX_THRD) ? ready : 0;
 }
 
-static ftl_media_component_common_t *_media_lookup(ftl_stream_configuration_private_t *ftl, uint32_t ssrc) {
-  ftl_media_component_common_t *mc = NULL;
-
-  /*check audio*/
-  mc = &ftl->audio.media_component;
-  if (mc->ssrc == ssrc) {
-    return mc;
+/*
+ * Hands up to max_bytes of queued packets to the socket, all of them when it
+ * is negative. With txtime_pacer each packet carries the time the pacer's
+ * credit covers it.
+ */
+static int _media_send_packet_batch(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, int max_bytes, media_pacer_t *txtime_pacer) {
+  nack_ring_t *ring;
+  int slots[MAX_SEND_BATCH_PKTS];
+  socket_packet_t pkts[MAX_SEND_BATCH_PKTS];
+  uint16_t tail = (uint16_t)os_atomic_load(&mc->xmit_seq_num);
+  uint16_t ready = (uint16_t)os_atomic_load(&mc->ready_seq_num) - tail;
+  int count = 0, sent, i;
+  int bytes_taken = 0, bytes_sent = 0;
+  int64_t now_us;
+
+  if (ready == 0) {
+    return 0;
   }
 
-  /*check video*/
-  mc = &ftl->video.media_component;
-  if (mc->ssrc == ssrc) {
-    return mc;
+  // A resize publishes the new ring after copying the queued packets into it
+  // and before readying any more, so the ring loaded after ready_seq_num holds
+  // every ready packet. Pinned so its region isn't reused while the batch
+  // reads it, which only holds up the next resize, not the producer.
+  ring = _media_acquire_ring(mc);
+
+  // Slots between xmit_seq_num and ready_seq_num are owned by this thread,
+  // the producer won't reuse them until xmit_seq_num moves past them.
+  while (count < ready && count < MAX_SEND_BATCH_PKTS && (max_bytes < 0 || bytes_taken < max_bytes)) {
+    int slot = (uint16_t)(tail + count) % ring->size;
+
+    slots[count] = slot;
+    pkts[count].buf = _nack_slot_packet(ring, slot);
+    pkts[count].len = ring->len[slot];
+    pkts[count].ext = ring->ext_data[slot];
+    pkts[count].ext_len = ring->ext_len[slot];
+    pkts[count].txtime_ns = 0;
+    if (txtime_pacer != NULL && bytes_taken > txtime_pacer->credit) {
+      pkts[count].txtime_ns = txtime_pacer->last_ns + (int64_t)((bytes_taken - txtime_pacer->credit) / txtime_pacer->bytes_per_ns);
+    }
+    bytes_taken += ring->len[slot];
+    count++;
   }
 
-  return NULL;
-}
-
-static nack_slot_t* _media_get_empty_slot(ftl_stream_configuration_private_t *ftl, uint32_t ssrc, uint16_t sn) {
-  ftl_media_component_common_t *mc;
-
-  if ((mc = _media_lookup(ftl, ssrc)) == NULL) {
-    FTL_LOG(ftl, FTL_LOG_ERROR, "Unable to find ssrc %d\n", ssrc);
-    return NULL;
+  if (count == 0) {
+    _media_release_ring(mc, ring);
+    return 0;
   }
 
-  nack_slot_t *slot;
-  {
-    os_lock_mutex(&mc->nack_slots_lock);
+  if ((sent = _media_send_batch(ftl, mc, pkts, count)) < count) {
+    FTL_LOG(ftl, FTL_LOG_ERROR, "only sent %d of %d batched packets: %s", sent, count, get_socket_error());
+  }
 
-    // If the next sequence number is equal to the current send number
-    // the queue is full. Return null.
-    // Note we do the nextSn increment outside of the if to ensure the rollover
-    // for uint16 works correctly.
-    uint16_t nextSn = sn + (uint16_t)1;
-    if (((nextSn) % NACK_RB_SIZE) == (mc->xmit_seq_num % NACK_RB_SIZE)) {
-      slot = NULL;
-    }
-    else {
-      slot = mc->nack_slots[sn % NACK_RB_SIZE];
-      slot->sn = sn;
-    }
+  now_us = _media_now_us();
 
-    os_unlock_mutex(&mc->nack_slots_lock);
+  if (mc == &ftl->video.media_component && ftl->video.first_packet_ms < 0) {
+    ftl->video.first_packet_ms = (int)((now_us - ftl->video.start_us) / 1000);
+    FTL_LOG(ftl, FTL_LOG_INFO, "First video packet sent %d ms after the media connection came up\n", ftl->video.first_packet_ms);
   }
 
-  return slot;
-}
+  for (i = 0; i < count; i++) {
+    int tx_len = (i < sent) ? pkts[i].len : SOCKET_ERROR;
 
-static float _media_get_queue_fullness(ftl_stream_configuration_private_t *ftl, uint32_t ssrc) {
-  ftl_media_component_common_t *mc;
+    ring->xmit_us[slots[i]] = now_us;
+    _media_update_xmit_stats(mc, ring, slots[i], tx_len);
 
-  if ((mc = _media_lookup(ftl, ssrc)) == NULL) {
-    FTL_LOG(ftl, FTL_LOG_ERROR, "Unable to find ssrc %d\n", ssrc);
-    return -1;
+    if (tx_len > 0) {
+      bytes_sent += tx_len;
+    }
   }
 
-  int packets_queued;
+  _media_release_ring(mc, ring);
 
-  if (mc->seq_num >= mc->xmit_seq_num) {
-    packets_queued = mc->seq_num - mc->xmit_seq_num;
-  }
-  else {
-    packets_queued = 65535 - mc->xmit_seq_num + mc->seq_num + 1;
-  }
+  os_atomic_store(&mc->xmit_bytes, os_atomic_load(&mc->xmit_bytes) + bytes_taken);
+  os_atomic_store(&mc->xmit_seq_num, (uint16_t)(tail + count));
+
+  _media_retire_buffers(ftl, mc, FALSE);
 
-  return (float)packets_queued / (float)NACK_RB_SIZE;
+  return bytes_sent;
 }
 
-static int _media_send_slot(ftl_stream_configuration_private_t *ftl, nack_slot_t *slot) {
-  int tx_len;
+/*
+ * Copies len bytes at src out of the buffer of ref id, unless the buffer has
+ * been released. Used by retransmits, the pin keeps the send thread from
+ * releasing the buffer during the copy.
+ */
+static BOOL _media_copy_buffer_ref(ftl_media_component_common_t *mc, uint32_t id, const uint8_t *src, int len, uint8_t *out) {
+  media_buffer_ref_t *ref = &mc->buffer_refs[id % MAX_BUFFER_REFS];
+  BOOL valid;
 
-  uint8_t pkt[MAX_PACKET_BUFFER];
-  int pkt_len;
+  os_atomic_add(&ref->pins, 1);
+  os_atomic_fence();
 
-  os_lock_mutex(&ftl->media.mutex);
-  memcpy(pkt, slot->packet, slot->len);
-  pkt_len = slot->len;
-  os_unlock_mutex(&ftl->media.mutex);
+  valid = os_atomic_load(&ref->live) && ref->id == id && src >= ref->data && src + len <= ref->data + ref->len;
 
-  if ((tx_len = sendto(ftl->media.media_socket, pkt, pkt_len, 0, (struct sockaddr*) ftl->media.ingest_addr, (int)ftl->media.ingest_addrlen)) == SOCKET_ERROR)
-  {
-    FTL_LOG(ftl, FTL_LOG_ERROR, "sendto() failed with error: %s", get_socket_error());
+  if (valid) {
+    memcpy(out, src, len);
   }
-  
-  return tx_len;
-}
 
-static int _media_send_packet(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc) {
+  os_atomic_add(&ref->pins, -1);
 
-  int tx_len;
-
-  nack_slot_t *slot;
-
-  {
-    os_lock_mutex(&mc->nack_slots_lock);
+  return valid;
+}
 
-    slot = mc->nack_slots[mc->xmit_seq_num % NACK_RB_SIZE];
-    mc->xmit_seq_num++;
+/*
+ * Releases, oldest first, the buffers whose packets have all been sent and are
+ * past retention. force releases everything and is only used once the send
+ * and receive threads are gone. Called by the send thread.
+ */
+static void _media_retire_buffers(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, BOOL force) {
+  uint32_t tail = (uint32_t)os_atomic_load(&mc->buffer_ref_tail);
+  uint32_t head = (uint32_t)os_atomic_load(&mc->buffer_ref_head);
+  uint16_t xmit = (uint16_t)os_atomic_load(&mc->xmit_seq_num);
+  int64_t now_us = 0;
+  BOOL in_order = TRUE;
+  uint32_t id;
+
+  for (id = tail; id != head; id++) {
+    media_buffer_ref_t *ref = &mc->buffer_refs[id % MAX_BUFFER_REFS];
+    uint16_t end_sn = (uint16_t)os_atomic_load(&ref->end_sn);
+
+    if (!force && end_sn != ref->start_sn) {
+      if ((int16_t)(xmit - end_sn) < 0) {
+        break;
+      }
 
-    os_unlock_mutex(&mc->nack_slots_lock);
-  }
+      if (now_us == 0) {
+        now_us = _media_now_us();
+      }
 
-  os_lock_mutex(&slot->mutex);
+      // Stamp every sent buffer, not just the oldest, so their retention
+      // runs concurrently.
+      if (ref->sent_us == 0) {
+        ref->sent_us = now_us;
+      }
 
-  tx_len = _media_send_slot(ftl, slot);
+      if (now_us - ref->sent_us <= (int64_t)_media_retention_ms(ftl) * 1000) {
+        in_order = FALSE;
+      }
+    }
 
-  gettimeofday(&slot->xmit_time, NULL);
+    if (!in_order) {
+      continue;
+    }
 
-  if (slot->last) {
-    mc->stats.frames_sent++;
-  }
-  mc->stats.packets_sent++;
-  mc->stats.bytes_sent += tx_len;
+    os_atomic_store(&ref->live, 0);
+    os_atomic_fence();
 
-  struct timeval profile_delta;
-  float xmit_delay_delta;
-  timeval_subtract(&profile_delta, &slot->xmit_time, &slot->insert_time);
+    while (os_atomic_load(&ref->pins) != 0) {
+      sleep_ms(0);
+    }
 
-  xmit_delay_delta = timeval_to_ms(&profile_delta);
+    ref->release(ref->context, ref->data);
 
-  if (xmit_delay_delta > mc->stats.pkt_xmit_delay_max) {
-    mc->stats.pkt_xmit_delay_max = (int)xmit_delay_delta;
-  }
-  else if (xmit_delay_delta < mc->stats.pkt_xmit_delay_min) {
-    mc->stats.pkt_xmit_delay_min = (int)xmit_delay_delta;
+    os_atomic_store(&mc->buffer_ref_tail, id + 1);
   }
-
-  mc->stats.total_xmit_delay += (int)xmit_delay_delta;
-  mc->stats.xmit_delay_samples++;
-
-  os_unlock_mutex(&slot->mutex);
-
-  return tx_len;
 }
 
+/*
+ * Retransmits run on the receive thread without any lock. The slot is copied
+ * out and the copy is only used if the producer didn't touch the slot while
+ * we were reading it (the slot generation is unchanged and even) and the send
+ * thread has already sent the packet.
+ */
 static int _nack_resend_packet(ftl_stream_configuration_private_t *ftl, uint32_t ssrc, uint16_t sn) {
   ftl_media_component_common_t *mc;
+  nack_ring_t *ring;
+  int slot;
   int tx_len = 0;
+  uint8_t packet[MAX_PACKET_BUFFER];
+  int len, ext_len, slot_sn, is_iframe, ring_size;
+  const uint8_t *ext_data;
+  uint32_t ext_ref;
+  int64_t xmit_us;
+  uint16_t tail;
+  int32_t gen;
+  BOOL valid;
 
   if ((mc = _media_lookup(ftl, ssrc)) == NULL) {
     FTL_LOG(ftl, FTL_LOG_ERROR, "Unable to find ssrc %d\n", ssrc);
     return -1;
   }
 
+  // With retransmits off (the speed test) requests are only counted, the
+  // packets may not even be in the ring.
+  if (!mc->nack_enabled) {
+    mc->stats.nack_requests++;
+    return 0;
+  }
+
   /*map sequence number to slot*/
-  nack_slot_t *slot = mc->nack_slots[sn % NACK_RB_SIZE];
-  os_lock_mutex(&slot->mutex);
+  ring = _media_acquire_ring(mc);
+  ring_size = ring->size;
+  slot = sn % ring_size;
+
+  tail = (uint16_t)os_atomic_load(&mc->xmit_seq_num);
+  gen = os_atomic_load(&ring->gen[slot]);
+  slot_sn = ring->sn[slot];
+  xmit_us = ring->xmit_us[slot];
+
+  // Everything up to the payload copy is decided from the metadata arrays.
+  if ((gen & 1) || slot_sn != sn) {
+    _media_release_ring(mc, ring);
+    FTL_LOG(ftl, FTL_LOG_WARN, "[%d] expected sn %d in slot but found %d...discarding retransmit request", ssrc, sn, slot_sn);
+    return 0;
+  }
 
-  if (slot->sn != sn) {
-    FTL_LOG(ftl, FTL_LOG_WARN, "[%d] expected sn %d in slot but found %d...discarding retransmit request", ssrc, sn, slot->sn);
-    os_unlock_mutex(&slot->mutex);
+  // Only packets behind xmit_seq_num have been sent.
+  uint16_t age = tail - sn;
+  if (age == 0 || age > ring_size) {
+    _media_release_ring(mc, ring);
+    FTL_LOG(ftl, FTL_LOG_WARN, "[%d] sn %d has not been sent yet...discarding retransmit request", ssrc, sn);
     return 0;
   }
 
-  int req_delay = 0;
-  struct timeval delta, now;
-  gettimeofday(&now, NULL);
-  timeval_subtract(&delta, &now, &slot->xmit_time);
-  req_delay = (int)timeval_to_ms(&delta);
+  int req_delay = (int)((_media_now_us() - xmit_us) / 1000);
 
-  if (mc->nack_enabled) {
-    tx_len = _media_send_slot(ftl, slot);
-    FTL_LOG(ftl, FTL_LOG_INFO, "[%d] resent sn %d, request delay was %d ms, was part of iframe? %d", ssrc, sn, req_delay, slot->isPartOfIframe);
+  if (req_delay > _media_retention_ms(ftl)) {
+    _media_release_ring(mc, ring);
+    mc->stats.nack_requests++;
+    mc->stats.nack_expired++;
+    return 0;
   }
-  mc->stats.nack_requests++;
 
-  os_unlock_mutex(&slot->mutex);
+  len = ring->len[slot];
+  ext_len = ring->ext_len[slot];
+  ext_data = ring->ext_data[slot];
+  ext_ref = ring->ext_ref[slot];
+  is_iframe = (ring->flags[slot] & NACK_SLOT_IFRAME) != 0;
+  valid = len > 0 && len <= (int)sizeof(packet) && ext_len >= 0 && ext_len <= len && len - ext_len <= ring->stride;
+
+  if (valid) {
+    memcpy(packet, _nack_slot_packet(ring, slot), len - ext_len);
+
+    if (ext_len > 0) {
+      valid = _media_copy_buffer_ref(mc, ext_ref, ext_data, ext_len, packet + len - ext_len);
+    }
+  }
+
+  os_atomic_fence();
+
+  valid = valid && gen == os_atomic_load(&ring->gen[slot]);
+
+  _media_release_ring(mc, ring);
+
+  if (!valid) {
+    FTL_LOG(ftl, FTL_LOG_WARN, "[%d] sn %d was overwritten while being read...discarding retransmit request", ssrc, sn);
+    return 0;
+  }
+
+  tx_len = _media_send_buffer(ftl, packet, len);
+  FTL_LOG(ftl, FTL_LOG_INFO, "[%d] resent sn %d, request delay was %d ms, was part of iframe? %d", ssrc, sn, req_delay, is_iframe);
+  mc->stats.nack_requests++;
 
   return tx_len;
 }
@@ -959,7 +2788,62 @@ static int _write_rtp_header(uint8_t *buf, size_t len, uint8_t ptype, uint16_t s
   return (int)((uint8_t*)out_header - buf);
 }
 
-static int _media_make_video_rtp_packet(ftl_stream_configuration_private_t *ftl, uint8_t *in, int in_len, uint8_t *out, int *out_len, int first_pkt) {
+static void _media_cursor_init(media_cursor_t *in, const ftl_media_buffer_t *buffers, int count) {
+  in->buffers = buffers;
+  in->count = count;
+  in->idx = 0;
+  in->offset = 0;
+  in->by_reference = FALSE;
+  in->ref = 0;
+  in->ext = NULL;
+  in->ext_len = 0;
+}
+
+// Next byte without consuming it, 0 past the end.
+static uint8_t _media_cursor_peek(media_cursor_t *in) {
+  while (in->idx < in->count && in->offset >= in->buffers[in->idx].len) {
+    in->idx++;
+    in->offset = 0;
+  }
+
+  return (in->idx < in->count) ? in->buffers[in->idx].data[in->offset] : 0;
+}
+
+static void _media_cursor_copy(media_cursor_t *in, uint8_t *out, int len) {
+  while (len > 0 && in->idx < in->count) {
+    const ftl_media_buffer_t *buf = &in->buffers[in->idx];
+    int n = buf->len - in->offset;
+
+    if (n > len) {
+      n = len;
+    }
+
+    memcpy(out, buf->data + in->offset, n);
+    out += n;
+    len -= n;
+    in->offset += n;
+
+    if (in->offset >= buf->len) {
+      in->idx++;
+      in->offset = 0;
+    }
+  }
+}
+
+// Payload of a packet, copied to out or left in place when by_reference.
+static void _media_cursor_take(media_cursor_t *in, uint8_t *out, int len) {
+  if (!in->by_reference) {
+    _media_cursor_copy(in, out, len);
+    return;
+  }
+
+  _media_cursor_peek(in);
+  in->ext = in->buffers[in->idx].data + in->offset;
+  in->ext_len = len;
+  in->offset += len;
+}
+
+static int _media_make_video_rtp_packet(ftl_stream_configuration_private_t *ftl, media_cursor_t *in, int in_len, uint8_t *out, int *out_len, int first_pkt) {
   uint8_t sbit = 0, ebit = 0;
   int frag_len;
   ftl_video_component_t *video = &ftl->video;
@@ -978,14 +2862,13 @@ static int _media_make_video_rtp_packet(ftl_stream_configuration_private_t *ftl,
   if (first_pkt && in_len <= (ftl->media.max_mtu - RTP_HEADER_BASE_LEN)) {
     frag_len = in_len;
     *out_len = frag_len + rtp_hdr_len;
-    memcpy(out, in, frag_len);
+    _media_cursor_take(in, out, frag_len);
   }
   else {//otherwise packetize using FU-A
 
     if (first_pkt) {
       sbit = 1;
-      video->fua_nalu_type = in[0];
-      in += 1;
+      _media_cursor_copy(in, &video->fua_nalu_type, 1);
       in_len--;
     }
     else if (in_len <= (ftl->media.max_mtu - RTP_HEADER_BASE_LEN - RTP_FUA_HEADER_LEN)) {
@@ -1003,7 +2886,7 @@ static int _media_make_video_rtp_packet(ftl_stream_configuration_private_t *ftl,
       frag_len = in_len;
     }
 
-    memcpy(out, in, frag_len);
+    _media_cursor_take(in, out, frag_len);
 
     *out_len = frag_len + RTP_HEADER_BASE_LEN + RTP_FUA_HEADER_LEN;
   }
@@ -1011,7 +2894,7 @@ static int _media_make_video_rtp_packet(ftl_stream_configuration_private_t *ftl,
   return frag_len + sbit;
 }
 
-static int _media_make_audio_rtp_packet(ftl_stream_configuration_private_t *ftl, uint8_t *in, int in_len, uint8_t *out, int *out_len) {
+static int _media_make_audio_rtp_packet(ftl_stream_configuration_private_t *ftl, media_cursor_t *in, int in_len, uint8_t *out, int *out_len) {
   ftl_audio_component_t *audio = &ftl->audio;
   ftl_media_component_common_t *mc = &audio->media_component;
 
@@ -1032,7 +2915,7 @@ static int _media_make_audio_rtp_packet(ftl_stream_configuration_private_t *ftl,
   }
 
   *out_len = payload_len + rtp_hdr_len;
-  memcpy(out, in, payload_len);
+  _media_cursor_copy(in, out, payload_len);
 
   return payload_len;
 }
@@ -1075,10 +2958,7 @@ OS_THREAD_ROUTINE recv_thread(void *data)
   }
 #endif
 
-  if ((buf = (unsigned char*)malloc(MAX_PACKET_BUFFER)) == NULL) {
-    FTL_LOG(ftl, FTL_LOG_ERROR, "Failed to allocate recv buffer\n");
-    return (OS_THREAD_TYPE)-1;
-  }
+  buf = media->recv_buf;
 
   while (ftl_get_state(ftl, FTL_RX_THRD)) {
 
@@ -1162,6 +3042,10 @@ OS_THREAD_ROUTINE recv_thread(void *data)
         }
       }
     }
+    else if (ptype == RTCP_PSFB_PTYPE && (feedbackType == RTCP_PSFB_PLI || feedbackType == RTCP_PSFB_FIR)) {
+      FTL_LOG(ftl, FTL_LOG_INFO, "Ingest asked for a key frame (%s)\n", feedbackType == RTCP_PSFB_PLI ? "PLI" : "FIR");
+      _media_request_keyframe(ftl, FTL_KEYFRAME_PICTURE_LOSS);
+    }
     else if (feedbackType == 1 && ptype == PING_PTYPE) {
 
       ping_pkt_t *ping = (ping_pkt_t *)buf;
@@ -1184,11 +3068,17 @@ OS_THREAD_ROUTINE recv_thread(void *data)
       pkt_stats->rtt_samples++;
 
       ftl->media.last_rtt_delay = delay_ms;
+
+      // Smoothed rtt as in RFC 6298, used to expire the retransmit history.
+      if (ftl->media.srtt_ms < 0) {
+        ftl->media.srtt_ms = delay_ms;
+      }
+      else {
+        ftl->media.srtt_ms = (7 * ftl->media.srtt_ms + delay_ms) / 8;
+      }
     }
   }
 
-  free(buf);
-
   FTL_LOG(ftl, FTL_LOG_INFO, "Exited Recv Thread\n");
 
   return (OS_THREAD_TYPE)0;
@@ -1201,14 +3091,13 @@ OS_THREAD_ROUTINE video_send_thread(void *data)
   ftl_media_component_common_t *video = &ftl->video.media_component;
 
   int first_packet = 1;
-  int bytes_per_ms;
   int pkt_sent;
   int video_kbps = -1;
   int disable_flow_control = 1;
   int initial_peak_kbps;
 
-  int transmit_level;
-  struct timeval start_tv;
+  media_pacer_t pacer;
+  OS_TIMER timer;
 
 #ifdef _WIN32
   if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
@@ -1216,9 +3105,13 @@ OS_THREAD_ROUTINE video_send_thread(void *data)
   }
 #endif
 
+  if (os_create_timer(&timer) != 0) {
+    FTL_LOG(ftl, FTL_LOG_INFO, "No high resolution timer, pacing with millisecond sleeps\n");
+  }
+
   initial_peak_kbps = video->kbps = video->peak_kbps;
   video_kbps = 0;
-  transmit_level = 5 * video->kbps * 1000 / 8 / 1000; /*small initial level to prevent bursting at the start of a stream*/
+  memset(&pacer, 0, sizeof(pacer));
 
   while (1) {
 
@@ -1227,7 +3120,7 @@ OS_THREAD_ROUTINE video_send_thread(void *data)
     }
 
     if (video->kbps != video_kbps) {
-      bytes_per_ms = video->kbps * 1000 / 8 / 1000;
+      _media_pacer_set_rate(ftl, &pacer, video->kbps);
       video_kbps = video->kbps;
 
       disable_flow_control = 0;
@@ -1236,42 +3129,67 @@ OS_THREAD_ROUTINE video_send_thread(void *data)
       }
     }
 
-    os_semaphore_pend(&video->pkt_ready, FOREVER);
-
-    if (!ftl_get_state(ftl, FTL_TX_THRD)) {
+    if (_media_wait_for_packets(ftl, video) == 0) {
       break;
     }
 
+    // Before sending as well, to see a frame that was just queued at its peak.
+    _media_check_queue_level(ftl);
+
     if (disable_flow_control) {
-      _media_send_packet(ftl, video);
+      _media_send_packet_batch(ftl, video, -1, NULL);
     }
     else {
       pkt_sent = 0;
       if (first_packet) {
-        gettimeofday(&start_tv, NULL);
+        pacer.last_ns = os_monotonic_ns();
+        pacer.credit = pacer.bytes_per_ns * PACER_START_BURST_MS * 1000000;
         first_packet = 0;
       }
 
-      _update_xmit_level(ftl, &transmit_level, &start_tv, bytes_per_ms);
+      _media_pacer_refill(&pacer);
+
+      // The kernel spaces the packets out. Up to the burst size is queued in
+      // it ahead of the pacer, the thread wakes when half of that has left.
+      if (ftl->media.pacing != FTL_PACING_USER) {
+        int room;
+
+        if (pacer.credit < -pacer.depth / 2) {
+          ftl->video.media_component.stats.bw_throttling_count++;
+          os_sleep_until_ns(&timer, pacer.last_ns + (int64_t)((-pacer.depth / 2 - pacer.credit) / pacer.bytes_per_ns) + 1);
+          _media_pacer_refill(&pacer);
+        }
+
+        room = (int)(pacer.credit + pacer.depth);
+        pacer.credit -= _media_send_packet_batch(ftl, video, (room > 0) ? room : 1, (ftl->media.pacing == FTL_PACING_TXTIME) ? &pacer : NULL);
+        pkt_sent = 1;
+      }
+
       while (!pkt_sent && ftl_get_state(ftl, FTL_TX_THRD)) {
 
-        if (transmit_level <= 0) {
+        // Wake when a byte of credit is back, the batch then takes a single
+        // packet and the next wait spaces it from the one after.
+        if (pacer.credit < 1) {
           ftl->video.media_component.stats.bw_throttling_count++;
-          sleep_ms(MAX_MTU / bytes_per_ms + 1);
-          _update_xmit_level(ftl, &transmit_level, &start_tv, bytes_per_ms);
+          os_sleep_until_ns(&timer, pacer.last_ns + (int64_t)((1 - pacer.credit) / pacer.bytes_per_ns) + 1);
+          _media_pacer_refill(&pacer);
         }
 
-        if (transmit_level > 0) {
-          transmit_level -= _media_send_packet(ftl, video);
+        if (pacer.credit >= 1) {
+          pacer.credit -= _media_send_packet_batch(ftl, video, (int)pacer.credit, NULL);
           pkt_sent = 1;
         }
       }
 
     }
 
+    _media_check_queue_level(ftl);
+
     _update_stats(ftl);
   }
 
+  os_delete_timer(&timer);
+
   FTL_LOG(ftl, FTL_LOG_INFO, "Exited Send Thread\n");
   return (OS_THREAD_TYPE)0;
 }
@@ -1289,32 +3207,68 @@ OS_THREAD_ROUTINE audio_send_thread(void *data)
 
     while (1) {
 
-        os_semaphore_pend(&audio->pkt_ready, FOREVER);
-
-        if (!ftl_get_state(ftl, FTL_TX_THRD)) {
+        if (_media_wait_for_packets(ftl, audio) == 0) {
             break;
         }
 
-        _media_send_packet(ftl, audio);
+        _media_send_packet_batch(ftl, audio, -1, NULL);
     }
 
     FTL_LOG(ftl, FTL_LOG_INFO, "Exited Audio Send Thread\n");
     return (OS_THREAD_TYPE)0;
 }
 
-static void _update_xmit_level(ftl_stream_configuration_private_t *ftl, int *transmit_level, struct timeval *start_tv, int bytes_per_ms) {
+/*
+ * Sets up the kernel pacing backend asked for, or falls back to pacing in
+ * the send thread when the socket doesn't take it.
+ */
+static void _media_init_pacing(ftl_stream_configuration_private_t *ftl) {
+  ftl_media_config_t *media = &ftl->media;
+  int ret = 0;
+
+  media->pacing = ftl->video.pacing;
+
+  if (media->pacing == FTL_PACING_RATE) {
+    ret = set_socket_max_pacing_rate(media->media_socket, 0);
+  }
+  else if (media->pacing == FTL_PACING_TXTIME) {
+    ret = set_socket_txtime(media->media_socket);
+  }
+
+  if (ret == SOCKET_ERROR) {
+    FTL_LOG(ftl, FTL_LOG_WARN, "Kernel pacing is not available (%s), pacing in user space\n", get_socket_error());
+    media->pacing = FTL_PACING_USER;
+  }
+
+  // fq would let a GSO super-buffer out as one burst.
+  if (media->pacing != FTL_PACING_USER) {
+    media->gso_enabled = FALSE;
+    FTL_LOG(ftl, FTL_LOG_INFO, "Pacing video with %s\n", (media->pacing == FTL_PACING_RATE) ? "SO_MAX_PACING_RATE" : "SO_TXTIME");
+  }
+}
+
+static void _media_pacer_set_rate(ftl_stream_configuration_private_t *ftl, media_pacer_t *pacer, int kbps) {
+  // kbps * 1000 / 8 bytes a second
+  pacer->bytes_per_ns = (double)kbps * ftl->video.pacer_rate_percent / 100 * 125 / 1000000000;
+  pacer->depth = pacer->bytes_per_ns * ftl->video.pacer_burst_ms * 1000000;
+  ftl->video.paced_kbps = (kbps > 0) ? (int)(pacer->bytes_per_ns * 8000000 + 0.5) : 0;
 
-  struct timeval stop_tv;
+  // Audio and retransmits share the socket and its cap.
+  if (ftl->media.pacing == FTL_PACING_RATE) {
+    set_socket_max_pacing_rate(ftl->media.media_socket, (kbps > 0) ? (int64_t)(pacer->bytes_per_ns * 1000000000) + KERNEL_PACING_HEADROOM_KBPS * 125 : 0);
+  }
+}
 
-  gettimeofday(&stop_tv, NULL);
+static void _media_pacer_refill(media_pacer_t *pacer) {
+  int64_t now_ns = os_monotonic_ns();
 
-  *transmit_level += (int)timeval_subtract_to_ms(&stop_tv, start_tv) * bytes_per_ms;
+  pacer->credit += (double)(now_ns - pacer->last_ns) * pacer->bytes_per_ns;
 
-  if (*transmit_level > (MAX_XMIT_LEVEL_IN_MS * bytes_per_ms)) {
-    *transmit_level = MAX_XMIT_LEVEL_IN_MS * bytes_per_ms;
+  if (pacer->credit > pacer->depth) {
+    pacer->credit = pacer->depth;
   }
 
-  *start_tv = stop_tv;
+  pacer->last_ns = now_ns;
 }
 
 static int _update_stats(ftl_stream_configuration_private_t *ftl) {
@@ -1344,6 +3298,7 @@ static int _send_pkt_stats(ftl_stream_configuration_private_t *ftl, ftl_media_co
   p->period = timeval_subtract_to_ms(&now, &mc->stats.start_time);
   p->sent = mc->stats.packets_sent;
   p->nack_reqs = mc->stats.nack_requests;
+  p->expired = mc->stats.nack_expired;
   p->lost = 0; // needs rtcp reports to get this value
   p->recovered = 0; // need rtcp reports to get this value
   p->late = 0; // need rtcp reports to get this value
@@ -1399,8 +3354,12 @@ static int _send_video_stats(ftl_stream_configuration_private_t *ftl, ftl_media_
   v->bytes_sent = mc->stats.bytes_sent;
   v->queue_fullness = (int)(_media_get_queue_fullness(ftl, mc->ssrc) * 100.f);
   v->max_frame_size = mc->stats.max_frame_size;
+  v->keyframe_requests = mc->stats.keyframe_requests;
+  v->max_recovery_ms = mc->stats.max_recovery_ms;
+  v->first_packet_ms = ftl->video.first_packet_ms;
 
   mc->stats.max_frame_size = 0;
+  mc->stats.max_recovery_ms = 0;
   enqueue_status_msg(ftl, &m);
 
   return 0;
@@ -1412,16 +3371,10 @@ OS_THREAD_ROUTINE ping_thread(void *data) {
   ftl_media_config_t *media = &ftl->media;
   struct timeval lastSenderReportSendTime_tv;
 
-  senderReport_pkt_t *senderReport;
-  nack_slot_t senderReportSlot;
-  ping_pkt_t *ping;
-  nack_slot_t pingSlot;
-
-  ping = (ping_pkt_t*)pingSlot.packet;
-  senderReport = (senderReport_pkt_t*)senderReportSlot.packet;
-
-  pingSlot.len = sizeof(ping_pkt_t);
-  senderReportSlot.len = sizeof(senderReport_pkt_t);
+  senderReport_pkt_t senderReportPkt;
+  senderReport_pkt_t *senderReport = &senderReportPkt;
+  ping_pkt_t pingPkt;
+  ping_pkt_t *ping = &pingPkt;
 
   //   RTPC Header Format
   //      0                   1                   2                   3
@@ -1453,7 +3406,7 @@ OS_THREAD_ROUTINE ping_thread(void *data) {
     {
         ping->xmit_time.tv_sec = currentTime.tv_sec;
         ping->xmit_time.tv_usec = currentTime.tv_usec;
-        _media_send_slot(ftl, &pingSlot);
+        _media_send_buffer(ftl, (uint8_t *)ping, sizeof(ping_pkt_t));
     }
 
     if (!ftl_get_state(ftl, FTL_DISABLE_TX_SENDER_REPORT))
@@ -1501,7 +3454,7 @@ OS_THREAD_ROUTINE ping_thread(void *data) {
                 senderReport->ntpTimestampLow = htonl((uint32_t)(ntpTimestamp));
 
                 // Send the report
-                _media_send_slot(ftl, &senderReportSlot);
+                _media_send_buffer(ftl, (uint8_t *)senderReport, sizeof(senderReport_pkt_t));
             }
         }
     }
@@ -1539,6 +3492,18 @@ FTL_API ftl_status_t ftl_get_video_stats(
   return FTL_SUCCESS;
 }
 
+FTL_API ftl_status_t ftl_get_nal_filter_stats(ftl_handle_t *handle, ftl_nal_filter_stats_t *stats) {
+  ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)handle->priv;
+
+  if (ftl == NULL) {
+    return FTL_NOT_INITIALIZED;
+  }
+
+  *stats = ftl->video.nal_filter_stats;
+
+  return FTL_SUCCESS;
+}
+
 BOOL is_bitrate_reduction_required(
   const float nacks_to_frames_ratio,
   const float avg_rtt,
@@ -1612,16 +3577,10 @@ FTL_API ftl_status_t ftl_adaptive_bitrate_thread(ftl_handle_t* ftl_handle, void*
 {
   ftl_status_t ret_status = FTL_SUCCESS;
   ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
-  ftl_adaptive_bitrate_thread_params_t* thread_params = NULL;
+  ftl_adaptive_bitrate_thread_params_t* thread_params = &ftl->bitrate_thread_params;
 
   do
   {
-    if ((thread_params = (ftl_adaptive_bitrate_thread_params_t*)malloc(sizeof(ftl_adaptive_bitrate_thread_params_t))) == NULL)
-    {
-      ret_status = FTL_MALLOC_FAILURE;
-      break;
-    }
-
     memset(thread_params, 0, sizeof(ftl_adaptive_bitrate_thread_params_t));
 
     thread_params->handle = ftl_handle;
@@ -1647,10 +3606,6 @@ FTL_API ftl_status_t ftl_adaptive_bitrate_thread(ftl_handle_t* ftl_handle, void*
     ftl_set_state(ftl, FTL_BITRATE_THRD);
   } while (0);
 
-  if (ret_status != FTL_SUCCESS)
-  {
-    free(thread_params);
-  }
   return ret_status;
 }
 
@@ -1982,6 +3937,5 @@ OS_THREAD_ROUTINE adaptive_bitrate_thread(void* data)
     }
   }
   FTL_LOG(params->handle->priv, FTL_LOG_INFO, "Shutting down bitrate thread");
-  free(params);
   return 0;
 }
@@ -22,6 +22,10 @@
 * SOFTWARE.
 **/
 
+#ifdef __linux__
+#define _GNU_SOURCE // for sendmmsg()
+#endif
+
 #include "ftl.h"
 #include "ftl_private.h"
 
@@ -31,6 +35,41 @@
 #include <sys/ioctl.h>
 #include <errno.h>
 #include <poll.h>
+#include <limits.h>
+#include <time.h>
+#ifdef __linux__
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+
+// struct sock_txtime from linux/net_tstamp.h, which older headers lack.
+typedef struct {
+  clockid_t clockid;
+  uint32_t flags;
+} _socket_txtime_t;
+
+static void _socket_packet_txtime(struct msghdr *msg, char *control, int64_t txtime_ns)
+{
+  struct cmsghdr *cmsg;
+
+  msg->msg_control = control;
+  msg->msg_controllen = CMSG_SPACE(sizeof(uint64_t));
+
+  cmsg = CMSG_FIRSTHDR(msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_TXTIME;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+  *((uint64_t *)CMSG_DATA(cmsg)) = (uint64_t)txtime_ns;
+}
+#endif
 
 void init_sockets() {
   //BSD sockets are smarter and don't need silly init
@@ -120,3 +159,176 @@ int poll_socket_for_receive(SOCKET socket, int timeoutMs)
     return SOCKET_ERROR;
   }
 }
+
+// Fills in one or two iovecs for a packet and returns how many were used.
+static int _socket_packet_iov(const socket_packet_t *pkt, struct iovec *iov)
+{
+  iov[0].iov_base = pkt->buf;
+  iov[0].iov_len = pkt->len - pkt->ext_len;
+
+  if (pkt->ext_len == 0) {
+    return 1;
+  }
+
+  iov[1].iov_base = (void *)pkt->ext;
+  iov[1].iov_len = pkt->ext_len;
+  return 2;
+}
+
+int send_socket_batch(SOCKET sock, socket_packet_t *pkts, int count, const struct sockaddr *addr, int addrlen)
+{
+  // Returns the number of packets handed to the kernel, or SOCKET_ERROR if
+  // not even the first packet could be sent.
+  int sent = 0;
+
+#ifdef __linux__
+  struct mmsghdr msgs[MAX_SEND_BATCH_PKTS];
+  struct iovec iovs[2 * MAX_SEND_BATCH_PKTS];
+  char controls[MAX_SEND_BATCH_PKTS][CMSG_SPACE(sizeof(uint64_t))];
+
+  while (sent < count) {
+    int i, n = count - sent;
+    int ret;
+
+    if (n > MAX_SEND_BATCH_PKTS) {
+      n = MAX_SEND_BATCH_PKTS;
+    }
+
+    memset(msgs, 0, sizeof(msgs[0]) * n);
+
+    for (i = 0; i < n; i++) {
+      msgs[i].msg_hdr.msg_name = (void *)addr;
+      msgs[i].msg_hdr.msg_namelen = addrlen;
+      msgs[i].msg_hdr.msg_iov = &iovs[2 * i];
+      msgs[i].msg_hdr.msg_iovlen = _socket_packet_iov(&pkts[sent + i], &iovs[2 * i]);
+
+      if (pkts[sent + i].txtime_ns > 0) {
+        memset(controls[i], 0, sizeof(controls[i]));
+        _socket_packet_txtime(&msgs[i].msg_hdr, controls[i], pkts[sent + i].txtime_ns);
+      }
+    }
+
+    if ((ret = sendmmsg(sock, msgs, n, 0)) <= 0) {
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    sent += ret;
+  }
+#else
+  struct iovec iovs[2];
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = (void *)addr;
+  msg.msg_namelen = addrlen;
+  msg.msg_iov = iovs;
+
+  while (sent < count) {
+    msg.msg_iovlen = _socket_packet_iov(&pkts[sent], iovs);
+    if (sendmsg(sock, &msg, 0) == SOCKET_ERROR) {
+      break;
+    }
+    sent++;
+  }
+#endif
+
+  return (sent == 0 && count > 0) ? SOCKET_ERROR : sent;
+}
+
+int get_socket_gso_supported(SOCKET sock)
+{
+#ifdef __linux__
+  // A zero segment size leaves normal sends untouched; we only care whether
+  // the kernel knows about the option (4.18+).
+  int gso_size = 0;
+  return setsockopt(sock, IPPROTO_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) == 0;
+#else
+  return 0;
+#endif
+}
+
+int send_socket_gso(SOCKET sock, socket_packet_t *pkts, int count, int segment_size, const struct sockaddr *addr, int addrlen)
+{
+  // Sends count packets as one UDP_SEGMENT super-buffer which the kernel splits
+  // back into datagrams of segment_size bytes. Every packet but the last must be
+  // exactly segment_size bytes long. Returns count or SOCKET_ERROR.
+#ifdef __linux__
+  struct iovec iovs[2 * MAX_SEND_BATCH_PKTS];
+  char control[CMSG_SPACE(sizeof(uint16_t))];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  int i, ret, iov_count = 0;
+
+  if (count > MAX_SEND_BATCH_PKTS) {
+    errno = EINVAL;
+    return SOCKET_ERROR;
+  }
+
+  for (i = 0; i < count; i++) {
+    iov_count += _socket_packet_iov(&pkts[i], &iovs[iov_count]);
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_name = (void *)addr;
+  msg.msg_namelen = addrlen;
+  msg.msg_iov = iovs;
+  msg.msg_iovlen = iov_count;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = IPPROTO_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  *((uint16_t *)CMSG_DATA(cmsg)) = (uint16_t)segment_size;
+
+  do {
+    ret = sendmsg(sock, &msg, 0);
+  } while (ret < 0 && errno == EINTR);
+
+  return (ret < 0) ? SOCKET_ERROR : count;
+#else
+  errno = EOPNOTSUPP;
+  return SOCKET_ERROR;
+#endif
+}
+
+int get_socket_gso_unsupported_error()
+{
+  // What send_socket_gso() fails with when the socket or the route's device
+  // can't segment, as opposed to a transient ENOBUFS or EAGAIN.
+  return errno == EIO || errno == EINVAL || errno == EOPNOTSUPP;
+}
+
+int set_socket_max_pacing_rate(SOCKET sock, int64_t bytes_per_sec)
+{
+  // Caps how fast the fq qdisc lets the socket's packets out, 0 removes the
+  // cap. Other qdiscs ignore it for UDP.
+#ifdef __linux__
+  unsigned int rate = (bytes_per_sec <= 0 || bytes_per_sec >= UINT_MAX) ? UINT_MAX : (unsigned int)bytes_per_sec;
+  return setsockopt(sock, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate));
+#else
+  errno = EOPNOTSUPP;
+  return SOCKET_ERROR;
+#endif
+}
+
+int set_socket_txtime(SOCKET sock)
+{
+  // Lets packets carry a departure time, which fq holds them until. Times
+  // are CLOCK_MONOTONIC like os_monotonic_ns().
+#ifdef __linux__
+  _socket_txtime_t config;
+
+  config.clockid = CLOCK_MONOTONIC;
+  config.flags = 0;
+  return setsockopt(sock, SOL_SOCKET, SO_TXTIME, &config, sizeof(config));
+#else
+  errno = EOPNOTSUPP;
+  return SOCKET_ERROR;
+#endif
+}
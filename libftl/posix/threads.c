@@ -23,6 +23,16 @@
 **/
 
 #include "threads.h"
+#include <sys/mman.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
 pthread_mutexattr_t ftl_default_mutexattr;
 
@@ -95,7 +105,11 @@ int os_semaphore_pend(OS_SEMAPHORE *sem, int ms_timeout) {
       sem->value--;
       break;
     } else {
-      if (ms_timeout < 0) {
+      if (ms_timeout == 0) {
+        // Polling, don't bother going through the timed wait.
+        retval = -4;
+        break;
+      } else if (ms_timeout < 0) {
         if (pthread_cond_wait(&sem->cond, &sem->mutex)) {
           retval = -2;
           break;
@@ -145,4 +159,260 @@ void sleep_ms(int ms)
     usleep(ms * 1000);
 }
 
+int64_t os_monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// clock_nanosleep() needs no timer object.
+int os_create_timer(OS_TIMER *timer) {
+  *timer = 0;
+  return 0;
+}
+
+void os_delete_timer(OS_TIMER *timer) {
+  (void)timer;
+}
+
+/*
+ * Sleeps until os_monotonic_ns() reaches deadline_ns. An absolute deadline
+ * doesn't drift by the time spent getting here.
+ */
+void os_sleep_until_ns(OS_TIMER *timer, int64_t deadline_ns) {
+  struct timespec ts;
+
+  (void)timer;
+
+#ifdef __APPLE__
+  int64_t wait_ns = deadline_ns - os_monotonic_ns();
+
+  if (wait_ns <= 0) {
+    return;
+  }
+
+  ts.tv_sec = (time_t)(wait_ns / 1000000000);
+  ts.tv_nsec = (long)(wait_ns % 1000000000);
+  nanosleep(&ts, NULL);
+#else
+  ts.tv_sec = (time_t)(deadline_ns / 1000000000);
+  ts.tv_nsec = (long)(deadline_ns % 1000000000);
 
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+  }
+#endif
+}
+
+static size_t _os_round_up(size_t size, size_t align) {
+  return (size + align - 1) & ~(align - 1);
+}
+
+/*
+ * Maps size bytes of zeroed memory. Huge pages, locking and prefaulting are
+ * best effort, mem->flags says which of them took effect.
+ */
+int os_map_memory(OS_MEMORY *mem, size_t size, int flags) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  void *base = MAP_FAILED;
+  size_t i;
+
+  mem->base = NULL;
+  mem->size = 0;
+  mem->flags = 0;
+
+#ifdef MAP_HUGETLB
+  if (flags & OS_MEMORY_HUGE_PAGES) {
+    mem->size = _os_round_up(size, HUGE_PAGE_SIZE);
+    base = mmap(NULL, mem->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+    if (base != MAP_FAILED) {
+      mem->flags |= OS_MEMORY_HUGE_PAGES;
+    }
+  }
+#endif
+
+  // Fall back to regular pages if no huge pages are reserved.
+  if (base == MAP_FAILED) {
+    mem->size = _os_round_up(size, page);
+    if ((base = mmap(NULL, mem->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0)) == MAP_FAILED) {
+      mem->size = 0;
+      return -1;
+    }
+#ifdef MADV_HUGEPAGE
+    if (flags & OS_MEMORY_HUGE_PAGES) {
+      madvise(base, mem->size, MADV_HUGEPAGE);
+    }
+#endif
+  }
+
+  mem->base = (uint8_t *)base;
+
+  if ((flags & OS_MEMORY_LOCK) && mlock(base, mem->size) == 0) {
+    mem->flags |= OS_MEMORY_LOCK;
+  }
+
+  if (flags & OS_MEMORY_PREFAULT) {
+    for (i = 0; i < mem->size; i += page) {
+      mem->base[i] = 0;
+    }
+    mem->flags |= OS_MEMORY_PREFAULT;
+  }
+
+  return 0;
+}
+
+/*
+ * Hands the whole pages in the range back to the OS, they read as zero when
+ * touched again. Locked or prefaulted memory is left resident.
+ */
+void os_discard_memory(OS_MEMORY *mem, size_t offset, size_t size) {
+  size_t page = (mem->flags & OS_MEMORY_HUGE_PAGES) ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+  size_t start = _os_round_up(offset, page);
+  size_t end = (offset + size) & ~(page - 1);
+
+  if ((mem->flags & (OS_MEMORY_LOCK | OS_MEMORY_PREFAULT)) || end <= start) {
+    return;
+  }
+
+  madvise(mem->base + start, end - start, MADV_DONTNEED);
+}
+
+void os_unmap_memory(OS_MEMORY *mem) {
+  if (mem->base != NULL) {
+    munmap(mem->base, mem->size);
+  }
+
+  mem->base = NULL;
+  mem->size = 0;
+  mem->flags = 0;
+}
+
+/*
+ * Creates the named shared memory object and maps it. Fails if the name is
+ * already in use, a live consumer may still have it mapped. The memory starts
+ * zeroed.
+ */
+int os_create_shared_memory(OS_SHARED_MEMORY *shm, const char *name, size_t size) {
+  void *base;
+  int fd;
+
+  shm->base = NULL;
+  shm->size = 0;
+  shm->owner = false;
+
+  if (strlen(name) >= sizeof(shm->name)) {
+    return -1;
+  }
+
+  if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+    return -1;
+  }
+
+  if (ftruncate(fd, (off_t)size) != 0) {
+    close(fd);
+    shm_unlink(name);
+    return -1;
+  }
+
+  base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (base == MAP_FAILED) {
+    shm_unlink(name);
+    return -1;
+  }
+
+  shm->base = (uint8_t *)base;
+  shm->size = size;
+  shm->owner = true;
+  strcpy(shm->name, name);
+
+  return 0;
+}
+
+// Maps a shared memory object another process created, all of it.
+int os_open_shared_memory(OS_SHARED_MEMORY *shm, const char *name) {
+  struct stat st;
+  void *base;
+  int fd;
+
+  shm->base = NULL;
+  shm->size = 0;
+  shm->owner = false;
+
+  if (strlen(name) >= sizeof(shm->name)) {
+    return -1;
+  }
+
+  if ((fd = shm_open(name, O_RDWR, 0)) < 0) {
+    return -1;
+  }
+
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return -1;
+  }
+
+  base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (base == MAP_FAILED) {
+    return -1;
+  }
+
+  shm->base = (uint8_t *)base;
+  shm->size = (size_t)st.st_size;
+  strcpy(shm->name, name);
+
+  return 0;
+}
+
+void os_close_shared_memory(OS_SHARED_MEMORY *shm) {
+  if (shm->base != NULL) {
+    munmap(shm->base, shm->size);
+  }
+
+  if (shm->owner) {
+    shm_unlink(shm->name);
+  }
+
+  shm->base = NULL;
+  shm->size = 0;
+  shm->owner = false;
+}
+
+/*
+ * Sleeps while the word in shared memory still holds value, until another
+ * process calls os_shared_wake() on it or the timeout passes. Spurious
+ * returns are possible, callers check their condition again.
+ */
+void os_shared_wait(OS_SHARED_MEMORY *shm, OS_ATOMIC_INT *word, int32_t value, int ms_timeout) {
+#ifdef __linux__
+  struct timespec ts;
+#endif
+
+  (void)shm;
+
+#ifdef __linux__
+  ts.tv_sec = ms_timeout / 1000;
+  ts.tv_nsec = (long)(ms_timeout % 1000) * 1000000;
+
+  // Not FUTEX_PRIVATE_FLAG, the word is mapped by other processes.
+  syscall(SYS_futex, (int32_t *)word, FUTEX_WAIT, value, &ts, NULL, 0);
+#else
+  // No process shared futex here, poll instead.
+  while (ms_timeout > 0 && os_atomic_load(word) == value) {
+    sleep_ms(1);
+    ms_timeout--;
+  }
+#endif
+}
+
+void os_shared_wake(OS_SHARED_MEMORY *shm, OS_ATOMIC_INT *word) {
+  (void)shm;
+
+#ifdef __linux__
+  syscall(SYS_futex, (int32_t *)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+  (void)word;
+#endif
+}
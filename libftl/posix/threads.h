@@ -23,6 +23,7 @@
 **/
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -48,6 +49,48 @@ typedef struct {
   unsigned int value;
 }OS_SEMAPHORE;
 
+// Kept by a thread that sleeps often, see os_sleep_until_ns().
+typedef int OS_TIMER;
+
+// Lock free primitives. Loads acquire, stores release and read-modify-write
+// operations are full barriers.
+typedef volatile int32_t OS_ATOMIC_INT;
+
+#define os_atomic_load(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define os_atomic_store(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define os_atomic_add(ptr, val) __atomic_add_fetch((ptr), (val), __ATOMIC_SEQ_CST)
+#define os_atomic_exchange(ptr, val) __atomic_exchange_n((ptr), (val), __ATOMIC_SEQ_CST)
+#define os_atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define os_atomic_load_ptr(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define os_atomic_store_ptr(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_SEQ_CST)
+
+// 64 bit counters, for byte totals that can pass 2GB.
+typedef volatile int64_t OS_ATOMIC_INT64;
+
+#define os_atomic_load64(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define os_atomic_add64(ptr, val) __atomic_add_fetch((ptr), (val), __ATOMIC_SEQ_CST)
+
+// Backing memory for long lived buffers, see os_map_memory().
+#define OS_MEMORY_LOCK 0x1
+#define OS_MEMORY_PREFAULT 0x2
+#define OS_MEMORY_HUGE_PAGES 0x4
+
+typedef struct {
+  uint8_t *base;
+  size_t size;
+  int flags; //the OS_MEMORY_* flags that took effect
+} OS_MEMORY;
+
+// Memory mapped by more than one process, see os_create_shared_memory().
+#define OS_SHARED_MEMORY_NAME_LEN 64
+
+typedef struct {
+  uint8_t *base;
+  size_t size;
+  BOOL owner; //the name is removed when the creator closes it
+  char name[OS_SHARED_MEMORY_NAME_LEN];
+} OS_SHARED_MEMORY;
+
 int os_init();
 
 int os_create_thread(OS_THREAD_HANDLE *handle, OS_THREAD_ATTRIBS *attibs, OS_THREAD_START_ROUTINE func, void *args);
@@ -65,6 +108,20 @@ int os_semaphore_pend(OS_SEMAPHORE *sem, int ms_timeout);
 int os_semaphore_post(OS_SEMAPHORE *sem);
 int os_semaphore_delete(OS_SEMAPHORE *sem);
 
+int os_map_memory(OS_MEMORY *mem, size_t size, int flags);
+void os_discard_memory(OS_MEMORY *mem, size_t offset, size_t size);
+void os_unmap_memory(OS_MEMORY *mem);
+
+int os_create_shared_memory(OS_SHARED_MEMORY *shm, const char *name, size_t size);
+int os_open_shared_memory(OS_SHARED_MEMORY *shm, const char *name);
+void os_close_shared_memory(OS_SHARED_MEMORY *shm);
+void os_shared_wait(OS_SHARED_MEMORY *shm, OS_ATOMIC_INT *word, int32_t value, int ms_timeout);
+void os_shared_wake(OS_SHARED_MEMORY *shm, OS_ATOMIC_INT *word);
+
 void sleep_ms(int ms);
+int64_t os_monotonic_ns();
+int os_create_timer(OS_TIMER *timer);
+void os_delete_timer(OS_TIMER *timer);
+void os_sleep_until_ns(OS_TIMER *timer, int64_t deadline_ns);
 
 
@@ -0,0 +1,239 @@
+#define __FTL_INTERNAL
+#include "ftl.h"
+#include "ftl_private.h"
+#include "shm_ring.h"
+
+// How long the reader sleeps on the doorbell before checking for detach.
+#define SHM_INPUT_WAIT_MS 100
+
+struct _shm_input_t {
+  ftl_stream_configuration_private_t *ftl;
+  OS_SHARED_MEMORY shm;
+  shm_ring_header_t *ring;
+  uint32_t slot_count; //copied from the header, which the producer could change
+  uint32_t slot_size;
+  uint32_t read; //next unit to packetize, only touched by the reader thread
+  uint32_t tail; //our copy of ring->tail
+  uint8_t *released; //per slot, set once its packets are no longer needed
+  OS_MUTEX mutex; //protects tail, released and detached
+  OS_THREAD_HANDLE thread;
+  OS_ATOMIC_INT stop;
+  BOOL detached;
+};
+
+static OS_THREAD_ROUTINE _shm_input_thread(void *data);
+static void _shm_input_send(shm_input_t *input, uint32_t n);
+static void _shm_input_release(void *context, const uint8_t *data);
+static void _shm_input_free(shm_input_t *input);
+
+/*
+ * Maps the ring an encoder process created with ftl_shm_producer_create and
+ * starts reading it. Units published before this are skipped.
+ */
+ftl_status_t shm_input_attach(ftl_stream_configuration_private_t *ftl, const char *name) {
+  ftl_status_t status = FTL_SUCCESS;
+  shm_input_t *input = NULL;
+  OS_SHARED_MEMORY shm;
+  shm_ring_header_t *ring;
+  uint32_t slot_count, slot_size;
+
+  do {
+    if (ftl->shm_input != NULL) {
+      status = FTL_ALREADY_CONNECTED;
+      break;
+    }
+
+    if (os_open_shared_memory(&shm, name) != 0) {
+      FTL_LOG(ftl, FTL_LOG_ERROR, "Failed to open shared memory ring %s\n", name);
+      status = FTL_CONFIG_ERROR;
+      break;
+    }
+
+    ring = (shm_ring_header_t *)shm.base;
+
+    if (shm.size < sizeof(shm_ring_header_t) || ring->magic != SHM_RING_MAGIC) {
+      FTL_LOG(ftl, FTL_LOG_ERROR, "%s is not a ready shared memory ring\n", name);
+      os_close_shared_memory(&shm);
+      status = FTL_CONFIG_ERROR;
+      break;
+    }
+
+    os_atomic_fence();
+    slot_count = ring->slot_count;
+    slot_size = ring->slot_size;
+
+    if (ring->version != SHM_RING_VERSION || slot_count < 2 || slot_count > SHM_RING_MAX_SLOTS || (slot_count & (slot_count - 1)) != 0 ||
+        slot_size <= sizeof(shm_ring_unit_t) || slot_size % SHM_RING_ALIGN != 0 ||
+        sizeof(shm_ring_header_t) + (size_t)slot_count * slot_size > shm.size) {
+      FTL_LOG(ftl, FTL_LOG_ERROR, "Shared memory ring %s has an unsupported layout\n", name);
+      os_close_shared_memory(&shm);
+      status = FTL_CONFIG_ERROR;
+      break;
+    }
+
+    if ((input = ftl_malloc(ftl, sizeof(shm_input_t) + slot_count, FTL_ALLOC_HANDLE)) == NULL) {
+      os_close_shared_memory(&shm);
+      status = FTL_MALLOC_FAILURE;
+      break;
+    }
+
+    memset(input, 0, sizeof(shm_input_t) + slot_count);
+    input->ftl = ftl;
+    input->shm = shm;
+    input->ring = ring;
+    input->slot_count = slot_count;
+    input->slot_size = slot_size;
+    input->released = (uint8_t *)(input + 1);
+    input->read = input->tail = (uint32_t)os_atomic_load(&ring->head);
+    os_atomic_store(&ring->tail, (int32_t)input->tail);
+    os_init_mutex(&input->mutex);
+
+    if (os_create_thread(&input->thread, NULL, _shm_input_thread, input) != 0) {
+      os_delete_mutex(&input->mutex);
+      _shm_input_free(input);
+      status = FTL_INTERNAL_ERROR;
+      break;
+    }
+
+    ftl->shm_input = input;
+
+    FTL_LOG(ftl, FTL_LOG_INFO, "Reading shared memory ring %s: %u slots of %u bytes\n", name, slot_count, slot_size);
+  } while (0);
+
+  return status;
+}
+
+/*
+ * Stops reading the ring. Packets already queued keep pointing into it, so it
+ * stays mapped until the last of them is released.
+ */
+ftl_status_t shm_input_detach(ftl_stream_configuration_private_t *ftl) {
+  shm_input_t *input = ftl->shm_input;
+  BOOL done;
+
+  if (input == NULL) {
+    return FTL_NOT_CONNECTED;
+  }
+
+  ftl->shm_input = NULL;
+
+  os_atomic_store(&input->stop, 1);
+  os_atomic_add(&input->ring->doorbell, 1);
+  os_shared_wake(&input->shm, &input->ring->doorbell);
+  os_wait_thread(input->thread);
+  os_destroy_thread(input->thread);
+
+  os_lock_mutex(&input->mutex);
+  input->detached = TRUE;
+  done = (input->tail == input->read);
+  os_unlock_mutex(&input->mutex);
+
+  if (done) {
+    os_delete_mutex(&input->mutex);
+    _shm_input_free(input);
+  }
+
+  return FTL_SUCCESS;
+}
+
+static OS_THREAD_ROUTINE _shm_input_thread(void *data) {
+  shm_input_t *input = (shm_input_t *)data;
+  shm_ring_header_t *ring = input->ring;
+  uint32_t head;
+  int32_t bell;
+
+  while (!os_atomic_load(&input->stop)) {
+    head = (uint32_t)os_atomic_load(&ring->head);
+
+    if (head == input->read) {
+      // Same handshake as the producer: flag that we sleep, then look again.
+      os_atomic_store(&ring->consumer_waiting, 1);
+      os_atomic_fence();
+      bell = os_atomic_load(&ring->doorbell);
+
+      if ((uint32_t)os_atomic_load(&ring->head) == input->read && !os_atomic_load(&input->stop)) {
+        os_shared_wait(&input->shm, &ring->doorbell, bell, SHM_INPUT_WAIT_MS);
+      }
+
+      os_atomic_store(&ring->consumer_waiting, 0);
+      continue;
+    }
+
+    if (head - input->read > input->slot_count) {
+      FTL_LOG(input->ftl, FTL_LOG_ERROR, "Shared memory ring producer overran the ring, stopped reading it\n");
+      break;
+    }
+
+    while (input->read != head) {
+      _shm_input_send(input, input->read++);
+    }
+  }
+
+  return (OS_THREAD_TYPE)0;
+}
+
+/*
+ * Video is queued by reference so the packets are built straight from the
+ * ring, audio is small and copied.
+ */
+static void _shm_input_send(shm_input_t *input, uint32_t n) {
+  ftl_stream_configuration_private_t *ftl = input->ftl;
+  shm_ring_unit_t *unit = SHM_RING_SLOT(input->ring, input->slot_count, input->slot_size, n);
+  uint8_t *data = (uint8_t *)(unit + 1);
+  int64_t dts_usec = unit->dts_usec;
+  int32_t media_type = unit->media_type;
+  int32_t len = unit->len;
+  int end_of_frame = unit->end_of_frame;
+
+  if (len <= 0 || (size_t)len > input->slot_size - sizeof(shm_ring_unit_t)) {
+    FTL_LOG(ftl, FTL_LOG_WARN, "Dropping shared memory unit with invalid length %d\n", len);
+  }
+  else if (media_type == FTL_VIDEO_DATA && ftl->video.codec == FTL_VIDEO_H264_AVCC) {
+    avcc_send_video(ftl, dts_usec, data, len);
+  }
+  else if (media_type == FTL_VIDEO_DATA) {
+    // Calls _shm_input_release once the packets are done with.
+    media_send_video_zero_copy(ftl, dts_usec, data, len, end_of_frame, _shm_input_release, input);
+    return;
+  }
+  else if (media_type == FTL_AUDIO_DATA) {
+    media_send_audio(ftl, dts_usec, data, len);
+  }
+
+  _shm_input_release(input, data);
+}
+
+/*
+ * Marks the unit's slot free and hands the ring every slot up to the first one
+ * still in use. Units are released out of order when video is held longer.
+ */
+static void _shm_input_release(void *context, const uint8_t *data) {
+  shm_input_t *input = (shm_input_t *)context;
+  const uint8_t *slots = input->shm.base + sizeof(shm_ring_header_t);
+  uint32_t mask = input->slot_count - 1;
+  uint32_t slot = (uint32_t)((data - sizeof(shm_ring_unit_t) - slots) / input->slot_size);
+  BOOL done;
+
+  os_lock_mutex(&input->mutex);
+
+  input->released[slot] = 1;
+  while (input->released[input->tail & mask]) {
+    input->released[input->tail & mask] = 0;
+    input->tail++;
+  }
+  os_atomic_store(&input->ring->tail, (int32_t)input->tail);
+
+  done = (input->detached && input->tail == input->read);
+
+  os_unlock_mutex(&input->mutex);
+
+  if (done) {
+    os_delete_mutex(&input->mutex);
+    _shm_input_free(input);
+  }
+}
+
+static void _shm_input_free(shm_input_t *input) {
+  os_close_shared_memory(&input->shm);
+  ftl_free(input);
+}
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ftl_shm.h"
+#include "threads.h"
+#include "shm_ring.h"
+
+struct ftl_shm_producer {
+  OS_SHARED_MEMORY shm;
+  shm_ring_header_t *ring;
+  uint32_t slot_count;
+  uint32_t slot_size;
+  uint32_t head; //our copy of ring->head
+};
+
+ftl_shm_producer_t *ftl_shm_producer_create(const char *name, int slot_count, int32_t max_unit_size) {
+  ftl_shm_producer_t *producer;
+  size_t unit_size = sizeof(shm_ring_unit_t) + (size_t)max_unit_size;
+  shm_ring_header_t *ring;
+
+  if (name == NULL || slot_count < 2 || slot_count > SHM_RING_MAX_SLOTS || (slot_count & (slot_count - 1)) != 0 || max_unit_size <= 0) {
+    return NULL;
+  }
+
+  if ((producer = (ftl_shm_producer_t *)calloc(1, sizeof(ftl_shm_producer_t))) == NULL) {
+    return NULL;
+  }
+
+  producer->slot_count = (uint32_t)slot_count;
+  producer->slot_size = (uint32_t)((unit_size + SHM_RING_ALIGN - 1) & ~(size_t)(SHM_RING_ALIGN - 1));
+
+  if (os_create_shared_memory(&producer->shm, name, sizeof(shm_ring_header_t) + (size_t)producer->slot_count * producer->slot_size) != 0) {
+    free(producer);
+    return NULL;
+  }
+
+  ring = producer->ring = (shm_ring_header_t *)producer->shm.base;
+  ring->version = SHM_RING_VERSION;
+  ring->slot_count = producer->slot_count;
+  ring->slot_size = producer->slot_size;
+
+  // A consumer attaching now must not see the magic before the sizes.
+  os_atomic_fence();
+  ring->magic = SHM_RING_MAGIC;
+
+  return producer;
+}
+
+uint8_t *ftl_shm_producer_reserve(ftl_shm_producer_t *producer, int32_t len) {
+  shm_ring_unit_t *unit;
+
+  if (len <= 0 || (size_t)len > producer->slot_size - sizeof(shm_ring_unit_t)) {
+    return NULL;
+  }
+
+  if (producer->head - (uint32_t)os_atomic_load(&producer->ring->tail) >= producer->slot_count) {
+    return NULL;
+  }
+
+  unit = SHM_RING_SLOT(producer->ring, producer->slot_count, producer->slot_size, producer->head);
+
+  return (uint8_t *)(unit + 1);
+}
+
+int ftl_shm_producer_publish(ftl_shm_producer_t *producer, ftl_media_type_t media_type, int64_t dts_usec, int32_t len, int end_of_frame) {
+  shm_ring_header_t *ring = producer->ring;
+  shm_ring_unit_t *unit;
+
+  if (ftl_shm_producer_reserve(producer, len) == NULL) {
+    return -1;
+  }
+
+  unit = SHM_RING_SLOT(ring, producer->slot_count, producer->slot_size, producer->head);
+  unit->dts_usec = dts_usec;
+  unit->media_type = (int32_t)media_type;
+  unit->len = len;
+  unit->end_of_frame = end_of_frame;
+
+  os_atomic_store(&ring->head, (int32_t)++producer->head);
+
+  // Pairs with the consumer setting consumer_waiting before it checks head
+  // again, one of us sees the other.
+  os_atomic_fence();
+  if (os_atomic_load(&ring->consumer_waiting)) {
+    os_atomic_add(&ring->doorbell, 1);
+    os_shared_wake(&producer->shm, &ring->doorbell);
+  }
+
+  return 0;
+}
+
+void ftl_shm_producer_destroy(ftl_shm_producer_t *producer) {
+  if (producer == NULL) {
+    return;
+  }
+
+  os_close_shared_memory(&producer->shm);
+  free(producer);
+}
@@ -0,0 +1,50 @@
+#ifndef __SHM_RING_H
+#define __SHM_RING_H
+
+#include <stdint.h>
+
+/*
+ * Layout of the shared memory ring between an encoder process using
+ * ftl_shm_producer_* and libftl reading it after ftl_ingest_attach_shm.
+ *
+ * The header is followed by slot_count slots of slot_size bytes, each a
+ * shm_ring_unit_t and its data. The producer fills the slot at head and
+ * publishes it by moving head. The consumer moves tail once the packets
+ * pointing into a slot are no longer needed for retransmission, which may be
+ * well after it was read. Both counters wrap.
+ *
+ * Include threads.h first for OS_ATOMIC_INT.
+ */
+#define SHM_RING_MAGIC 0x46544c52 //"FTLR"
+#define SHM_RING_VERSION 1
+#define SHM_RING_ALIGN 64 //slots and the counters below start on their own cache line
+#define SHM_RING_MAX_SLOTS 65536
+
+typedef struct {
+  int64_t dts_usec;
+  int32_t media_type; //ftl_media_type_t
+  int32_t len;
+  int32_t end_of_frame;
+  int32_t reserved;
+} shm_ring_unit_t;
+
+typedef struct {
+  uint32_t magic; //written last, once the rest of the header is set
+  uint32_t version;
+  uint32_t slot_count; //a power of two
+  uint32_t slot_size; //a multiple of SHM_RING_ALIGN, including the shm_ring_unit_t
+  uint8_t pad0[SHM_RING_ALIGN - 4 * sizeof(uint32_t)];
+  // Written by the producer.
+  OS_ATOMIC_INT head; //units published
+  OS_ATOMIC_INT doorbell; //bumped to wake the consumer
+  uint8_t pad1[SHM_RING_ALIGN - 2 * sizeof(OS_ATOMIC_INT)];
+  // Written by the consumer.
+  OS_ATOMIC_INT tail; //units whose slots can be reused
+  OS_ATOMIC_INT consumer_waiting; //set while the consumer sleeps on the doorbell
+  uint8_t pad2[SHM_RING_ALIGN - 2 * sizeof(OS_ATOMIC_INT)];
+} shm_ring_header_t;
+
+#define SHM_RING_SLOT(base, slot_count, slot_size, n) \
+  ((shm_ring_unit_t *)((uint8_t *)(base) + sizeof(shm_ring_header_t) + (size_t)((uint32_t)(n) & ((slot_count) - 1)) * (slot_size)))
+
+#endif
@@ -109,4 +109,55 @@ int poll_socket_for_receive(SOCKET socket, int timeoutMs)
   {
     return SOCKET_ERROR;
   }
-}
\ No newline at end of file
+}
+
+int send_socket_batch(SOCKET sock, socket_packet_t *pkts, int count, const struct sockaddr *addr, int addrlen)
+{
+  // Winsock has no sendmmsg() equivalent for unconnected UDP sockets, so this
+  // just loops. Returns the number of packets sent, or SOCKET_ERROR if none were.
+  int sent = 0;
+  WSABUF bufs[2];
+  DWORD bytes;
+
+  while (sent < count) {
+    bufs[0].buf = (char *)pkts[sent].buf;
+    bufs[0].len = pkts[sent].len - pkts[sent].ext_len;
+    bufs[1].buf = (char *)pkts[sent].ext;
+    bufs[1].len = pkts[sent].ext_len;
+
+    if (WSASendTo(sock, bufs, (pkts[sent].ext_len > 0) ? 2 : 1, &bytes, 0, addr, addrlen, NULL, NULL) == SOCKET_ERROR) {
+      break;
+    }
+    sent++;
+  }
+
+  return (sent == 0 && count > 0) ? SOCKET_ERROR : sent;
+}
+
+int get_socket_gso_supported(SOCKET sock)
+{
+  return 0;
+}
+
+int send_socket_gso(SOCKET sock, socket_packet_t *pkts, int count, int segment_size, const struct sockaddr *addr, int addrlen)
+{
+  WSASetLastError(WSAEOPNOTSUPP);
+  return SOCKET_ERROR;
+}
+
+int get_socket_gso_unsupported_error()
+{
+  return WSAGetLastError() == WSAEOPNOTSUPP;
+}
+
+int set_socket_max_pacing_rate(SOCKET sock, int64_t bytes_per_sec)
+{
+  WSASetLastError(WSAEOPNOTSUPP);
+  return SOCKET_ERROR;
+}
+
+int set_socket_txtime(SOCKET sock)
+{
+  WSASetLastError(WSAEOPNOTSUPP);
+  return SOCKET_ERROR;
+}
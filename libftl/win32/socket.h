@@ -9,3 +9,20 @@ int set_socket_send_buf(SOCKET socket, int buffer_space);
 int poll_socket_for_receive(SOCKET socket, int ms_timeout);
 int get_socket_bytes_available(SOCKET socket, unsigned long *bytes_available);
 int shutdown_socket(SOCKET sock, int how);
+
+// len counts the whole packet, the last ext_len bytes of which are read from
+// ext rather than buf.
+typedef struct {
+  uint8_t *buf;
+  int len;
+  const uint8_t *ext;
+  int ext_len;
+  int64_t txtime_ns; //SO_TXTIME departure time on the os_monotonic_ns() clock, 0 to send now
+} socket_packet_t;
+
+int send_socket_batch(SOCKET sock, socket_packet_t *pkts, int count, const struct sockaddr *addr, int addrlen);
+int get_socket_gso_supported(SOCKET sock);
+int send_socket_gso(SOCKET sock, socket_packet_t *pkts, int count, int segment_size, const struct sockaddr *addr, int addrlen);
+int get_socket_gso_unsupported_error();
+int set_socket_max_pacing_rate(SOCKET sock, int64_t bytes_per_sec);
+int set_socket_txtime(SOCKET sock);
@@ -23,6 +23,8 @@
 **/
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include "threads.h"
 
 int os_init(){
@@ -89,7 +91,7 @@ int os_delete_mutex(OS_MUTEX *mutex) {
 
 int os_semaphore_create(OS_SEMAPHORE *sem, const char *name, int oflag, unsigned int value) {
 
-  char *internal_name = NULL;
+  char internal_name[128];
   int retval = 0;
 
   do {
@@ -99,15 +101,12 @@ int os_semaphore_create(OS_SEMAPHORE *sem, const char *name, int oflag, unsigned
     }
 
     //if the semaphore is intended to only be used by the same process and not across processes, give it unique name
-    size_t name_len = strlen(name);
-    size_t max_name = name_len + 20;
-
-    if ((internal_name = (char*)malloc(max_name * sizeof(char))) == NULL) {
+    if (strlen(name) + 20 > sizeof(internal_name)) {
       retval = -2;
       break;
     }
 
-    sprintf_s(internal_name, max_name, "%s_%d", name, (unsigned int)rand());
+    sprintf_s(internal_name, sizeof(internal_name), "%s_%d", name, (unsigned int)rand());
 
     if ( (*sem = CreateSemaphoreA(NULL, value, MAX_SEM_COUNT, (LPCSTR)internal_name)) == NULL){
       retval = -3;
@@ -115,10 +114,6 @@ int os_semaphore_create(OS_SEMAPHORE *sem, const char *name, int oflag, unsigned
     }
   }while(0);
 
-  if(internal_name != NULL){
-    free(internal_name);
-  }
-
   return retval;
 }
 
@@ -152,4 +147,249 @@ void sleep_ms(int ms)
         Sleep(ms);
 }
 
+int64_t os_monotonic_ns() {
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if (freq.QuadPart == 0) {
+    QueryPerformanceFrequency(&freq);
+  }
+
+  QueryPerformanceCounter(&now);
+
+  return (int64_t)(now.QuadPart / freq.QuadPart) * 1000000000 + (int64_t)(now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+}
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x2
+#endif
+
+/*
+ * High resolution waitable timers (Windows 10 1803 and later) wake within a
+ * fraction of a millisecond. Returns -1 if there isn't one, the timer is then
+ * NULL and os_sleep_until_ns() falls back to Sleep().
+ */
+int os_create_timer(OS_TIMER *timer) {
+  *timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+
+  return (*timer != NULL) ? 0 : -1;
+}
+
+void os_delete_timer(OS_TIMER *timer) {
+  if (*timer != NULL) {
+    CloseHandle(*timer);
+    *timer = NULL;
+  }
+}
+
+/*
+ * Sleeps until os_monotonic_ns() reaches deadline_ns. Waitable timers only
+ * take relative or wall clock times so the deadline is converted first.
+ */
+void os_sleep_until_ns(OS_TIMER *timer, int64_t deadline_ns) {
+  int64_t wait_ns = deadline_ns - os_monotonic_ns();
+  LARGE_INTEGER due;
+
+  if (wait_ns <= 0) {
+    return;
+  }
+
+  due.QuadPart = -(wait_ns / 100); //relative, in 100ns units
+  if (*timer == NULL || !SetWaitableTimer(*timer, &due, 0, NULL, NULL, FALSE)) {
+    Sleep((DWORD)((wait_ns + 999999) / 1000000));
+    return;
+  }
+
+  WaitForSingleObject(*timer, INFINITE);
+}
+
+static size_t _os_round_up(size_t size, size_t align) {
+  return (size + align - 1) & ~(align - 1);
+}
+
+/*
+ * Maps size bytes of zeroed memory. Large pages, locking and prefaulting are
+ * best effort, mem->flags says which of them took effect.
+ */
+int os_map_memory(OS_MEMORY *mem, size_t size, int flags) {
+  SYSTEM_INFO info;
+  SIZE_T large_page = GetLargePageMinimum();
+  void *base = NULL;
+  size_t i;
+
+  GetSystemInfo(&info);
+
+  mem->base = NULL;
+  mem->size = 0;
+  mem->flags = 0;
+
+  // Large pages need SeLockMemoryPrivilege and are never paged out.
+  if ((flags & OS_MEMORY_HUGE_PAGES) && large_page > 0) {
+    mem->size = _os_round_up(size, large_page);
+    if ((base = VirtualAlloc(NULL, mem->size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE)) != NULL) {
+      mem->flags |= OS_MEMORY_HUGE_PAGES | OS_MEMORY_LOCK;
+    }
+  }
+
+  if (base == NULL) {
+    mem->size = _os_round_up(size, info.dwPageSize);
+    if ((base = VirtualAlloc(NULL, mem->size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)) == NULL) {
+      mem->size = 0;
+      return -1;
+    }
+
+    if ((flags & OS_MEMORY_LOCK) && VirtualLock(base, mem->size)) {
+      mem->flags |= OS_MEMORY_LOCK;
+    }
+  }
+
+  mem->base = (uint8_t *)base;
+
+  if (flags & OS_MEMORY_PREFAULT) {
+    for (i = 0; i < mem->size; i += info.dwPageSize) {
+      mem->base[i] = 0;
+    }
+    mem->flags |= OS_MEMORY_PREFAULT;
+  }
+
+  return 0;
+}
+
+/*
+ * Lets the OS drop the whole pages in the range instead of paging them out.
+ * Locked or prefaulted memory is left resident.
+ */
+void os_discard_memory(OS_MEMORY *mem, size_t offset, size_t size) {
+  SYSTEM_INFO info;
+  size_t start, end;
+
+  if (mem->flags & (OS_MEMORY_LOCK | OS_MEMORY_PREFAULT)) {
+    return;
+  }
+
+  GetSystemInfo(&info);
+  start = _os_round_up(offset, info.dwPageSize);
+  end = (offset + size) & ~((size_t)info.dwPageSize - 1);
+
+  if (end > start) {
+    VirtualAlloc(mem->base + start, end - start, MEM_RESET, PAGE_READWRITE);
+  }
+}
+
+void os_unmap_memory(OS_MEMORY *mem) {
+  if (mem->base != NULL) {
+    VirtualFree(mem->base, 0, MEM_RELEASE);
+  }
+
+  mem->base = NULL;
+  mem->size = 0;
+  mem->flags = 0;
+}
+
+static void _os_doorbell_name(char *out, size_t out_len, const char *name) {
+  snprintf(out, out_len, "%s_doorbell", name);
+}
+
+// Creates the named file mapping backed by the page file and maps it. Fails
+// if the name is already in use.
+int os_create_shared_memory(OS_SHARED_MEMORY *shm, const char *name, size_t size) {
+  char event_name[OS_SHARED_MEMORY_NAME_LEN + 16];
+
+  shm->base = NULL;
+  shm->size = 0;
+  shm->event = NULL;
+
+  if (strlen(name) >= OS_SHARED_MEMORY_NAME_LEN) {
+    return -1;
+  }
+
+  if ((shm->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, name)) == NULL) {
+    return -1;
+  }
+
+  // An existing mapping is opened instead, someone else still holds it.
+  if (GetLastError() == ERROR_ALREADY_EXISTS) {
+    CloseHandle(shm->mapping);
+    shm->mapping = NULL;
+    return -1;
+  }
+
+  _os_doorbell_name(event_name, sizeof(event_name), name);
+
+  if ((shm->base = (uint8_t *)MapViewOfFile(shm->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size)) == NULL ||
+      (shm->event = CreateEventA(NULL, FALSE, FALSE, event_name)) == NULL) {
+    os_close_shared_memory(shm);
+    return -1;
+  }
+
+  shm->size = size;
+
+  return 0;
+}
+
+// Maps a file mapping another process created, all of it.
+int os_open_shared_memory(OS_SHARED_MEMORY *shm, const char *name) {
+  char event_name[OS_SHARED_MEMORY_NAME_LEN + 16];
+  MEMORY_BASIC_INFORMATION info;
+
+  shm->base = NULL;
+  shm->size = 0;
+  shm->event = NULL;
+
+  if (strlen(name) >= OS_SHARED_MEMORY_NAME_LEN) {
+    return -1;
+  }
+
+  if ((shm->mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name)) == NULL) {
+    return -1;
+  }
+
+  _os_doorbell_name(event_name, sizeof(event_name), name);
+
+  if ((shm->base = (uint8_t *)MapViewOfFile(shm->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0)) == NULL ||
+      VirtualQuery(shm->base, &info, sizeof(info)) == 0 ||
+      (shm->event = OpenEventA(SYNCHRONIZE | EVENT_MODIFY_STATE, FALSE, event_name)) == NULL) {
+    os_close_shared_memory(shm);
+    return -1;
+  }
+
+  shm->size = info.RegionSize;
+
+  return 0;
+}
+
+void os_close_shared_memory(OS_SHARED_MEMORY *shm) {
+  if (shm->base != NULL) {
+    UnmapViewOfFile(shm->base);
+  }
+
+  if (shm->event != NULL) {
+    CloseHandle(shm->event);
+  }
+
+  if (shm->mapping != NULL) {
+    CloseHandle(shm->mapping);
+  }
+
+  shm->base = NULL;
+  shm->size = 0;
+  shm->mapping = NULL;
+  shm->event = NULL;
+}
+
+/*
+ * Sleeps while the word in shared memory still holds value, until another
+ * process calls os_shared_wake() or the timeout passes. Spurious returns are
+ * possible, callers check their condition again.
+ */
+void os_shared_wait(OS_SHARED_MEMORY *shm, OS_ATOMIC_INT *word, int32_t value, int ms_timeout) {
+  if (os_atomic_load(word) == value) {
+    WaitForSingleObject(shm->event, ms_timeout);
+  }
+}
+
+void os_shared_wake(OS_SHARED_MEMORY *shm, OS_ATOMIC_INT *word) {
+  (void)word;
 
+  SetEvent(shm->event);
+}
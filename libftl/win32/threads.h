@@ -24,6 +24,7 @@
 
 #include <Windows.h>
 #include <stdio.h>
+#include <stdint.h>
 
 typedef CRITICAL_SECTION OS_MUTEX;
 
@@ -40,6 +41,48 @@ typedef void OS_THREAD_ATTRIBS; //todo implement attributes
 
 #define OS_FOREVER INFINITE
 
+// Kept by a thread that sleeps often, see os_sleep_until_ns().
+typedef HANDLE OS_TIMER;
+
+// Lock free primitives. Loads acquire, stores release and read-modify-write
+// operations are full barriers.
+typedef volatile LONG OS_ATOMIC_INT;
+
+#define os_atomic_load(ptr) InterlockedCompareExchange((ptr), 0, 0)
+#define os_atomic_store(ptr, val) InterlockedExchange((ptr), (val))
+#define os_atomic_add(ptr, val) InterlockedAdd((ptr), (val))
+#define os_atomic_exchange(ptr, val) InterlockedExchange((ptr), (val))
+#define os_atomic_fence() MemoryBarrier()
+#define os_atomic_load_ptr(ptr) InterlockedCompareExchangePointer((PVOID volatile *)(ptr), NULL, NULL)
+#define os_atomic_store_ptr(ptr, val) InterlockedExchangePointer((PVOID volatile *)(ptr), (val))
+
+// 64 bit counters, for byte totals that can pass 2GB.
+typedef volatile LONG64 OS_ATOMIC_INT64;
+
+#define os_atomic_load64(ptr) InterlockedCompareExchange64((ptr), 0, 0)
+#define os_atomic_add64(ptr, val) InterlockedAdd64((ptr), (val))
+
+// Backing memory for long lived buffers, see os_map_memory().
+#define OS_MEMORY_LOCK 0x1
+#define OS_MEMORY_PREFAULT 0x2
+#define OS_MEMORY_HUGE_PAGES 0x4
+
+typedef struct {
+  uint8_t *base;
+  size_t size;
+  int flags; //the OS_MEMORY_* flags that took effect
+} OS_MEMORY;
+
+// Memory mapped by more than one process, see os_create_shared_memory().
+#define OS_SHARED_MEMORY_NAME_LEN 64
+
+typedef struct {
+  uint8_t *base;
+  size_t size;
+  HANDLE mapping;
+  HANDLE event; //named auto reset event standing in for a futex
+} OS_SHARED_MEMORY;
+
 int os_init();
 
 int os_create_thread(OS_THREAD_HANDLE *handle, OS_THREAD_ATTRIBS *attibs, OS_THREAD_START_ROUTINE func, void *args);
@@ -57,4 +100,18 @@ int os_semaphore_pend(OS_SEMAPHORE *sem, int ms_timeout);
 int os_semaphore_post(OS_SEMAPHORE *sem);
 int os_semaphore_delete(OS_SEMAPHORE *sem);
 
+int os_map_memory(OS_MEMORY *mem, size_t size, int flags);
+void os_discard_memory(OS_MEMORY *mem, size_t offset, size_t size);
+void os_unmap_memory(OS_MEMORY *mem);
+
+int os_create_shared_memory(OS_SHARED_MEMORY *shm, const char *name, size_t size);
+int os_open_shared_memory(OS_SHARED_MEMORY *shm, const char *name);
+void os_close_shared_memory(OS_SHARED_MEMORY *shm);
+void os_shared_wait(OS_SHARED_MEMORY *shm, OS_ATOMIC_INT *word, int32_t value, int ms_timeout);
+void os_shared_wake(OS_SHARED_MEMORY *shm, OS_ATOMIC_INT *word);
+
 void sleep_ms(int ms);
+int64_t os_monotonic_ns();
+int os_create_timer(OS_TIMER *timer);
+void os_delete_timer(OS_TIMER *timer);
+void os_sleep_until_ns(OS_TIMER *timer, int64_t deadline_ns);